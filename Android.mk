@@ -36,6 +36,8 @@ LOCAL_SRC_FILES := \
     twrpTar.cpp \
 	twrpDU.cpp \
     twrpDigest.cpp \
+    twrpImage.cpp \
+    twrpWipe.cpp \
     find_file.cpp \
     infomanager.cpp
 
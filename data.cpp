@@ -35,6 +35,7 @@
 #include <string>
 #include <utility>
 #include <map>
+#include <vector>
 #include <fstream>
 #include <sstream>
 
@@ -66,10 +67,26 @@ extern "C"
 
 #define FILE_VERSION 0x00010001
 
+// Settings are written this long after the last persisted change,
+// but no later than SAVE_MAX_DELAY_MS after the first unsaved one
+#define SAVE_DELAY_MS 1000
+#define SAVE_MAX_DELAY_MS 5000
+
 using namespace std;
 
-map<string, DataManager::TStrIntPair>   DataManager::mValues;
-map<string, string>                     DataManager::mConstValues;
+map<string, int>                        DataManager::mHandles;
+vector<DataManager::TVariable*>         DataManager::mVars;
+pthread_rwlock_t                        DataManager::mLock = PTHREAD_RWLOCK_INITIALIZER;
+volatile unsigned int                   DataManager::mChangeCount = 0;
+pthread_mutex_t                         DataManager::mSaveLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t                          DataManager::mSaveCond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t                         DataManager::mWriteLock = PTHREAD_MUTEX_INITIALIZER;
+bool                                    DataManager::mSaveThreadStarted = false;
+bool                                    DataManager::mSaveScheduled = false;
+bool                                    DataManager::mSaveUnsaved = false;
+bool                                    DataManager::mSaveSkipLogged = false;
+struct timespec                         DataManager::mFirstChange;
+struct timespec                         DataManager::mLastChange;
 string                                  DataManager::mBackingFile;
 int                                     DataManager::mInitialized = 0;
 
@@ -127,7 +144,7 @@ void DataManager::get_device_id(void) {
 			strcat(device_id, hardware_id);
 		}
 		sanitize_device_id((char *)device_id);
-		mConstValues.insert(make_pair("device_id", device_id));
+		SetConstValue("device_id", device_id);
 		LOGINFO("=> using device id: '%s'\n", device_id);
 		return;
 	}
@@ -154,7 +171,7 @@ void DataManager::get_device_id(void) {
 				// We found the serial number!
 				strcpy(device_id, token + CMDLINE_SERIALNO_LEN);
 				sanitize_device_id((char *)device_id);
-				mConstValues.insert(make_pair("device_id", device_id));
+				SetConstValue("device_id", device_id);
 				return;
 			}
 			token = strtok(NULL, " ");
@@ -182,7 +199,7 @@ void DataManager::get_device_id(void) {
 					LOGINFO("=> serial from cpuinfo: '%s'\n", device_id);
 					fclose(fp);
 					sanitize_device_id((char *)device_id);
-					mConstValues.insert(make_pair("device_id", device_id));
+					SetConstValue("device_id", device_id);
 					return;
 				}
 			} else if (memcmp(line, CPUINFO_HARDWARE, CPUINFO_HARDWARE_LEN) == 0) {// We're also going to look for the hardware line in cpuinfo and save it for later in case we don't find the device ID
@@ -208,20 +225,31 @@ void DataManager::get_device_id(void) {
 		LOGINFO("\nusing hardware id for device id: '%s'\n", hardware_id);
 		strcpy(device_id, hardware_id);
 		sanitize_device_id((char *)device_id);
-		mConstValues.insert(make_pair("device_id", device_id));
+		SetConstValue("device_id", device_id);
 		return;
 	}
 
 	strcpy(device_id, "serialno");
 	LOGERR("=> device id not found, using '%s'.", device_id);
-	mConstValues.insert(make_pair("device_id", device_id));
+	SetConstValue("device_id", device_id);
 	return;
 }
 
 int DataManager::ResetDefaults()
 {
-	mValues.clear();
-	mConstValues.clear();
+	// Handles stay valid, only the values are dropped
+	pthread_rwlock_wrlock(&mLock);
+	for (size_t i = 0; i < mVars.size(); i++)
+	{
+		mVars[i]->defined = false;
+		mVars[i]->isConst = false;
+		mVars[i]->persist = 0;
+		mVars[i]->str.clear();
+		mVars[i]->ival = 0;
+		mVars[i]->fval = 0;
+		mVars[i]->ullval = 0;
+	}
+	pthread_rwlock_unlock(&mLock);
 	SetDefaultValues();
 	return 0;
 }
@@ -267,16 +295,18 @@ int DataManager::LoadValues(const string filename)
 		if (fread(array, 1, length, in) != length)										goto error;
 		Value = array;
 
-		map<string, TStrIntPair>::iterator pos;
-
-		pos = mValues.find(Name);
-		if (pos != mValues.end())
+		int handle = GetHandle(Name);
+		if (handle < 0)
+			continue;
+		pthread_rwlock_wrlock(&mLock);
+		TVariable* var = mVars[handle];
+		if (!var->isConst)
 		{
-			pos->second.first = Value;
-			pos->second.second = 1;
+			StoreString(var, Value);
+			var->defined = true;
+			var->persist = 1;
 		}
-		else
-			mValues.insert(TNameValuePair(Name, TStrIntPair(Value, 1)));
+		pthread_rwlock_unlock(&mLock);
 #ifndef TW_NO_SCREEN_TIMEOUT
 		if (Name == "tw_screen_timeout_secs")
 			blankTimer.setTime(atoi(Value.c_str()));
@@ -311,97 +341,386 @@ int DataManager::SaveValues()
 	string mount_path = GetSettingsStoragePath();
 	PartitionManager.Mount_By_Path(mount_path.c_str(), 1);
 
-	FILE* out = fopen(mBackingFile.c_str(), "wb");
-	if (!out)
-		return -1;
+	return WriteValues();
+#endif // ifdef TW_OEM_BUILD
+	return 0;
+}
+
+// Writes the persisted values through a temporary file that is renamed over
+// the settings file, so an interrupted write never leaves a truncated file
+int DataManager::WriteValues()
+{
+	// Changes made from here on are saved by the next write
+	pthread_mutex_lock(&mSaveLock);
+	mSaveUnsaved = false;
+	pthread_mutex_unlock(&mSaveLock);
 
+	string data;
 	int file_version = FILE_VERSION;
-	fwrite(&file_version, 1, sizeof(int), out);
+	data.append((const char*) &file_version, sizeof(int));
 
-	map<string, TStrIntPair>::iterator iter;
-	for (iter = mValues.begin(); iter != mValues.end(); ++iter)
+	map<string, int>::iterator iter;
+	pthread_rwlock_rdlock(&mLock);
+	for (iter = mHandles.begin(); iter != mHandles.end(); ++iter)
 	{
-		// Save only the persisted data
-		if (iter->second.second != 0)
+		TVariable* var = mVars[iter->second];
+		if (var->defined && !var->isConst && var->persist != 0)
 		{
 			unsigned short length = (unsigned short) iter->first.length() + 1;
-			fwrite(&length, 1, sizeof(unsigned short), out);
-			fwrite(iter->first.c_str(), 1, length, out);
-			length = (unsigned short) iter->second.first.length() + 1;
-			fwrite(&length, 1, sizeof(unsigned short), out);
-			fwrite(iter->second.first.c_str(), 1, length, out);
+			data.append((const char*) &length, sizeof(unsigned short));
+			data.append(iter->first.c_str(), length);
+			length = (unsigned short) var->str.length() + 1;
+			data.append((const char*) &length, sizeof(unsigned short));
+			data.append(var->str.c_str(), length);
 		}
 	}
-	fclose(out);
-#endif // ifdef TW_OEM_BUILD
+	pthread_rwlock_unlock(&mLock);
+
+	pthread_mutex_lock(&mWriteLock);
+	string temp_file = mBackingFile + ".tmp";
+	bool ok = false;
+	FILE* out = fopen(temp_file.c_str(), "wb");
+	if (out)
+	{
+		ok = (fwrite(data.data(), 1, data.size(), out) == data.size());
+		ok = (fflush(out) == 0 && fsync(fileno(out)) == 0 && ok);
+		ok = (fclose(out) == 0 && ok);
+		if (ok)
+			ok = (rename(temp_file.c_str(), mBackingFile.c_str()) == 0);
+		if (!ok)
+			unlink(temp_file.c_str());
+	}
+	pthread_mutex_unlock(&mWriteLock);
+
+	if (ok)
+	{
+		pthread_mutex_lock(&mSaveLock);
+		mSaveSkipLogged = false;
+		pthread_mutex_unlock(&mSaveLock);
+	}
+	else
+	{
+		LOGINFO("Unable to save settings to '%s'.\n", mBackingFile.c_str());
+		pthread_mutex_lock(&mSaveLock);
+		mSaveUnsaved = true;
+		pthread_mutex_unlock(&mSaveLock);
+		return -1;
+	}
 	return 0;
 }
 
-int DataManager::GetValue(const string varName, string& value)
+static void AddMilliseconds(struct timespec* ts, int ms)
 {
-	string localStr = varName;
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
 
-	if (!mInitialized)
-		SetDefaultValues();
+static bool IsBefore(const struct timespec& a, const struct timespec& b)
+{
+	return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+// Persisted values are written by a background thread once they stop
+// changing, so dragging a slider costs one write instead of dozens
+void DataManager::ScheduleSave()
+{
+#ifdef TW_OEM_BUILD
+	return;
+#endif
+	if (mBackingFile.empty())
+		return;
 
-	// Strip off leading and trailing '%' if provided
-	if (localStr.length() > 2 && localStr[0] == '%' && localStr[localStr.length()-1] == '%')
+	bool started;
+	pthread_mutex_lock(&mSaveLock);
+	clock_gettime(CLOCK_REALTIME, &mLastChange);
+	if (!mSaveScheduled)
+		mFirstChange = mLastChange;
+	mSaveScheduled = true;
+	mSaveUnsaved = true;
+	if (!mSaveThreadStarted)
 	{
-		localStr.erase(0, 1);
-		localStr.erase(localStr.length() - 1, 1);
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		mSaveThreadStarted = (pthread_create(&thread, &attr, SaveThread, NULL) == 0);
+		pthread_attr_destroy(&attr);
 	}
+	started = mSaveThreadStarted;
+	pthread_cond_signal(&mSaveCond);
+	pthread_mutex_unlock(&mSaveLock);
 
-	// Handle magic values
-	if (GetMagicValue(localStr, value) == 0)
-		return 0;
-	map<string, string>::iterator constPos;
-	constPos = mConstValues.find(localStr);
-	if (constPos != mConstValues.end())
+	if (!started)
 	{
-		value = constPos->second;
-		return 0;
+		LOGINFO("Unable to start the settings thread, saving now.\n");
+		SaveValues();
 	}
+}
 
-	map<string, TStrIntPair>::iterator pos;
-	pos = mValues.find(localStr);
-	if (pos == mValues.end())
-		return -1;
+void* DataManager::SaveThread(void* cookie)
+{
+	pthread_mutex_lock(&mSaveLock);
+	while (true)
+	{
+		while (!mSaveScheduled)
+			pthread_cond_wait(&mSaveCond, &mSaveLock);
+
+		struct timespec now, deadline = mLastChange, max_deadline = mFirstChange;
+		AddMilliseconds(&deadline, SAVE_DELAY_MS);
+		AddMilliseconds(&max_deadline, SAVE_MAX_DELAY_MS);
+		if (IsBefore(max_deadline, deadline))
+			deadline = max_deadline;
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (IsBefore(now, deadline))
+		{
+			pthread_cond_timedwait(&mSaveCond, &mSaveLock, &deadline);
+			continue;
+		}
+		mSaveScheduled = false;
+		pthread_mutex_unlock(&mSaveLock);
 
-	value = pos->second.first;
-	return 0;
+		// Never mount from here. Values that could not be written stay unsaved until
+		// the next change, the next mount of a partition or FlushPending at reboot.
+		if (TWFunc::Path_Exists(TWFunc::Get_Path(mBackingFile)))
+			WriteValues();
+		else
+			LogSaveSkipped();
+
+		pthread_mutex_lock(&mSaveLock);
+	}
+	return NULL;
 }
 
-int DataManager::GetValue(const string varName, int& value)
+// Called before the settings storage may go away, e.g. at unmount or reboot.
+// With mount set an unmounted settings storage is mounted to write the values.
+void DataManager::FlushPending(bool mount)
 {
-	string data;
+#ifdef TW_OEM_BUILD
+	return;
+#endif
+	pthread_mutex_lock(&mSaveLock);
+	bool unsaved = mSaveUnsaved;
+	pthread_mutex_unlock(&mSaveLock);
+
+	if (!unsaved || mBackingFile.empty())
+		return;
+	if (TWFunc::Path_Exists(TWFunc::Get_Path(mBackingFile)))
+		WriteValues();
+	else if (mount)
+		SaveValues();
+	else
+		LogSaveSkipped();
+}
+
+// Logs a skipped write once until the values are written again
+void DataManager::LogSaveSkipped()
+{
+	pthread_mutex_lock(&mSaveLock);
+	bool logged = mSaveSkipLogged;
+	mSaveSkipLogged = true;
+	pthread_mutex_unlock(&mSaveLock);
+	if (!logged)
+		LOGINFO("Settings storage is not mounted, settings will be saved later.\n");
+}
+
+// Stores a value given as a string, parsing the native values once. Called with mLock held for writing.
+void DataManager::StoreString(TVariable* var, const string& value)
+{
+	var->str = value;
+	var->ival = atoi(value.c_str());
+	var->fval = atof(value.c_str());
+	var->ullval = strtoull(value.c_str(), NULL, 10);
+	mChangeCount++;
+}
+
+// Strips off leading and trailing '%' if provided
+static string StripPercent(const string& varName)
+{
+	if (varName.length() > 2 && varName[0] == '%' && varName[varName.length()-1] == '%')
+		return varName.substr(1, varName.length() - 2);
+	return varName;
+}
+
+static bool IsMagicName(const string& varName)
+{
+	return varName == "tw_time" || varName == "tw_cpu_temp" || varName == "tw_battery";
+}
 
-	if (GetValue(varName,data) != 0)
+int DataManager::GetHandle(const string varName)
+{
+	string localStr = StripPercent(varName);
+	if (localStr.empty())
 		return -1;
 
-	value = atoi(data.c_str());
-	return 0;
+	map<string, int>::iterator pos;
+	pthread_rwlock_rdlock(&mLock);
+	pos = mHandles.find(localStr);
+	int handle = (pos == mHandles.end() ? -1 : pos->second);
+	pthread_rwlock_unlock(&mLock);
+	if (handle >= 0)
+		return handle;
+
+	pthread_rwlock_wrlock(&mLock);
+	pos = mHandles.find(localStr);
+	if (pos != mHandles.end())
+		handle = pos->second;
+	else
+	{
+		// Slots are never freed, so handles and references to them stay valid
+		TVariable* var = new TVariable;
+		var->name = localStr;
+		var->ival = 0;
+		var->fval = 0;
+		var->ullval = 0;
+		var->persist = 0;
+		var->defined = false;
+		var->isConst = false;
+		var->isMagic = IsMagicName(localStr);
+		handle = mVars.size();
+		mVars.push_back(var);
+		mHandles.insert(make_pair(localStr, handle));
+	}
+	pthread_rwlock_unlock(&mLock);
+	return handle;
+}
+
+void DataManager::SetDefaultValue(const string varName, const string value, int persist)
+{
+	int handle = GetHandle(varName);
+	if (handle < 0)
+		return;
+	pthread_rwlock_wrlock(&mLock);
+	TVariable* var = mVars[handle];
+	if (!var->defined)
+	{
+		StoreString(var, value);
+		var->defined = true;
+		var->persist = persist;
+	}
+	pthread_rwlock_unlock(&mLock);
+}
+
+void DataManager::SetConstValue(const string varName, const string value)
+{
+	int handle = GetHandle(varName);
+	if (handle < 0)
+		return;
+	pthread_rwlock_wrlock(&mLock);
+	TVariable* var = mVars[handle];
+	// A constant overrides a regular value of the same name, but the first constant wins
+	bool ignored = (var->isConst && var->str != value);
+	if (!var->isConst)
+	{
+		StoreString(var, value);
+		var->defined = true;
+		var->isConst = true;
+	}
+	pthread_rwlock_unlock(&mLock);
+	if (ignored)
+		LOGINFO("Constant '%s' is already set, ignoring '%s'.\n", varName.c_str(), value.c_str());
+}
+
+int DataManager::GetValue(const string varName, string& value)
+{
+	return GetValue(GetHandle(varName), value);
+}
+
+int DataManager::GetValue(const string varName, int& value)
+{
+	return GetValue(GetHandle(varName), value);
 }
 
 int DataManager::GetValue(const string varName, float& value)
 {
-	string data;
+	return GetValue(GetHandle(varName), value);
+}
 
-	if (GetValue(varName,data) != 0)
+unsigned long long DataManager::GetValue(const string varName, unsigned long long& value)
+{
+	return GetValue(GetHandle(varName), value);
+}
+
+int DataManager::GetValue(int handle, string& value)
+{
+	if (!mInitialized)
+		SetDefaultValues();
+	if (handle < 0)
 		return -1;
 
-	value = atof(data.c_str());
-	return 0;
+	pthread_rwlock_rdlock(&mLock);
+	TVariable* var = mVars[handle];
+	bool magic = var->isMagic;
+	bool defined = var->defined;
+	if (defined && !magic)
+		value = var->str;
+	pthread_rwlock_unlock(&mLock);
+
+	// Handle magic values
+	if (magic && GetMagicValue(var->name, value) == 0)
+		return 0;
+	return defined ? 0 : -1;
 }
 
-unsigned long long DataManager::GetValue(const string varName, unsigned long long& value)
+int DataManager::GetValue(int handle, int& value)
 {
-	string data;
+	if (!mInitialized)
+		SetDefaultValues();
+	if (handle < 0)
+		return -1;
+
+	pthread_rwlock_rdlock(&mLock);
+	TVariable* var = mVars[handle];
+	if (var->isMagic)
+	{
+		pthread_rwlock_unlock(&mLock);
+		string data;
+		if (GetValue(handle, data) != 0)
+			return -1;
+		value = atoi(data.c_str());
+		return 0;
+	}
+	bool defined = var->defined;
+	if (defined)
+		value = var->ival;
+	pthread_rwlock_unlock(&mLock);
+	return defined ? 0 : -1;
+}
 
-	if (GetValue(varName,data) != 0)
+int DataManager::GetValue(int handle, float& value)
+{
+	if (!mInitialized)
+		SetDefaultValues();
+	if (handle < 0)
 		return -1;
 
-	value = strtoull(data.c_str(), NULL, 10);
-	return 0;
+	pthread_rwlock_rdlock(&mLock);
+	TVariable* var = mVars[handle];
+	bool defined = var->defined;
+	if (defined)
+		value = var->fval;
+	pthread_rwlock_unlock(&mLock);
+	return defined ? 0 : -1;
+}
+
+unsigned long long DataManager::GetValue(int handle, unsigned long long& value)
+{
+	if (!mInitialized)
+		SetDefaultValues();
+	if (handle < 0)
+		return -1;
+
+	pthread_rwlock_rdlock(&mLock);
+	TVariable* var = mVars[handle];
+	bool defined = var->defined;
+	if (defined)
+		value = var->ullval;
+	pthread_rwlock_unlock(&mLock);
+	return defined ? 0 : -1;
 }
 
 // This is a dangerous function. It will create the value if it doesn't exist so it has a valid c_str
@@ -410,17 +729,22 @@ string& DataManager::GetValueRef(const string varName)
 	if (!mInitialized)
 		SetDefaultValues();
 
-	map<string, string>::iterator constPos;
-	constPos = mConstValues.find(varName);
-	if (constPos != mConstValues.end())
-		return constPos->second;
-
-	map<string, TStrIntPair>::iterator pos;
-	pos = mValues.find(varName);
-	if (pos == mValues.end())
-		pos = (mValues.insert(TNameValuePair(varName, TStrIntPair("", 0)))).first;
+	int handle = GetHandle(varName);
+	if (handle < 0)
+	{
+		static string empty;
+		return empty;
+	}
 
-	return pos->second.first;
+	pthread_rwlock_wrlock(&mLock);
+	TVariable* var = mVars[handle];
+	if (!var->defined)
+	{
+		StoreString(var, "");
+		var->defined = true;
+	}
+	pthread_rwlock_unlock(&mLock);
+	return var->str;
 }
 
 // This function will return an empty string if the value doesn't exist
@@ -434,54 +758,109 @@ string DataManager::GetStrValue(const string varName)
 
 // This function will return 0 if the value doesn't exist
 int DataManager::GetIntValue(const string varName)
+{
+	return GetIntValue(GetHandle(varName));
+}
+
+string DataManager::GetStrValue(int handle)
 {
 	string retVal;
 
-	GetValue(varName, retVal);
-	return atoi(retVal.c_str());
+	GetValue(handle, retVal);
+	return retVal;
+}
+
+int DataManager::GetIntValue(int handle)
+{
+	int retVal = 0;
+
+	GetValue(handle, retVal);
+	return retVal;
+}
+
+bool DataManager::IsMagicValue(int handle)
+{
+	if (handle < 0)
+		return false;
+
+	pthread_rwlock_rdlock(&mLock);
+	bool magic = mVars[handle]->isMagic;
+	pthread_rwlock_unlock(&mLock);
+	return magic;
+}
+
+// Don't allow empty values or numerical starting values
+static bool IsValidName(const string& varName)
+{
+	return !varName.empty() && !(varName[0] >= '0' && varName[0] <= '9');
 }
 
 int DataManager::SetValue(const string varName, string value, int persist /* = 0 */)
 {
-	if (!mInitialized)
-		SetDefaultValues();
+	if (!IsValidName(varName))
+		return -1;
+	return SetValue(GetHandle(varName), value, persist);
+}
 
-	// Don't allow empty values or numerical starting values
-	if (varName.empty() || (varName[0] >= '0' && varName[0] <= '9'))
+int DataManager::SetValue(const string varName, int value, int persist /* = 0 */)
+{
+	if (!IsValidName(varName))
 		return -1;
+	return SetValue(GetHandle(varName), value, persist);
+}
 
-	map<string, string>::iterator constChk;
-	constChk = mConstValues.find(varName);
-	if (constChk != mConstValues.end())
+int DataManager::SetValue(const string varName, float value, int persist /* = 0 */)
+{
+	if (!IsValidName(varName))
 		return -1;
+	return SetValue(GetHandle(varName), value, persist);
+}
 
-	map<string, TStrIntPair>::iterator pos;
-	pos = mValues.find(varName);
-	if (pos == mValues.end())
-		pos = (mValues.insert(TNameValuePair(varName, TStrIntPair(value, persist)))).first;
-	else
-		pos->second.first = value;
+int DataManager::SetValue(const string varName, unsigned long long value, int persist /* = 0 */)
+{
+	if (!IsValidName(varName))
+		return -1;
+	return SetValue(GetHandle(varName), value, persist);
+}
 
-	if (pos->second.second != 0)
-		SaveValues();
+int DataManager::SetValue(int handle, string value, int persist /* = 0 */)
+{
+	if (!mInitialized)
+		SetDefaultValues();
+	if (handle < 0)
+		return -1;
 
-#ifndef TW_NO_SCREEN_TIMEOUT
-	if (varName == "tw_screen_timeout_secs") {
-		blankTimer.setTime(atoi(value.c_str()));
-	} else
-#endif
-	if (varName == "tw_storage_path") {
-		SetBackupFolder();
+	pthread_rwlock_wrlock(&mLock);
+	TVariable* var = mVars[handle];
+	if (var->isConst)
+	{
+		pthread_rwlock_unlock(&mLock);
+		return -1;
 	}
-	gui_notifyVarChange(varName.c_str(), value.c_str());
-	return 0;
+	StoreString(var, value);
+	if (!var->defined)
+	{
+		var->defined = true;
+		var->persist = persist;
+	}
+	persist = var->persist;
+	pthread_rwlock_unlock(&mLock);
+
+	return ValueChanged(var, persist);
 }
 
-int DataManager::SetValue(const string varName, int value, int persist /* = 0 */)
+int DataManager::SetValue(int handle, int value, int persist /* = 0 */)
 {
-	ostringstream valStr;
-	valStr << value;
-	if (varName == "tw_use_external_storage") {
+	if (!mInitialized)
+		SetDefaultValues();
+	if (handle < 0)
+		return -1;
+
+	pthread_rwlock_rdlock(&mLock);
+	bool use_external = (mVars[handle]->name == "tw_use_external_storage");
+	pthread_rwlock_unlock(&mLock);
+
+	if (use_external) {
 		string str;
 
 		if (GetIntValue(TW_HAS_DUAL_STORAGE) == 1) {
@@ -497,25 +876,89 @@ int DataManager::SetValue(const string varName, int value, int persist /* = 0 */
 
 		SetValue("tw_storage_path", str);
 	}
-	return SetValue(varName, valStr.str(), persist);
+
+	char valStr[16];
+	sprintf(valStr, "%d", value);
+	return StoreNative(handle, valStr, value, (float) value, (unsigned long long) value, persist);
 }
 
-int DataManager::SetValue(const string varName, float value, int persist /* = 0 */)
+int DataManager::SetValue(int handle, float value, int persist /* = 0 */)
+{
+	if (!mInitialized)
+		SetDefaultValues();
+	if (handle < 0)
+		return -1;
+
+	// %g formats like the default ostream precision
+	char valStr[32];
+	sprintf(valStr, "%g", value);
+	return StoreNative(handle, valStr, (int) value, value, (unsigned long long) value, persist);
+}
+
+int DataManager::SetValue(int handle, unsigned long long value, int persist /* = 0 */)
 {
-	ostringstream valStr;
-	valStr << value;
-	return SetValue(varName, valStr.str(), persist);;
+	if (!mInitialized)
+		SetDefaultValues();
+	if (handle < 0)
+		return -1;
+
+	char valStr[32];
+	sprintf(valStr, "%llu", value);
+	return StoreNative(handle, valStr, (int) value, (float) value, value, persist);
 }
 
-int DataManager::SetValue(const string varName, unsigned long long value, int persist /* = 0 */)
+// Stores a value that is already in native form, without parsing it back from the string
+int DataManager::StoreNative(int handle, const char* str, int ival, float fval, unsigned long long ullval, int persist)
+{
+	pthread_rwlock_wrlock(&mLock);
+	TVariable* var = mVars[handle];
+	if (var->isConst)
+	{
+		pthread_rwlock_unlock(&mLock);
+		return -1;
+	}
+	var->str = str;
+	var->ival = ival;
+	var->fval = fval;
+	var->ullval = ullval;
+	mChangeCount++;
+	if (!var->defined)
+	{
+		var->defined = true;
+		var->persist = persist;
+	}
+	persist = var->persist;
+	pthread_rwlock_unlock(&mLock);
+
+	return ValueChanged(var, persist);
+}
+
+// Saves and notifies about a changed value. Called without mLock held.
+int DataManager::ValueChanged(TVariable* var, int persist)
 {
-	ostringstream valStr;
-	valStr << value;
-	return SetValue(varName, valStr.str(), persist);
+	if (persist != 0)
+		ScheduleSave();
+
+	pthread_rwlock_rdlock(&mLock);
+	string value = var->str;
+	pthread_rwlock_unlock(&mLock);
+#ifndef TW_NO_SCREEN_TIMEOUT
+	if (var->name == "tw_screen_timeout_secs") {
+		blankTimer.setTime(atoi(value.c_str()));
+	} else
+#endif
+	if (var->name == "tw_storage_path") {
+		SetBackupFolder();
+	}
+	gui_notifyVarChange(var->name.c_str(), value.c_str());
+	return 0;
 }
 
 int DataManager::SetProgress(float Fraction) {
-	return SetValue("ui_progress", (float) (Fraction * 100.0));
+	static int progress = -1;
+	if (progress < 0)
+		progress = GetHandle("ui_progress");
+	return SetValue(progress, (float) (Fraction * 100.0));
 }
 
 int DataManager::ShowProgress(float Portion, float Seconds)
@@ -531,10 +974,16 @@ int DataManager::ShowProgress(float Portion, float Seconds)
 
 void DataManager::DumpValues()
 {
-	map<string, TStrIntPair>::iterator iter;
+	map<string, int>::iterator iter;
 	gui_print("Data Manager dump - Values with leading X are persisted.\n");
-	for (iter = mValues.begin(); iter != mValues.end(); ++iter)
-		gui_print("%c %s=%s\n", iter->second.second ? 'X' : ' ', iter->first.c_str(), iter->second.first.c_str());
+	pthread_rwlock_rdlock(&mLock);
+	for (iter = mHandles.begin(); iter != mHandles.end(); ++iter)
+	{
+		TVariable* var = mVars[iter->second];
+		if (var->defined && !var->isConst)
+			gui_print("%c %s=%s\n", var->persist ? 'X' : ' ', iter->first.c_str(), var->str.c_str());
+	}
+	pthread_rwlock_unlock(&mLock);
 }
 
 void DataManager::update_tz_environment_variables(void)
@@ -589,19 +1038,19 @@ void DataManager::SetDefaultValues()
 
 	mInitialized = 1;
 
-	mConstValues.insert(make_pair("true", "1"));
-	mConstValues.insert(make_pair("false", "0"));
+	SetConstValue("true", "1");
+	SetConstValue("false", "0");
 
-	mConstValues.insert(make_pair(TW_VERSION_VAR, TW_VERSION_STR));
-	mValues.insert(make_pair("tw_button_vibrate", make_pair("80", 1)));
-	mValues.insert(make_pair("tw_keyboard_vibrate", make_pair("40", 1)));
-	mValues.insert(make_pair("tw_action_vibrate", make_pair("160", 1)));
+	SetConstValue(TW_VERSION_VAR, TW_VERSION_STR);
+	SetDefaultValue("tw_button_vibrate", "80", 1);
+	SetDefaultValue("tw_keyboard_vibrate", "40", 1);
+	SetDefaultValue("tw_action_vibrate", "160", 1);
 
 	TWPartition *store = PartitionManager.Get_Default_Storage_Partition();
 	if(store)
-		mValues.insert(make_pair("tw_storage_path", make_pair(store->Storage_Path.c_str(), 1)));
+		SetDefaultValue("tw_storage_path", store->Storage_Path.c_str(), 1);
 	else
-		mValues.insert(make_pair("tw_storage_path", make_pair("/", 1)));
+		SetDefaultValue("tw_storage_path", "/", 1);
 
 #ifdef TW_FORCE_CPUINFO_FOR_DEVICE_ID
 	printf("TW_FORCE_CPUINFO_FOR_DEVICE_ID := true\n");
@@ -609,16 +1058,16 @@ void DataManager::SetDefaultValues()
 
 #ifdef BOARD_HAS_NO_REAL_SDCARD
 	printf("BOARD_HAS_NO_REAL_SDCARD := true\n");
-	mConstValues.insert(make_pair(TW_ALLOW_PARTITION_SDCARD, "0"));
+	SetConstValue(TW_ALLOW_PARTITION_SDCARD, "0");
 #else
-	mConstValues.insert(make_pair(TW_ALLOW_PARTITION_SDCARD, "1"));
+	SetConstValue(TW_ALLOW_PARTITION_SDCARD, "1");
 #endif
 
 #ifdef TW_INCLUDE_DUMLOCK
 	printf("TW_INCLUDE_DUMLOCK := true\n");
-	mConstValues.insert(make_pair(TW_SHOW_DUMLOCK, "1"));
+	SetConstValue(TW_SHOW_DUMLOCK, "1");
 #else
-	mConstValues.insert(make_pair(TW_SHOW_DUMLOCK, "0"));
+	SetConstValue(TW_SHOW_DUMLOCK, "0");
 #endif
 
 	str = GetCurrentStoragePath();
@@ -631,38 +1080,38 @@ void DataManager::SetDefaultValues()
 	str += dev_id;
 	SetValue(TW_BACKUPS_FOLDER_VAR, str, 0);
 
-	mConstValues.insert(make_pair(TW_REBOOT_SYSTEM, "1"));
+	SetConstValue(TW_REBOOT_SYSTEM, "1");
 #ifdef TW_NO_REBOOT_RECOVERY
 	printf("TW_NO_REBOOT_RECOVERY := true\n");
-	mConstValues.insert(make_pair(TW_REBOOT_RECOVERY, "0"));
+	SetConstValue(TW_REBOOT_RECOVERY, "0");
 #else
-	mConstValues.insert(make_pair(TW_REBOOT_RECOVERY, "1"));
+	SetConstValue(TW_REBOOT_RECOVERY, "1");
 #endif
-	mConstValues.insert(make_pair(TW_REBOOT_POWEROFF, "1"));
+	SetConstValue(TW_REBOOT_POWEROFF, "1");
 #ifdef TW_NO_REBOOT_BOOTLOADER
 	printf("TW_NO_REBOOT_BOOTLOADER := true\n");
-	mConstValues.insert(make_pair(TW_REBOOT_BOOTLOADER, "0"));
+	SetConstValue(TW_REBOOT_BOOTLOADER, "0");
 #else
-	mConstValues.insert(make_pair(TW_REBOOT_BOOTLOADER, "1"));
+	SetConstValue(TW_REBOOT_BOOTLOADER, "1");
 #endif
 #ifdef RECOVERY_SDCARD_ON_DATA
 	printf("RECOVERY_SDCARD_ON_DATA := true\n");
-	mConstValues.insert(make_pair(TW_HAS_DATA_MEDIA, "1"));
-	mConstValues.insert(make_pair("tw_has_internal", "1"));
+	SetConstValue(TW_HAS_DATA_MEDIA, "1");
+	SetConstValue("tw_has_internal", "1");
 	datamedia = true;
 #else
-	mValues.insert(make_pair(TW_HAS_DATA_MEDIA, make_pair("0", 0)));
-	mValues.insert(make_pair("tw_has_internal", make_pair("0", 0)));
+	SetDefaultValue(TW_HAS_DATA_MEDIA, "0", 0);
+	SetDefaultValue("tw_has_internal", "0", 0);
 #endif
 #ifdef TW_NO_BATT_PERCENT
 	printf("TW_NO_BATT_PERCENT := true\n");
-	mConstValues.insert(make_pair(TW_NO_BATTERY_PERCENT, "1"));
+	SetConstValue(TW_NO_BATTERY_PERCENT, "1");
 #else
-	mConstValues.insert(make_pair(TW_NO_BATTERY_PERCENT, "0"));
+	SetConstValue(TW_NO_BATTERY_PERCENT, "0");
 #endif
 #ifdef TW_NO_CPU_TEMP
 	printf("TW_NO_CPU_TEMP := true\n");
-	mConstValues.insert(make_pair("tw_no_cpu_temp", "1"));
+	SetConstValue("tw_no_cpu_temp", "1");
 #else
 	string cpu_temp_file;
 #ifdef TW_CUSTOM_CPU_TEMP_PATH
@@ -671,31 +1120,31 @@ void DataManager::SetDefaultValues()
 	cpu_temp_file = "/sys/class/thermal/thermal_zone0/temp";
 #endif
 	if (TWFunc::Path_Exists(cpu_temp_file)) {
-		mConstValues.insert(make_pair("tw_no_cpu_temp", "0"));
+		SetConstValue("tw_no_cpu_temp", "0");
 	} else {
 		LOGINFO("CPU temperature file '%s' not found, disabling CPU temp.\n", cpu_temp_file.c_str());
-		mConstValues.insert(make_pair("tw_no_cpu_temp", "1"));
+		SetConstValue("tw_no_cpu_temp", "1");
 	}
 #endif
 #ifdef TW_CUSTOM_POWER_BUTTON
 	printf("TW_POWER_BUTTON := %s\n", EXPAND(TW_CUSTOM_POWER_BUTTON));
-	mConstValues.insert(make_pair(TW_POWER_BUTTON, EXPAND(TW_CUSTOM_POWER_BUTTON)));
+	SetConstValue(TW_POWER_BUTTON, EXPAND(TW_CUSTOM_POWER_BUTTON));
 #else
-	mConstValues.insert(make_pair(TW_POWER_BUTTON, "0"));
+	SetConstValue(TW_POWER_BUTTON, "0");
 #endif
 #ifdef TW_ALWAYS_RMRF
 	printf("TW_ALWAYS_RMRF := true\n");
-	mConstValues.insert(make_pair(TW_RM_RF_VAR, "1"));
+	SetConstValue(TW_RM_RF_VAR, "1");
 #endif
 #ifdef TW_NEVER_UNMOUNT_SYSTEM
 	printf("TW_NEVER_UNMOUNT_SYSTEM := true\n");
-	mConstValues.insert(make_pair(TW_DONT_UNMOUNT_SYSTEM, "1"));
+	SetConstValue(TW_DONT_UNMOUNT_SYSTEM, "1");
 #else
-	mConstValues.insert(make_pair(TW_DONT_UNMOUNT_SYSTEM, "0"));
+	SetConstValue(TW_DONT_UNMOUNT_SYSTEM, "0");
 #endif
 #ifdef TW_NO_USB_STORAGE
 	printf("TW_NO_USB_STORAGE := true\n");
-	mConstValues.insert(make_pair(TW_HAS_USB_STORAGE, "0"));
+	SetConstValue(TW_HAS_USB_STORAGE, "0");
 #else
 	char lun_file[255];
 	string Lun_File_str = CUSTOM_LUN_FILE;
@@ -706,90 +1155,91 @@ void DataManager::SetDefaultValues()
 	}
 	if (!TWFunc::Path_Exists(Lun_File_str)) {
 		LOGINFO("Lun file '%s' does not exist, USB storage mode disabled\n", Lun_File_str.c_str());
-		mConstValues.insert(make_pair(TW_HAS_USB_STORAGE, "0"));
+		SetConstValue(TW_HAS_USB_STORAGE, "0");
 	} else {
 		LOGINFO("Lun file '%s'\n", Lun_File_str.c_str());
-		mConstValues.insert(make_pair(TW_HAS_USB_STORAGE, "1"));
+		SetConstValue(TW_HAS_USB_STORAGE, "1");
 	}
 #endif
 #ifdef TW_INCLUDE_INJECTTWRP
 	printf("TW_INCLUDE_INJECTTWRP := true\n");
-	mConstValues.insert(make_pair(TW_HAS_INJECTTWRP, "1"));
-	mValues.insert(make_pair(TW_INJECT_AFTER_ZIP, make_pair("1", 1)));
+	SetConstValue(TW_HAS_INJECTTWRP, "1");
+	SetDefaultValue(TW_INJECT_AFTER_ZIP, "1", 1);
 #else
-	mConstValues.insert(make_pair(TW_HAS_INJECTTWRP, "0"));
-	mValues.insert(make_pair(TW_INJECT_AFTER_ZIP, make_pair("0", 1)));
+	SetConstValue(TW_HAS_INJECTTWRP, "0");
+	SetDefaultValue(TW_INJECT_AFTER_ZIP, "0", 1);
 #endif
 #ifdef TW_HAS_DOWNLOAD_MODE
 	printf("TW_HAS_DOWNLOAD_MODE := true\n");
-	mConstValues.insert(make_pair(TW_DOWNLOAD_MODE, "1"));
+	SetConstValue(TW_DOWNLOAD_MODE, "1");
 #endif
 #ifdef TW_INCLUDE_CRYPTO
-	mConstValues.insert(make_pair(TW_HAS_CRYPTO, "1"));
+	SetConstValue(TW_HAS_CRYPTO, "1");
 	printf("TW_INCLUDE_CRYPTO := true\n");
 #endif
 #ifdef TW_SDEXT_NO_EXT4
 	printf("TW_SDEXT_NO_EXT4 := true\n");
-	mConstValues.insert(make_pair(TW_SDEXT_DISABLE_EXT4, "1"));
+	SetConstValue(TW_SDEXT_DISABLE_EXT4, "1");
 #else
-	mConstValues.insert(make_pair(TW_SDEXT_DISABLE_EXT4, "0"));
+	SetConstValue(TW_SDEXT_DISABLE_EXT4, "0");
 #endif
 
 #ifdef TW_HAS_NO_BOOT_PARTITION
-	mValues.insert(make_pair("tw_backup_list", make_pair("/system;/data;", 1)));
+	SetDefaultValue("tw_backup_list", "/system;/data;", 1);
 #else
-	mValues.insert(make_pair("tw_backup_list", make_pair("/system;/data;/boot;", 1)));
+	SetDefaultValue("tw_backup_list", "/system;/data;/boot;", 1);
 #endif
-	mConstValues.insert(make_pair(TW_MIN_SYSTEM_VAR, TW_MIN_SYSTEM_SIZE));
-	mValues.insert(make_pair(TW_BACKUP_NAME, make_pair("(Auto Generate)", 0)));
-
-	mValues.insert(make_pair(TW_REBOOT_AFTER_FLASH_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SIGNED_ZIP_VERIFY_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_FORCE_MD5_CHECK_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_COLOR_THEME_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_USE_COMPRESSION_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SHOW_SPAM_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_TIME_ZONE_VAR, make_pair("CST6CDT", 1)));
-	mValues.insert(make_pair(TW_SORT_FILES_BY_DATE_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_GUI_SORT_ORDER, make_pair("1", 1)));
-	mValues.insert(make_pair(TW_RM_RF_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SKIP_MD5_CHECK_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SKIP_MD5_GENERATE_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SDEXT_SIZE, make_pair("512", 1)));
-	mValues.insert(make_pair(TW_SWAP_SIZE, make_pair("32", 1)));
-	mValues.insert(make_pair(TW_SDPART_FILE_SYSTEM, make_pair("ext3", 1)));
-	mValues.insert(make_pair(TW_TIME_ZONE_GUISEL, make_pair("CST6;CDT", 1)));
-	mValues.insert(make_pair(TW_TIME_ZONE_GUIOFFSET, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_TIME_ZONE_GUIDST, make_pair("1", 1)));
-	mValues.insert(make_pair(TW_ACTION_BUSY, make_pair("0", 0)));
-	mValues.insert(make_pair("tw_wipe_cache", make_pair("0", 0)));
-	mValues.insert(make_pair("tw_wipe_dalvik", make_pair("0", 0)));
+	SetConstValue(TW_MIN_SYSTEM_VAR, TW_MIN_SYSTEM_SIZE);
+	SetDefaultValue(TW_BACKUP_NAME, "(Auto Generate)", 0);
+
+	SetDefaultValue(TW_REBOOT_AFTER_FLASH_VAR, "0", 1);
+	SetDefaultValue(TW_SIGNED_ZIP_VERIFY_VAR, "0", 1);
+	SetDefaultValue(TW_FORCE_MD5_CHECK_VAR, "0", 1);
+	SetDefaultValue(TW_COLOR_THEME_VAR, "0", 1);
+	SetDefaultValue(TW_USE_COMPRESSION_VAR, "0", 1);
+	SetDefaultValue(TW_SHOW_SPAM_VAR, "0", 1);
+	SetDefaultValue(TW_TIME_ZONE_VAR, "CST6CDT", 1);
+	SetDefaultValue(TW_SORT_FILES_BY_DATE_VAR, "0", 1);
+	SetDefaultValue(TW_GUI_SORT_ORDER, "1", 1);
+	SetDefaultValue(TW_RM_RF_VAR, "0", 1);
+	SetDefaultValue(TW_SKIP_MD5_CHECK_VAR, "0", 1);
+	SetDefaultValue(TW_SKIP_MD5_GENERATE_VAR, "0", 1);
+	SetDefaultValue(TW_FAST_FORMAT_VAR, "1", 1);
+	SetDefaultValue(TW_SDEXT_SIZE, "512", 1);
+	SetDefaultValue(TW_SWAP_SIZE, "32", 1);
+	SetDefaultValue(TW_SDPART_FILE_SYSTEM, "ext3", 1);
+	SetDefaultValue(TW_TIME_ZONE_GUISEL, "CST6;CDT", 1);
+	SetDefaultValue(TW_TIME_ZONE_GUIOFFSET, "0", 1);
+	SetDefaultValue(TW_TIME_ZONE_GUIDST, "1", 1);
+	SetDefaultValue(TW_ACTION_BUSY, "0", 0);
+	SetDefaultValue("tw_wipe_cache", "0", 0);
+	SetDefaultValue("tw_wipe_dalvik", "0", 0);
 	if (GetIntValue(TW_HAS_INTERNAL) == 1 && GetIntValue(TW_HAS_DATA_MEDIA) == 1 && GetIntValue(TW_HAS_EXTERNAL) == 0)
 		SetValue(TW_HAS_USB_STORAGE, 0, 0);
 	else
 		SetValue(TW_HAS_USB_STORAGE, 1, 0);
-	mValues.insert(make_pair(TW_ZIP_INDEX, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_ZIP_QUEUE_COUNT, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_FILENAME, make_pair("/sdcard", 0)));
-	mValues.insert(make_pair(TW_SIMULATE_ACTIONS, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SIMULATE_FAIL, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_IS_ENCRYPTED, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_IS_DECRYPTED, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_CRYPTO_PASSWORD, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_DATA_BLK_DEVICE, make_pair("0", 0)));
-	mValues.insert(make_pair("tw_terminal_state", make_pair("0", 0)));
-	mValues.insert(make_pair("tw_background_thread_running", make_pair("0", 0)));
-	mValues.insert(make_pair(TW_RESTORE_FILE_DATE, make_pair("0", 0)));
-	mValues.insert(make_pair("tw_military_time", make_pair("0", 1)));
+	SetDefaultValue(TW_ZIP_INDEX, "0", 0);
+	SetDefaultValue(TW_ZIP_QUEUE_COUNT, "0", 0);
+	SetDefaultValue(TW_FILENAME, "/sdcard", 0);
+	SetDefaultValue(TW_SIMULATE_ACTIONS, "0", 1);
+	SetDefaultValue(TW_SIMULATE_FAIL, "0", 1);
+	SetDefaultValue(TW_IS_ENCRYPTED, "0", 0);
+	SetDefaultValue(TW_IS_DECRYPTED, "0", 0);
+	SetDefaultValue(TW_CRYPTO_PASSWORD, "0", 0);
+	SetDefaultValue(TW_DATA_BLK_DEVICE, "0", 0);
+	SetDefaultValue("tw_terminal_state", "0", 0);
+	SetDefaultValue("tw_background_thread_running", "0", 0);
+	SetDefaultValue(TW_RESTORE_FILE_DATE, "0", 0);
+	SetDefaultValue("tw_military_time", "0", 1);
 #ifdef TW_NO_SCREEN_TIMEOUT
-	mValues.insert(make_pair("tw_screen_timeout_secs", make_pair("0", 1)));
-	mValues.insert(make_pair("tw_no_screen_timeout", make_pair("1", 1)));
+	SetDefaultValue("tw_screen_timeout_secs", "0", 1);
+	SetDefaultValue("tw_no_screen_timeout", "1", 1);
 #else
-	mValues.insert(make_pair("tw_screen_timeout_secs", make_pair("60", 1)));
-	mValues.insert(make_pair("tw_no_screen_timeout", make_pair("0", 1)));
+	SetDefaultValue("tw_screen_timeout_secs", "60", 1);
+	SetDefaultValue("tw_no_screen_timeout", "0", 1);
 #endif
-	mValues.insert(make_pair("tw_gui_done", make_pair("0", 0)));
-	mValues.insert(make_pair("tw_encrypt_backup", make_pair("0", 0)));
+	SetDefaultValue("tw_gui_done", "0", 0);
+	SetDefaultValue("tw_encrypt_backup", "0", 0);
 #ifdef TW_BRIGHTNESS_PATH
 	string findbright;
 	if (strcmp(EXPAND(TW_BRIGHTNESS_PATH), "/nobrightness") != 0) {
@@ -807,21 +1257,21 @@ void DataManager::SetDefaultValues()
 	}
 	if (findbright.empty()) {
 		LOGINFO("Unable to locate brightness file\n");
-		mConstValues.insert(make_pair("tw_has_brightnesss_file", "0"));
+		SetConstValue("tw_has_brightnesss_file", "0");
 	} else {
 		LOGINFO("Found brightness file at '%s'\n", findbright.c_str());
-		mConstValues.insert(make_pair("tw_has_brightnesss_file", "1"));
-		mConstValues.insert(make_pair("tw_brightness_file", findbright));
+		SetConstValue("tw_has_brightnesss_file", "1");
+		SetConstValue("tw_brightness_file", findbright);
 		ostringstream maxVal;
 		maxVal << TW_MAX_BRIGHTNESS;
-		mConstValues.insert(make_pair("tw_brightness_max", maxVal.str()));
-		mValues.insert(make_pair("tw_brightness", make_pair(maxVal.str(), 1)));
-		mValues.insert(make_pair("tw_brightness_pct", make_pair("100", 1)));
+		SetConstValue("tw_brightness_max", maxVal.str());
+		SetDefaultValue("tw_brightness", maxVal.str(), 1);
+		SetDefaultValue("tw_brightness_pct", "100", 1);
 #ifdef TW_SECONDARY_BRIGHTNESS_PATH
 		string secondfindbright = EXPAND(TW_SECONDARY_BRIGHTNESS_PATH);
 		if (secondfindbright != "" && TWFunc::Path_Exists(secondfindbright)) {
 			LOGINFO("Will use a second brightness file at '%s'\n", secondfindbright.c_str());
-			mConstValues.insert(make_pair("tw_secondary_brightness_file", secondfindbright));
+			SetConstValue("tw_secondary_brightness_file", secondfindbright);
 		} else {
 			LOGINFO("Specified secondary brightness file '%s' not found.\n", secondfindbright.c_str());
 		}
@@ -830,21 +1280,21 @@ void DataManager::SetDefaultValues()
 		TWFunc::Set_Brightness(max_bright);
 	}
 #endif
-	mValues.insert(make_pair(TW_MILITARY_TIME, make_pair("0", 1)));
+	SetDefaultValue(TW_MILITARY_TIME, "0", 1);
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
-	mValues.insert(make_pair("tw_include_encrypted_backup", make_pair("1", 0)));
+	SetDefaultValue("tw_include_encrypted_backup", "1", 0);
 #else
 	LOGINFO("TW_EXCLUDE_ENCRYPTED_BACKUPS := true\n");
-	mValues.insert(make_pair("tw_include_encrypted_backup", make_pair("0", 0)));
+	SetDefaultValue("tw_include_encrypted_backup", "0", 0);
 #endif
 #ifdef TW_HAS_MTP
-	mConstValues.insert(make_pair("tw_has_mtp", "1"));
-	mValues.insert(make_pair("tw_mtp_enabled", make_pair("1", 1)));
-	mValues.insert(make_pair("tw_mtp_debug", make_pair("0", 1)));
+	SetConstValue("tw_has_mtp", "1");
+	SetDefaultValue("tw_mtp_enabled", "1", 1);
+	SetDefaultValue("tw_mtp_debug", "0", 1);
 #else
 	LOGINFO("TW_EXCLUDE_MTP := true\n");
-	mConstValues.insert(make_pair("tw_has_mtp", "0"));
-	mConstValues.insert(make_pair("tw_mtp_enabled", "0"));
+	SetConstValue("tw_has_mtp", "0");
+	SetConstValue("tw_mtp_enabled", "0");
 #endif
 }
 
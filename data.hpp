@@ -19,9 +19,12 @@
 #ifndef _DATAMANAGER_HPP_HEADER
 #define _DATAMANAGER_HPP_HEADER
 
+#include <pthread.h>
+#include <time.h>
 #include <string>
 #include <utility>
 #include <map>
+#include <vector>
 
 using namespace std;
 
@@ -31,6 +34,8 @@ public:
 	static int ResetDefaults();
 	static int LoadValues(const string filename);
 	static int Flush();
+	// Writes changes still waiting for the background save, mounting the settings storage if asked to
+	static void FlushPending(bool mount = false);
 
 	// Core get routines
 	static int GetValue(const string varName, string& value);
@@ -45,11 +50,30 @@ public:
 	static string GetStrValue(const string varName);
 	static int GetIntValue(const string varName);
 
+	// Handles are resolved once (e.g. when the XML is loaded) to skip the name
+	// lookup on every access. A handle stays valid even before the variable is
+	// set and across ResetDefaults. Returns -1 for an empty name.
+	static int GetHandle(const string varName);
+	static int GetValue(int handle, string& value);
+	static int GetValue(int handle, int& value);
+	static int GetValue(int handle, float& value);
+	static unsigned long long GetValue(int handle, unsigned long long& value);
+	static string GetStrValue(int handle);
+	static int GetIntValue(int handle);
+	// Magic values (e.g. tw_time) change without SetValue being called
+	static bool IsMagicValue(int handle);
+	// Increases on every stored value, cached results built from values stay valid while it does not change
+	static unsigned int GetChangeCount(void) { return mChangeCount; }
+
 	// Core set routines
 	static int SetValue(const string varName, string value, int persist = 0);
 	static int SetValue(const string varName, int value, int persist = 0);
 	static int SetValue(const string varName, float value, int persist = 0);
 	static int SetValue(const string varName, unsigned long long value, int persist = 0);
+	static int SetValue(int handle, string value, int persist = 0);
+	static int SetValue(int handle, int value, int persist = 0);
+	static int SetValue(int handle, float value, int persist = 0);
+	static int SetValue(int handle, unsigned long long value, int persist = 0);
 	static int SetProgress(float Fraction);
 	static int ShowProgress(float Portion, float Seconds);
 
@@ -67,18 +91,48 @@ public:
 	static string& CGetSettingsStoragePath();
 
 protected:
-	typedef pair<string, int> TStrIntPair;
-	typedef pair<string, unsigned long long> TStrULLPair;
-	typedef pair<string, TStrIntPair> TNameValuePair;
-	static map<string, TStrIntPair> mValues;
-	static map<string, TStrULLPair> mULLValues;
+	// Every value is kept as a string and in native form, so reads don't parse
+	struct TVariable
+	{
+		string name;
+		string str;
+		int ival;
+		float fval;
+		unsigned long long ullval;
+		int persist;
+		bool defined;
+		bool isConst;
+		bool isMagic;
+	};
+	static map<string, int> mHandles;
+	static vector<TVariable*> mVars;   // indexed by handle, slots are never freed
+	static pthread_rwlock_t mLock;     // protects mHandles, mVars and the slots
+	static volatile unsigned int mChangeCount;
+
+	// Write-behind state for the settings file, protected by mSaveLock
+	static pthread_mutex_t mSaveLock;
+	static pthread_cond_t mSaveCond;
+	static pthread_mutex_t mWriteLock; // one writer of the settings file at a time
+	static bool mSaveThreadStarted;
+	static bool mSaveScheduled;        // the background thread has a write to do
+	static bool mSaveUnsaved;          // values changed since the last successful write
+	static bool mSaveSkipLogged;       // a skipped write was logged since the last successful write
+	static struct timespec mFirstChange;
+	static struct timespec mLastChange;
 	static string mBackingFile;
 	static int mInitialized;
 
-	static map<string, string> mConstValues;
-
 protected:
 	static int SaveValues();
+	static int WriteValues();
+	static void ScheduleSave();
+	static void* SaveThread(void* cookie);
+	static void LogSaveSkipped();
+	static void SetDefaultValue(const string varName, const string value, int persist);
+	static void SetConstValue(const string varName, const string value);
+	static void StoreString(TVariable* var, const string& value);
+	static int StoreNative(int handle, const char* str, int ival, float fval, unsigned long long ullval, int persist);
+	static int ValueChanged(TVariable* var, int persist);
 
 	static int GetMagicValue(string varName, string& value);
 
@@ -21,13 +21,16 @@
 #include <sstream>
 #include <string>
 #include <vector>
+#include <map>
+#include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
-#include "gui/rapidxml.hpp"
 #include "fixPermissions.hpp"
 #include "twrp-functions.hpp"
 #include "twcommon.h"
@@ -39,82 +42,171 @@
 #endif
 
 using namespace std;
-using namespace rapidxml;
+
+// Packages and folders are fixed by up to this many threads, including the caller
+#define FIX_MAX_THREADS 4
+
+fixPermissions::fixPermissions() {
+	debug = false;
+	remove_data = false;
+	multi_user = false;
+	currentJob = NULL;
+	nextJob = jobCount = 0;
+	jobFailed = false;
+	examined = changed = 0;
+	labelsExamined = relabeled = 0;
+	pthread_mutex_init(&lock, NULL);
+}
+
+fixPermissions::~fixPermissions() {
+	pthread_mutex_destroy(&lock);
+}
+
+// Calls job for every index from 0 to count, stops handing out indexes once one fails
+int fixPermissions::runJobs(Job job, size_t count) {
+	pthread_t threads[FIX_MAX_THREADS - 1];
+	int started = 0;
+
+	currentJob = job;
+	jobCount = count;
+	nextJob = 0;
+	jobFailed = false;
+	while (started < FIX_MAX_THREADS - 1 && (size_t)started + 1 < count) {
+		if (pthread_create(&threads[started], NULL, jobThread, this) != 0)
+			break;
+		started++;
+	}
+	workJobs();
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	return jobFailed ? -1 : 0;
+}
+
+void* fixPermissions::jobThread(void* cookie) {
+	((fixPermissions*) cookie)->workJobs();
+	return NULL;
+}
+
+void fixPermissions::workJobs() {
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		if (jobFailed || nextJob >= jobCount) {
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+		size_t index = nextJob++;
+		pthread_mutex_unlock(&lock);
+
+		if ((this->*currentJob)(index) != 0) {
+			pthread_mutex_lock(&lock);
+			jobFailed = true;
+			pthread_mutex_unlock(&lock);
+		}
+	}
+}
+
+static bool isDirEntry(int dirfd, struct dirent* de, int type) {
+	struct stat st;
+
+	if (de->d_type != DT_UNKNOWN)
+		return de->d_type == type;
+	if (fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+		return false;
+	return (type == DT_DIR && S_ISDIR(st.st_mode)) || (type == DT_REG && S_ISREG(st.st_mode));
+}
 
 #ifdef HAVE_SELINUX
 struct selabel_handle *sehandle;
 struct selinux_opt selinux_options[] = {
 	{ SELABEL_OPT_PATH, "/file_contexts" }
 };
+// Lookups may compile the regular expressions of a spec the first time it is used
+static pthread_mutex_t selabel_lock = PTHREAD_MUTEX_INITIALIZER;
 
-int fixPermissions::restorecon(string entry, struct stat *sb) {
+// There is no *at version of lsetfilecon, the label is looked up by path anyway
+int fixPermissions::restorecon(int dirfd, const char* name, const string& path) {
 	char *oldcontext, *newcontext;
-	if (lgetfilecon(entry.c_str(), &oldcontext) < 0) {
-		LOGINFO("Couldn't get selinux context for %s\n", entry.c_str());
+	struct stat sb;
+	int ret;
+
+	__sync_fetch_and_add(&labelsExamined, 1);
+	if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+		LOGINFO("Couldn't stat %s\n", path.c_str());
+		return -1;
+	}
+	if (lgetfilecon(path.c_str(), &oldcontext) < 0) {
+		LOGINFO("Couldn't get selinux context for %s\n", path.c_str());
 		return -1;
 	}
-	if (selabel_lookup(sehandle, &newcontext, entry.c_str(), sb->st_mode) < 0) {
-		LOGINFO("Couldn't lookup selinux context for %s\n", entry.c_str());
+	pthread_mutex_lock(&selabel_lock);
+	ret = selabel_lookup(sehandle, &newcontext, path.c_str(), sb.st_mode);
+	pthread_mutex_unlock(&selabel_lock);
+	if (ret < 0) {
+		LOGINFO("Couldn't lookup selinux context for %s\n", path.c_str());
+		freecon(oldcontext);
 		return -1;
 	}
 	if (strcmp(oldcontext, newcontext) != 0) {
-		LOGINFO("Relabeling %s from %s to %s\n", entry.c_str(), oldcontext, newcontext);
-		if (lsetfilecon(entry.c_str(), newcontext) < 0) {
-			LOGINFO("Couldn't label %s with %s: %s\n", entry.c_str(), newcontext, strerror(errno));
-		}
+		LOGINFO("Relabeling %s from %s to %s\n", path.c_str(), oldcontext, newcontext);
+		if (lsetfilecon(path.c_str(), newcontext) < 0)
+			LOGINFO("Couldn't label %s with %s: %s\n", path.c_str(), newcontext, strerror(errno));
+		else
+			__sync_fetch_and_add(&relabeled, 1);
 	}
 	freecon(oldcontext);
 	freecon(newcontext);
 	return 0;
 }
 
-int fixPermissions::fixDataDataContexts(void) {
-	string dir = "/data/data/";
-	sehandle = selabel_open(SELABEL_CTX_FILE, selinux_options, 1);
-	if (!sehandle) {
-		LOGINFO("Unable to open /file_contexts\n");
-		return 0;
-	}
-	if (TWFunc::Path_Exists(dir)) {
-		fixContextsRecursively(dir, 0);
+// Relabels what is in dir, with recursive its folders are walked on several threads
+int fixPermissions::fixContexts(string dir, bool recursive) {
+	DIR *d;
+	struct dirent *de;
+	string path;
+
+	dir = TWFunc::Remove_Trailing_Slashes(dir);
+	if (!(d = opendir(dir.c_str())))
+		return -1;
+	contextDirs.clear();
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		path = dir + "/" + de->d_name;
+		restorecon(dirfd(d), de->d_name, path);
+		if (recursive && isDirEntry(dirfd(d), de, DT_DIR))
+			contextDirs.push_back(path);
 	}
-	selabel_close(sehandle);
+	closedir(d);
+	return runJobs(&fixPermissions::fixContextsJob, contextDirs.size());
+}
+
+int fixPermissions::fixContextsJob(size_t index) {
+	fixContextsRecursively(contextDirs[index]);
 	return 0;
 }
 
-int fixPermissions::fixContextsRecursively(string name, int level) {
+int fixPermissions::fixContextsRecursively(const string& name) {
 	DIR *d;
 	struct dirent *de;
-	struct stat sb;
 	string path;
 
 	if (!(d = opendir(name.c_str())))
 		return -1;
-	if (!(de = readdir(d)))
-		return -1;
-
-	do {
-		if (de->d_type ==  DT_DIR) {
-			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
-				continue;
-			path = name + "/" + de->d_name;
-			restorecon(path, &sb);
-			fixContextsRecursively(path, level + 1);
-		}
-		else {
-			path = name + "/" + de->d_name;
-			restorecon(path, &sb);
-		}
-	} while (de = readdir(d));
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		path = name + "/" + de->d_name;
+		restorecon(dirfd(d), de->d_name, path);
+		if (isDirEntry(dirfd(d), de, DT_DIR))
+			fixContextsRecursively(path);
+	}
 	closedir(d);
 	return 0;
 }
 
 int fixPermissions::fixDataInternalContexts(void) {
-	DIR *d;
-	struct dirent *de;
-	struct stat sb;
 	string dir, androiddir;
+
 	sehandle = selabel_open(SELABEL_CTX_FILE, selinux_options, 1);
 	if (!sehandle) {
 		LOGINFO("Unable to open /file_contexts\n");
@@ -126,25 +218,19 @@ int fixPermissions::fixDataInternalContexts(void) {
 		dir = "/data/media";
 	if (!TWFunc::Path_Exists(dir)) {
 		LOGINFO("fixDataInternalContexts: '%s' does not exist!\n", dir.c_str());
+		selabel_close(sehandle);
 		return 0;
 	}
 	LOGINFO("Fixing %s contexts\n", dir.c_str());
-	restorecon(dir, &sb);
-	d = opendir(dir.c_str());
-
-	while (( de = readdir(d)) != NULL) {
-		stat(de->d_name, &sb);
-		string f;
-		f = dir + "/" + de->d_name;
-		restorecon(f, &sb);
-	}
-	closedir(d);
+	labelsExamined = relabeled = 0;
+	restorecon(AT_FDCWD, dir.c_str(), dir);
+	fixContexts(dir, false);
 
-	androiddir = dir + "/Android/";
-	if (TWFunc::Path_Exists(androiddir)) {
-		fixContextsRecursively(androiddir, 0);
-	}
+	androiddir = dir + "/Android";
+	if (TWFunc::Path_Exists(androiddir))
+		fixContexts(androiddir, true);
 	selabel_close(sehandle);
+	LOGINFO("Checked %lu contexts in %s, relabeled %lu\n", labelsExamined, dir.c_str(), relabeled);
 	return 0;
 }
 #endif
@@ -154,6 +240,7 @@ int fixPermissions::fixPerms(bool enable_debug, bool remove_data_for_missing_app
 	debug = enable_debug;
 	remove_data = remove_data_for_missing_apps;
 	multi_user = TWFunc::Path_Exists("/data/user");
+	examined = changed = 0;
 
 	if (!(TWFunc::Path_Exists(packageFile))) {
 		gui_print("Can't check permissions\n");
@@ -170,12 +257,12 @@ int fixPermissions::fixPerms(bool enable_debug, bool remove_data_for_missing_app
 	}
 
 	gui_print("Fixing /system/app permissions...\n");
-	if ((fixSystemApps()) != 0) {
+	if (runJobs(&fixPermissions::fixSystemApp, packages.size()) != 0) {
 		return -1;
 	}
 
 	gui_print("Fixing /data/app permissions...\n");
-	if ((fixDataApps()) != 0) {
+	if (runJobs(&fixPermissions::fixDataApp, packages.size()) != 0) {
 		return -1;
 	}
 
@@ -218,7 +305,8 @@ int fixPermissions::fixPerms(bool enable_debug, bool remove_data_for_missing_app
 					continue;
 				}
 				gui_print("Fixing %s permissions...\n", new_path.c_str());
-				if ((fixDataData(new_path)) != 0) {
+				dataDir = new_path;
+				if (runJobs(&fixPermissions::fixDataData, packages.size()) != 0) {
 					closedir(d);
 					return -1;
 				}
@@ -227,457 +315,369 @@ int fixPermissions::fixPerms(bool enable_debug, bool remove_data_for_missing_app
 		}
 	} else {
 		gui_print("Fixing /data/data permissions...\n");
-		if ((fixDataData("/data/data/")) != 0) {
+		dataDir = "/data/data/";
+		if (runJobs(&fixPermissions::fixDataData, packages.size()) != 0) {
 			return -1;
 		}
 	}
+	gui_print("Checked %lu files, fixed %lu.\n", examined, changed);
 	#ifdef HAVE_SELINUX
 	gui_print("Fixing /data/data/ contexts.\n");
-	fixDataDataContexts();
+	sehandle = selabel_open(SELABEL_CTX_FILE, selinux_options, 1);
+	if (!sehandle) {
+		LOGINFO("Unable to open /file_contexts\n");
+	} else {
+		labelsExamined = relabeled = 0;
+		if (TWFunc::Path_Exists("/data/data/"))
+			fixContexts("/data/data/", true);
+		selabel_close(sehandle);
+		gui_print("Checked %lu contexts, relabeled %lu.\n", labelsExamined, relabeled);
+	}
 	fixDataInternalContexts();
 	#endif
 	gui_print("Done fixing permissions.\n");
 	return 0;
 }
 
-int fixPermissions::pchown(string fn, int puid, int pgid) {
-	LOGINFO("Fixing %s, uid: %d, gid: %d\n", fn.c_str(), puid, pgid);
-	if (chown(fn.c_str(), puid, pgid) != 0) {
-		LOGERR("Unable to chown '%s' %i %i\n", fn.c_str(), puid, pgid);
+// Sets owner and mode of name in dirfd, entries that already have them are left alone
+int fixPermissions::fixEntry(int dirfd, const char* name, const string& path, int uid, int gid, mode_t mode) {
+	struct stat st;
+	bool chowned = false;
+
+	__sync_fetch_and_add(&examined, 1);
+	if (fstatat(dirfd, name, &st, 0) != 0) {
+		LOGERR("Unable to stat '%s'\n", path.c_str());
 		return -1;
 	}
-	return 0;
-}
-
-int fixPermissions::pchmod(string fn, string mode) {
-	long mask = 0;
-	LOGINFO("Fixing %s, mode: %s\n", fn.c_str(), mode.c_str());
-	for ( std::string::size_type n = 0; n < mode.length(); ++n) {
-		if (n == 0) {
-			if (mode[n] == '0')
-				continue;
-			else if (mode[n] == '1')
-				mask = S_ISVTX;
-			else if (mode[n] == '2')
-				mask = S_ISGID;
-		}
-		else if (n == 1) {
-			if (mode[n] == '7') {
-				mask |= S_IRWXU;
-			}
-			if (mode[n] == '6') {
-				mask |= S_IRUSR;
-				mask |= S_IWUSR;
-			}
-			if (mode[n] == '5') {
-				mask |= S_IRUSR;
-				mask |= S_IXUSR;
-			}
-			if (mode[n] == '4')
-				mask |= S_IRUSR;
-			if (mode[n] == '3') {
-				mask |= S_IWUSR;
-				mask |= S_IRUSR;
-			}
-			if (mode[n] == '2')
-				mask |= S_IWUSR;
-			if (mode[n] == '1')
-				mask |= S_IXUSR;
-		}
-		else if (n == 2) {
-			if (mode[n] == '7') {
-				mask |= S_IRWXG;
-			}
-			if (mode[n] == '6') {
-				mask |= S_IRGRP;
-				mask |= S_IWGRP;
-			}
-			if (mode[n] == '5') {
-				mask |= S_IRGRP;
-				mask |= S_IXGRP;
-			}
-			if (mode[n] == '4')
-				mask |= S_IRGRP;
-			if (mode[n] == '3') {
-				mask |= S_IWGRP;
-				mask |= S_IXGRP;
-			}
-			if (mode[n] == '2')
-				mask |= S_IWGRP;
-			if (mode[n] == '1')
-				mask |= S_IXGRP;
-		}
-		else if (n == 3) {
-			if (mode[n] == '7') {
-				mask |= S_IRWXO;
-			}
-			if (mode[n] == '6') {
-				mask |= S_IROTH;
-				mask |= S_IWOTH;
-			}
-			if (mode[n] == '5') {
-				mask |= S_IROTH;
-				mask |= S_IXOTH;
-			}
-			if (mode[n] == '4')
-				mask |= S_IROTH;
-			if (mode[n] == '3') {
-				mask |= S_IWOTH;
-				mask |= S_IXOTH;
-			}
-			if (mode[n] == '2')
-				mask |= S_IWOTH;
-			if (mode[n] == '1')
-				mask |= S_IXOTH;
+	if (st.st_uid != (uid_t)uid || st.st_gid != (gid_t)gid) {
+		LOGINFO("Fixing %s, uid: %d, gid: %d\n", path.c_str(), uid, gid);
+		if (fchownat(dirfd, name, uid, gid, 0) != 0) {
+			LOGERR("Unable to chown '%s' %i %i\n", path.c_str(), uid, gid);
+			return -1;
 		}
+		chowned = true;
 	}
-
-	if (chmod(fn.c_str(), mask) != 0) {
-		LOGERR("Unable to chmod '%s' %l\n", fn.c_str(), mask);
-		return -1;
+	// chown may have cleared the setuid and setgid bits
+	if ((st.st_mode & 07777) != mode || chowned) {
+		if ((st.st_mode & 07777) != mode)
+			LOGINFO("Fixing %s, mode: %04o\n", path.c_str(), (unsigned) mode);
+		if (fchmodat(dirfd, name, mode, 0) != 0) {
+			LOGERR("Unable to chmod '%s' %04o\n", path.c_str(), (unsigned) mode);
+			return -1;
+		}
+		__sync_fetch_and_add(&changed, 1);
 	}
-
 	return 0;
 }
 
-int fixPermissions::fixSystemApps() {
-	temp = head;
-	while (temp != NULL) {
-		if (TWFunc::Path_Exists(temp->codePath)) {
-			if (temp->appDir.compare("/system/app") == 0 || temp->appDir.compare("/system/priv-app") == 0) {
-				if (debug)	{
-					LOGINFO("Looking at '%s'\n", temp->codePath.c_str());
-					LOGINFO("Fixing permissions on '%s'\n", temp->pkgName.c_str());
-					LOGINFO("Directory: '%s'\n", temp->appDir.c_str());
-					LOGINFO("Original package owner: %d, group: %d\n", temp->uid, temp->gid);
-				}
-				if (pchown(temp->codePath, 0, 0) != 0)
-					return -1;
-				if (pchmod(temp->codePath, "0644") != 0)
-					return -1;
-			}
-		} else {
-			//Remove data directory since app isn't installed
-			if (remove_data && TWFunc::Path_Exists(temp->dDir) && temp->appDir.size() >= 9 && temp->appDir.substr(0, 9) != "/mnt/asec") {
-				if (debug)
-					LOGINFO("Looking at '%s', removing data dir: '%s', appDir: '%s'", temp->codePath.c_str(), temp->dDir.c_str(), temp->appDir.c_str());
-				if (TWFunc::removeDir(temp->dDir, false) != 0) {
-					LOGINFO("Unable to removeDir '%s'\n", temp->dDir.c_str());
-					return -1;
-				}
-			}
+int fixPermissions::removeDataDir(package* pkg) {
+	// An updated system app is still installed if its update is
+	const package* installed = findPackage(pkg->pkgName);
+	if (installed != NULL && installed != pkg && TWFunc::Path_Exists(installed->codePath))
+		return 0;
+	//Remove data directory since app isn't installed
+	if (remove_data && TWFunc::Path_Exists(pkg->dDir) && pkg->appDir.size() >= 9 && pkg->appDir.substr(0, 9) != "/mnt/asec") {
+		if (debug)
+			LOGINFO("Looking at '%s', removing data dir: '%s', appDir: '%s'", pkg->codePath.c_str(), pkg->dDir.c_str(), pkg->appDir.c_str());
+		if (TWFunc::removeDir(pkg->dDir, false) != 0) {
+			LOGINFO("Unable to removeDir '%s'\n", pkg->dDir.c_str());
+			return -1;
 		}
-		temp = temp->next;
 	}
 	return 0;
 }
 
-int fixPermissions::fixDataApps() {
-	bool fix = false;
-	int new_gid = 0;
-	string perms = "0000";
-
-	temp = head;
-	while (temp != NULL) {
-		if (TWFunc::Path_Exists(temp->codePath)) {
-			if (temp->appDir.compare("/data/app") == 0 || temp->appDir.compare("/sd-ext/app") == 0) {
-				fix = true;
-				new_gid = 1000;
-				perms = "0644";
-			} else if (temp->appDir.compare("/data/app-private") == 0 || temp->appDir.compare("/sd-ext/app-private") == 0) {
-				fix = true;
-				new_gid = temp->gid;
-				perms = "0640";
-			} else
-				fix = false;
-			if (fix) {
-				if (debug) {
-					LOGINFO("Looking at '%s'\n", temp->codePath.c_str());
-					LOGINFO("Fixing permissions on '%s'\n", temp->pkgName.c_str());
-					LOGINFO("Directory: '%s'\n", temp->appDir.c_str());
-					LOGINFO("Original package owner: %d, group: %d\n", temp->uid, temp->gid);
-				}
-				if (pchown(temp->codePath, 1000, new_gid) != 0)
-					return -1;
-				if (pchmod(temp->codePath, perms) != 0)
-					return -1;
-			}
-		} else {
-			//Remove data directory since app isn't installed
-			if (remove_data && TWFunc::Path_Exists(temp->dDir) && temp->appDir.size() >= 9 && temp->appDir.substr(0, 9) != "/mnt/asec") {
-				if (debug)
-					LOGINFO("Looking at '%s', removing data dir: '%s', appDir: '%s'", temp->codePath.c_str(), temp->dDir.c_str(), temp->appDir.c_str());
-				if (TWFunc::removeDir(temp->dDir, false) != 0) {
-					LOGINFO("Unable to removeDir '%s'\n", temp->dDir.c_str());
-					return -1;
-				}
-			}
+int fixPermissions::fixSystemApp(size_t index) {
+	package* pkg = &packages[index];
+
+	if (!TWFunc::Path_Exists(pkg->codePath))
+		return removeDataDir(pkg);
+	if (pkg->appDir.compare("/system/app") == 0 || pkg->appDir.compare("/system/priv-app") == 0) {
+		if (debug)	{
+			LOGINFO("Looking at '%s'\n", pkg->codePath.c_str());
+			LOGINFO("Fixing permissions on '%s'\n", pkg->pkgName.c_str());
+			LOGINFO("Directory: '%s'\n", pkg->appDir.c_str());
+			LOGINFO("Original package owner: %d, group: %d\n", pkg->uid, pkg->gid);
 		}
-		temp = temp->next;
+		if (fixEntry(AT_FDCWD, pkg->codePath.c_str(), pkg->codePath, 0, 0, 0644) != 0)
+			return -1;
 	}
 	return 0;
 }
 
-int fixPermissions::fixAllFiles(string directory, int gid, int uid, string file_perms) {
-	vector <string> files;
-	string file;
-
-	files = listAllFiles(directory);
-	for (unsigned i = 0; i < files.size(); ++i) {
-		file = directory + "/";
-		file.append(files.at(i));
-		if (debug)
-			LOGINFO("Looking at file '%s'\n", file.c_str());
-		if (pchmod(file, file_perms) != 0)
-			return -1;
-		if (pchown(file, uid, gid) != 0)
-			return -1;
+int fixPermissions::fixDataApp(size_t index) {
+	package* pkg = &packages[index];
+	int new_gid;
+	mode_t perms;
+
+	if (!TWFunc::Path_Exists(pkg->codePath))
+		return removeDataDir(pkg);
+	if (pkg->appDir.compare("/data/app") == 0 || pkg->appDir.compare("/sd-ext/app") == 0) {
+		new_gid = 1000;
+		perms = 0644;
+	} else if (pkg->appDir.compare("/data/app-private") == 0 || pkg->appDir.compare("/sd-ext/app-private") == 0) {
+		new_gid = pkg->gid;
+		perms = 0640;
+	} else
+		return 0;
+	if (debug) {
+		LOGINFO("Looking at '%s'\n", pkg->codePath.c_str());
+		LOGINFO("Fixing permissions on '%s'\n", pkg->pkgName.c_str());
+		LOGINFO("Directory: '%s'\n", pkg->appDir.c_str());
+		LOGINFO("Original package owner: %d, group: %d\n", pkg->uid, pkg->gid);
 	}
-	return 0;
+	return fixEntry(AT_FDCWD, pkg->codePath.c_str(), pkg->codePath, 1000, new_gid, perms);
 }
 
-int fixPermissions::fixDataData(string dataDir) {
-	string directory, dir;
-
-	temp = head;
-	while (temp != NULL) {
-		dir = dataDir + temp->dDir;
-		if (TWFunc::Path_Exists(dir)) {
-			vector <string> dataDataDirs = listAllDirectories(dir);
-			for (unsigned n = 0; n < dataDataDirs.size(); ++n) {
-				directory = dir + "/";
-				directory.append(dataDataDirs.at(n));
-				if (debug)
-					LOGINFO("Looking at data directory: '%s'\n", directory.c_str());
-				if (dataDataDirs.at(n) == ".") {
-					if (pchmod(directory, "0755") != 0)
-						return -1;
-					if (pchown(directory.c_str(), temp->uid, temp->gid) != 0)
-						return -1;
-					if (fixAllFiles(directory, temp->uid, temp->gid, "0755") != 0)
-						return -1;
-				}
-				else if (dataDataDirs.at(n) == "..") {
-					if (debug)
-						LOGINFO("Skipping ..\n");
-					continue;
-				}
-				else if (dataDataDirs.at(n) == "lib") {
-					if (pchmod(directory.c_str(), "0755") != 0)
-						return -1;
-					if (pchown(directory.c_str(), 1000, 1000) != 0)
-						return -1;
-					if (fixAllFiles(directory, temp->uid, temp->gid, "0755") != 0)
-						return -1;
-				}
-				else if (dataDataDirs.at(n) == "shared_prefs") {
-					if (pchmod(directory.c_str(), "0771") != 0)
-						return -1;
-					if (pchown(directory.c_str(), temp->uid, temp->gid) != 0)
-						return -1;
-					if (fixAllFiles(directory, temp->uid, temp->gid, "0660") != 0)
-						return -1;
-				}
-				else if (dataDataDirs.at(n) == "databases") {
-					if (pchmod(directory.c_str(), "0771") != 0)
-						return -1;
-					if (pchown(directory.c_str(), temp->uid, temp->gid) != 0)
-						return -1;
-					if (fixAllFiles(directory, temp->uid, temp->gid, "0660") != 0)
-						return -1;
-				}
-				else if (dataDataDirs.at(n) == "cache") {
-					if (pchmod(directory.c_str(), "0771") != 0)
-						return -1;
-					if (pchown(directory.c_str(), temp->uid, temp->gid) != 0)
-						return -1;
-					if (fixAllFiles(directory, temp->uid, temp->gid, "0600") != 0)
-						return -1;
-				}
-				else {
-					if (pchmod(directory.c_str(), "0771") != 0)
-						return -1;
-					if (pchown(directory.c_str(), temp->uid, temp->gid) != 0)
-						return -1;
-					if (fixAllFiles(directory, temp->uid, temp->gid, "0755") != 0)
-						return -1;
-				}
-			}
+// Fixes the regular files in the folder name of parentfd
+int fixPermissions::fixAllFiles(int parentfd, const char* name, const string& directory, int uid, int gid, mode_t file_perms) {
+	DIR *d;
+	struct dirent *de;
+	int fd;
+
+	fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || (d = fdopendir(fd)) == NULL) {
+		LOGERR("Error opening '%s'\n", directory.c_str());
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (!isDirEntry(fd, de, DT_REG))
+			continue;
+		if (fixEntry(fd, de->d_name, directory + "/" + de->d_name, uid, gid, file_perms) != 0) {
+			closedir(d);
+			return -1;
 		}
-		temp = temp->next;
 	}
+	closedir(d);
 	return 0;
 }
 
-vector <string> fixPermissions::listAllDirectories(string path) {
-	DIR *dir = opendir(path.c_str());
-	vector <string> dirs;
+int fixPermissions::fixDataData(size_t index) {
+	package* pkg = &packages[index];
+	string dir = dataDir + pkg->dDir, directory;
+	DIR *d;
+	struct dirent *de;
+	int ret = 0;
 
-	if (dir == NULL) {
-		LOGERR("Error opening '%s'\n", path.c_str());
-		return dirs;
-	}
-	struct dirent *entry = readdir(dir);
-	while (entry != NULL) {
-		if (entry->d_type == DT_DIR)
-			dirs.push_back(entry->d_name);
-		entry = readdir(dir);
+	if (!(d = opendir(dir.c_str())))
+		return 0;
+	while (ret == 0 && (de = readdir(d)) != NULL) {
+		int fd = dirfd(d), dir_uid = pkg->uid, dir_gid = pkg->gid;
+		mode_t dir_perms = 0771, file_perms = 0755;
+
+		if (!isDirEntry(fd, de, DT_DIR) || strcmp(de->d_name, "..") == 0)
+			continue;
+		directory = dir + "/" + de->d_name;
+		if (debug)
+			LOGINFO("Looking at data directory: '%s'\n", directory.c_str());
+		if (strcmp(de->d_name, ".") == 0) {
+			dir_perms = 0755;
+		} else if (strcmp(de->d_name, "lib") == 0) {
+			dir_perms = 0755;
+			dir_uid = dir_gid = 1000;
+		} else if (strcmp(de->d_name, "shared_prefs") == 0 || strcmp(de->d_name, "databases") == 0) {
+			file_perms = 0660;
+		} else if (strcmp(de->d_name, "cache") == 0) {
+			file_perms = 0600;
+		}
+		ret = fixEntry(fd, de->d_name, directory, dir_uid, dir_gid, dir_perms);
+		if (ret == 0)
+			ret = fixAllFiles(fd, de->d_name, directory, pkg->uid, pkg->gid, file_perms);
 	}
-	closedir(dir);
-	return dirs;
+	closedir(d);
+	return ret;
 }
 
-vector <string> fixPermissions::listAllFiles(string path) {
-	DIR *dir = opendir(path.c_str());
-	vector <string> files;
+// packages.xml is read in pieces of this size
+#define PACKAGES_READ_SIZE (64 * 1024)
+// Longest tag that is accepted, packages.xml is not valid if one is longer
+#define PACKAGES_MAX_TAG (1024 * 1024)
 
-	if (dir == NULL) {
-		LOGERR("Error opening '%s'\n", path.c_str());
-		return files;
-	}
-	struct dirent *entry = readdir(dir);
-	while (entry != NULL) {
-		if (entry->d_type == DT_REG)
-			files.push_back(entry->d_name);
-		entry = readdir(dir);
+static const char* skipPackages[] = {
+	"/system/framework/framework-res.apk",
+	"/system/framework/com.htc.resources.apk",
+	NULL
+};
+
+static string decodeEntities(const string& value) {
+	static const char* entities[][2] = {
+		{ "&amp;", "&" }, { "&lt;", "<" }, { "&gt;", ">" }, { "&quot;", "\"" }, { "&apos;", "'" }, { NULL, NULL }
+	};
+	string decoded;
+	size_t pos = 0, amp;
+
+	while ((amp = value.find('&', pos)) != string::npos) {
+		decoded.append(value, pos, amp - pos);
+		int n;
+		for (n = 0; entities[n][0]; n++) {
+			size_t len = strlen(entities[n][0]);
+			if (value.compare(amp, len, entities[n][0]) == 0) {
+				decoded += entities[n][1];
+				pos = amp + len;
+				break;
+			}
+		}
+		if (!entities[n][0]) {
+			decoded += '&';
+			pos = amp + 1;
+		}
 	}
-	closedir(dir);
-	return files;
+	decoded.append(value, pos, string::npos);
+	return decoded;
 }
 
-int fixPermissions::getPackages() {
-	int len = 0;
-	bool skiploop = false;
-	vector <string> skip;
-	string name;
-	head = NULL;
-
-	skip.push_back("/system/framework/framework-res.apk");
-	skip.push_back("/system/framework/com.htc.resources.apk");
-
-	ifstream xmlFile(packageFile.c_str());
-	xmlFile.seekg(0, ios::end);
-	len = (int) xmlFile.tellg();
-	xmlFile.seekg(0, ios::beg);
-	char xmlBuf[len + 1];
-	xmlFile.read(&xmlBuf[0], len);
-	xmlBuf[len] = '\0';
-	xml_document<> pkgDoc;
-	LOGINFO("parsing package, %i...\n", len);
-	pkgDoc.parse<parse_full>(&xmlBuf[0]);
-
-	xml_node<> * pkgNode = pkgDoc.first_node("packages");
-	if (pkgNode == NULL) {
-		LOGERR("No packages found to fix.\n");
-		return -1;
-	}
-	xml_node <> * next = pkgNode->first_node("package");
-	if (next == NULL) {
-		LOGERR("No package found to fix.\n");
-		return -1;
+// Handles the tag between < and >, only package and updated-package
+// elements right below packages are kept
+int fixPermissions::parseTag(const string& tag, int& depth) {
+	if (tag.empty() || tag[0] == '?' || tag[0] == '!')
+		return 0;
+	if (tag[0] == '/') {
+		depth--;
+		return 0;
 	}
+	bool closed = tag[tag.size() - 1] == '/';
+	size_t end = tag.find_first_of(" \t\r\n/");
+	string element = tag.substr(0, end);
+	int level = depth;
+	if (!closed)
+		depth++;
+	if (level != 1 || (element != "package" && element != "updated-package"))
+		return 0;
 
-	//Get packages
-	while (next->first_attribute("name") != NULL) {
-		package* temp = new package;
-		for (unsigned n = 0; n < skip.size(); ++n) {
-			if (skip.at(n).compare(next->first_attribute("codePath")->value()) == 0) {
-				skiploop = true;
-				break;
-			}
-		}
+	string name, codePath, userId, sharedUserId;
+	size_t pos = end;
+	while (pos < tag.size()) {
+		size_t attr = tag.find_first_not_of(" \t\r\n/", pos);
+		if (attr == string::npos)
+			break;
+		size_t eq = tag.find('=', attr);
+		if (eq == string::npos)
+			break;
+		size_t quote = tag.find_first_of("\"'", eq);
+		if (quote == string::npos)
+			break;
+		size_t close = tag.find(tag[quote], quote + 1);
+		if (close == string::npos)
+			break;
+		string attrName = tag.substr(attr, tag.find_first_of(" \t\r\n=", attr) - attr);
+		string value = decodeEntities(tag.substr(quote + 1, close - quote - 1));
+		if (attrName == "name")
+			name = value;
+		else if (attrName == "codePath")
+			codePath = value;
+		else if (attrName == "userId")
+			userId = value;
+		else if (attrName == "sharedUserId")
+			sharedUserId = value;
+		pos = close + 1;
+	}
 
-		if (skiploop == true) {
+	if (name.empty())
+		return 0;
+	for (int n = 0; skipPackages[n]; n++) {
+		if (codePath == skipPackages[n]) {
 			if (debug)
-				LOGINFO("Skipping package %s\n", next->first_attribute("codePath")->value());
-			free(temp);
-			next = next->next_sibling();
-			skiploop = false;
-			continue;
+				LOGINFO("Skipping package %s\n", codePath.c_str());
+			return 0;
 		}
-		name.append((next->first_attribute("name")->value()));
-		temp->pkgName = next->first_attribute("name")->value();
-		if (debug)
-			LOGINFO("Loading pkg: %s\n", next->first_attribute("name")->value());
-		if (next->first_attribute("codePath") == NULL) {
-			LOGINFO("Problem with codePath on %s\n", next->first_attribute("name")->value());
-		} else {
-			temp->codePath = next->first_attribute("codePath")->value();
-			temp->app = basename(next->first_attribute("codePath")->value());
-			temp->appDir = dirname(next->first_attribute("codePath")->value());
-		}
-		temp->dDir = name;
-		if ( next->first_attribute("sharedUserId") != NULL) {
-			temp->uid = atoi(next->first_attribute("sharedUserId")->value());
-			temp->gid = atoi(next->first_attribute("sharedUserId")->value());
-		}
-		else {
-			if (next->first_attribute("userId") == NULL) {
-				LOGINFO("Problem with userID on %s\n", next->first_attribute("name")->value());
-			} else {
-				temp->uid = atoi(next->first_attribute("userId")->value());
-				temp->gid = atoi(next->first_attribute("userId")->value());
-			}
-		}
-		temp->next = head;
-		head = temp;
-		if (next->next_sibling("package") == NULL)
-			break;
-		name.clear();
-		next = next->next_sibling("package");
-	}
-	//Get updated packages
-	next = pkgNode->first_node("updated-package");
-	if (next != NULL) {
-		while (next->first_attribute("name") != NULL) {
-			package* temp = new package;
-			for (unsigned n = 0; n < skip.size(); ++n) {
-				if (skip.at(n).compare(next->first_attribute("codePath")->value()) == 0) {
-					skiploop = true;
-					break;
-				}
-			}
+	}
+	if (debug)
+		LOGINFO("Loading pkg: %s\n", name.c_str());
+
+	package pkg;
+	pkg.pkgName = name;
+	pkg.dDir = name;
+	if (codePath.empty()) {
+		LOGINFO("Problem with codePath on %s\n", name.c_str());
+	} else {
+		pkg.codePath = codePath;
+		size_t slash = codePath.find_last_of('/');
+		pkg.app = slash == string::npos ? codePath : codePath.substr(slash + 1);
+		pkg.appDir = slash == string::npos ? "." : slash == 0 ? "/" : codePath.substr(0, slash);
+	}
+	if (!sharedUserId.empty()) {
+		pkg.uid = pkg.gid = atoi(sharedUserId.c_str());
+	} else if (!userId.empty()) {
+		pkg.uid = pkg.gid = atoi(userId.c_str());
+	} else {
+		// Without an id its files would be given to root
+		LOGINFO("Problem with userID on %s\n", name.c_str());
+		return 0;
+	}
+	if (element == "package")
+		packageIndex.insert(make_pair(name, packages.size()));
+	packages.push_back(pkg);
+	return 0;
+}
 
-			if (skiploop == true) {
-				if (debug)
-					LOGINFO("Skipping package %s\n", next->first_attribute("codePath")->value());
-				free(temp);
-				next = next->next_sibling();
-				skiploop = false;
+const fixPermissions::package* fixPermissions::findPackage(const string& name) {
+	map<string, size_t>::iterator it = packageIndex.find(name);
+	return it == packageIndex.end() ? NULL : &packages[it->second];
+}
+
+// Reads packages.xml a piece at a time, keeping only what is not parsed yet
+int fixPermissions::getPackages() {
+	char buf[PACKAGES_READ_SIZE];
+	string pending;
+	int fd, depth = 0;
+	ssize_t len;
+	size_t total = 0;
+
+	packages.clear();
+	packageIndex.clear();
+	fd = open(packageFile.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		LOGERR("Unable to open '%s': %s\n", packageFile.c_str(), strerror(errno));
+		return -1;
+	}
+	while ((len = read(fd, buf, sizeof(buf))) != 0) {
+		if (len < 0) {
+			if (errno == EINTR)
 				continue;
+			LOGERR("Unable to read '%s': %s\n", packageFile.c_str(), strerror(errno));
+			close(fd);
+			return -1;
+		}
+		total += len;
+		pending.append(buf, len);
+
+		size_t pos = 0;
+		for (;;) {
+			size_t start = pending.find('<', pos);
+			if (start == string::npos) {
+				pos = pending.size();
+				break;
 			}
-			name.append((next->first_attribute("name")->value()));
-			temp->pkgName = next->first_attribute("name")->value();
-			if (debug)
-				LOGINFO("Loading pkg: %s\n", next->first_attribute("name")->value());
-			if (next->first_attribute("codePath") == NULL) {
-				LOGINFO("Problem with codePath on %s\n", next->first_attribute("name")->value());
+			size_t end;
+			if (pending.compare(start, 4, "<!--") == 0) {
+				end = pending.find("-->", start + 4);
+				if (end != string::npos)
+					end += 2;
 			} else {
-				temp->codePath = next->first_attribute("codePath")->value();
-				temp->app = basename(next->first_attribute("codePath")->value());
-				temp->appDir = dirname(next->first_attribute("codePath")->value());
+				end = pending.find('>', start);
 			}
-
-			temp->dDir = name;
-			if ( next->first_attribute("sharedUserId") != NULL) {
-				temp->uid = atoi(next->first_attribute("sharedUserId")->value());
-				temp->gid = atoi(next->first_attribute("sharedUserId")->value());
-			}
-			else {
-				if (next->first_attribute("userId") == NULL) {
-					LOGINFO("Problem with userID on %s\n", next->first_attribute("name")->value());
-				} else {
-					temp->uid = atoi(next->first_attribute("userId")->value());
-					temp->gid = atoi(next->first_attribute("userId")->value());
-				}
-			}
-			temp->next = head;
-			head = temp;
-			if (next->next_sibling("package") == NULL)
+			if (end == string::npos) {
+				pos = start;
 				break;
-			name.clear();
-			next = next->next_sibling("package");
+			}
+			parseTag(pending.substr(start + 1, end - start - 1), depth);
+			pos = end + 1;
 		}
+		pending.erase(0, pos);
+		if (pending.size() > PACKAGES_MAX_TAG) {
+			LOGERR("Unable to parse '%s'\n", packageFile.c_str());
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	LOGINFO("parsed packages, %lu bytes, %lu packages\n", (unsigned long) total, (unsigned long) packages.size());
+
+	if (packages.empty()) {
+		LOGERR("No packages found to fix.\n");
+		return -1;
 	}
 	return 0;
 }
@@ -3,36 +3,26 @@
 #include <sstream>
 #include <string>
 #include <vector>
+#include <map>
 #include <string.h>
 #include <libgen.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
-#include "gui/rapidxml.hpp"
+#include <pthread.h>
 #include "twrp-functions.hpp"
 
 using namespace std;
 
 class fixPermissions {
 	public:
+		fixPermissions();
+		virtual ~fixPermissions();
 		int fixPerms(bool enable_debug, bool remove_data_for_missing_apps);
 		int fixDataInternalContexts(void);
 
 	private:
-		int pchown(std::string fn, int puid, int pgid);
-		int pchmod(std::string fn, string mode);
-		vector <string> listAllDirectories(std::string path);
-		vector <string> listAllFiles(std::string path);
-		int getPackages();
-		int fixSystemApps();
-		int fixDataApps();
-		int fixAllFiles(string directory, int gid, int uid, string file_perms);
-		int fixDataData(string dataDir);
-		int restorecon(std::string entry, struct stat *sb);
-		int fixDataDataContexts(void);
-		int fixContextsRecursively(std::string path, int level);
-
 		struct package {
 			string pkgName;
 			string codePath;
@@ -41,12 +31,46 @@ class fixPermissions {
 			string dDir;
 			int gid;
 			int uid;
-			package *next;
 		};
+		// Work that is spread over several threads, called once for every index
+		typedef int (fixPermissions::*Job)(size_t index);
+
+		int runJobs(Job job, size_t count);
+		static void* jobThread(void* cookie);
+		void workJobs();
+		int fixEntry(int dirfd, const char* name, const string& path, int uid, int gid, mode_t mode);
+		int fixAllFiles(int parentfd, const char* name, const string& directory, int uid, int gid, mode_t file_perms);
+		int removeDataDir(package* pkg);
+		int getPackages();
+		int parseTag(const string& tag, int& depth);
+		const package* findPackage(const string& name);
+		int fixSystemApp(size_t index);
+		int fixDataApp(size_t index);
+		int fixDataData(size_t index);
+		int restorecon(int dirfd, const char* name, const string& path);
+		int fixContexts(string dir, bool recursive);
+		int fixContextsJob(size_t index);
+		int fixContextsRecursively(const string& path);
+
 		bool debug;
 		bool remove_data;
 		bool multi_user;
-		package* head;
-		package* temp;
 		string packageFile;
+		vector<package> packages;
+		map<string, size_t> packageIndex;  // installed package of each name in packages
+		string dataDir;                  // folder fixDataData works in
+		vector<string> contextDirs;      // folders fixContextsJob relabels
+
+		// shared with the job threads, protected by lock
+		pthread_mutex_t lock;
+		Job currentJob;
+		size_t nextJob;
+		size_t jobCount;
+		bool jobFailed;
+
+		// updated atomically by the job threads
+		unsigned long examined;          // files and folders whose owner and mode were checked
+		unsigned long changed;           // of those, the ones that had to be fixed
+		unsigned long labelsExamined;
+		unsigned long relabeled;
 };
@@ -92,6 +92,8 @@ GUIAction::GUIAction(xml_node<>* node)
 
 		action.mFunction = attr->value();
 		action.mArg = child->value();
+		action.mFunctionTemplate.Compile(action.mFunction);
+		action.mArgTemplate.Compile(action.mArg);
 		mActions.push_back(action);
 
 		child = child->next_sibling("action");
@@ -386,9 +388,9 @@ int GUIAction::doAction(Action action, int isThreaded /* = 0 */)
 	static pthread_t terminal_command;
 	int simulate;
 
-	std::string arg = gui_parse_text(action.mArg);
+	std::string arg = action.mArgTemplate.Parse();
 
-	std::string function = gui_parse_text(action.mFunction);
+	std::string function = action.mFunctionTemplate.Parse();
 
 	DataManager::GetValue(TW_SIMULATE_ACTIONS, simulate);
 
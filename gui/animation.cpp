@@ -140,3 +140,8 @@ int GUIAnimation::Update(void)
 	return 0;
 }
 
+bool GUIAnimation::IsAnimating(void)
+{
+	return mAnimation && mLoop != -2 && isConditionTrue();
+}
+
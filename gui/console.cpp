@@ -16,6 +16,7 @@
 #include <stdlib.h>
 
 #include <string>
+#include <pthread.h>
 
 extern "C" {
 #include "../twcommon.h"
@@ -26,10 +27,45 @@ extern "C" {
 #include "objects.hpp"
 
 
-static std::vector<std::string> gConsole;
-static std::vector<std::string> gConsoleColor;
+// Only the last CONSOLE_MAX_LINES lines are kept
+#define CONSOLE_MAX_LINES 4096
+
+struct ConsoleLine
+{
+	std::string text;
+	int color;
+};
+
+static ConsoleLine gConsole[CONSOLE_MAX_LINES];
+static unsigned int gConsoleCount = 0; // lines printed so far, line n is kept in gConsole[n % CONSOLE_MAX_LINES]
+static std::vector<std::string> gConsoleColors; // interned color names, "normal" is always 0
+static pthread_mutex_t gConsoleLock = PTHREAD_MUTEX_INITIALIZER;
 static FILE* ors_file;
 
+// Must be called with gConsoleLock held
+static int InternConsoleColor(const char *color)
+{
+	if (gConsoleColors.empty())
+		gConsoleColors.push_back("normal");
+
+	for (size_t i = 0; i < gConsoleColors.size(); i++)
+	{
+		if (gConsoleColors[i] == color)
+			return i;
+	}
+	gConsoleColors.push_back(color);
+	return gConsoleColors.size() - 1;
+}
+
+// Must be called with gConsoleLock held
+static void AddConsoleLine(const char *text, int color)
+{
+	ConsoleLine& line = gConsole[gConsoleCount % CONSOLE_MAX_LINES];
+	line.text = text;
+	line.color = color;
+	gConsoleCount++;
+}
+
 extern "C" void __gui_print(const char *color, char *buf)
 {
 	char *start, *next;
@@ -39,13 +75,15 @@ extern "C" void __gui_print(const char *color, char *buf)
 		return;
 	}
 
+	pthread_mutex_lock(&gConsoleLock);
+	int color_id = InternConsoleColor(color);
+
 	for (start = next = buf; *next != '\0';)
 	{
 		if (*next == '\n')
 		{
 			*next = '\0';
-			gConsole.push_back(start);
-			gConsoleColor.push_back(color);
+			AddConsoleLine(start, color_id);
 
 			start = ++next;
 		}
@@ -54,10 +92,11 @@ extern "C" void __gui_print(const char *color, char *buf)
 	}
 
 	// The text after last \n (or whole string if there is no \n)
-	if(*start) {
-		gConsole.push_back(start);
-		gConsoleColor.push_back(color);
-	}
+	if(*start)
+		AddConsoleLine(start, color_id);
+	pthread_mutex_unlock(&gConsoleLock);
+	gui_wakeup();
+
 	if (ors_file) {
 		fprintf(ors_file, "%s\n", buf);
 		fflush(ors_file);
@@ -114,6 +153,8 @@ GUIConsole::GUIConsole(xml_node<>* node) : GUIObject(node)
 	mLastCount = 0;
 	mSlideout = 0;
 	RenderCount = 0;
+	mWrapWidth = -1;
+	mWrapFont = NULL;
 	mSlideoutState = hidden;
 	mRender = true;
 
@@ -192,6 +233,58 @@ int GUIConsole::RenderSlideout(void)
 	return 0;
 }
 
+// Wraps the lines printed since the last call into rows, and drops the
+// rows of lines that are no longer kept
+void GUIConsole::UpdateRows(void* fontResource)
+{
+	// Wrapping depends on the width and font, which differ between consoles
+	if (mWrapWidth != mConsoleW || mWrapFont != fontResource)
+	{
+		mRows.clear();
+		mLastCount = 0;
+		mWrapWidth = mConsoleW;
+		mWrapFont = fontResource;
+	}
+
+	std::vector<std::string> lines;
+	unsigned int first, oldest;
+
+	pthread_mutex_lock(&gConsoleLock);
+	oldest = (gConsoleCount > CONSOLE_MAX_LINES ? gConsoleCount - CONSOLE_MAX_LINES : 0);
+	first = (mLastCount > oldest ? mLastCount : oldest);
+	for (unsigned int i = first; i < gConsoleCount; i++)
+		lines.push_back(gConsole[i % CONSOLE_MAX_LINES].text);
+	mLastCount = gConsoleCount;
+	pthread_mutex_unlock(&gConsoleLock);
+
+	while (!mRows.empty() && mRows.front().line < oldest)
+	{
+		mRows.pop_front();
+		if (mCurrentLine > 0)
+			mCurrentLine--;
+	}
+
+	for (size_t i = 0; i < lines.size(); i++)
+	{
+		const char* text = lines[i].c_str();
+		size_t len = lines[i].size(), offset = 0;
+		ConsoleRow row;
+
+		row.line = first + i;
+		do {
+			size_t width = gr_maxExW(text + offset, fontResource, mConsoleW);
+			if (width < 1)
+				width = 1;
+			if (width > len - offset)
+				width = len - offset;
+			row.offset = offset;
+			row.length = width;
+			mRows.push_back(row);
+			offset += width;
+		} while (offset < len);
+	}
+}
+
 int GUIConsole::RenderConsole(void)
 {
 	void* fontResource = NULL;
@@ -205,34 +298,13 @@ int GUIConsole::RenderConsole(void)
 	gr_color(mScrollColor.red, mScrollColor.green, mScrollColor.blue, mScrollColor.alpha);
 	gr_fill(mConsoleX + (mConsoleW * 9 / 10), mConsoleY, (mConsoleW / 10), mConsoleH);
 
-	// Don't try to continue to render without data
-	int prevCount = mLastCount;
-	mLastCount = gConsole.size();
 	mRender = false;
-	if (mLastCount == 0)
-		return (mSlideout ? RenderSlideout() : 0);
+	UpdateRows(fontResource);
 
-	// Due to word wrap, figure out what / how the newly added text needs to be added to the render vector that is word wrapped
-	// Note, that multiple consoles on different GUI pages may be different widths or use different fonts, so the word wrapping
-	// may different in different console windows
-	for (int i = prevCount; i < mLastCount; i++) {
-		string curr_line = gConsole[i];
-		string curr_color = gConsoleColor[i];
-		int line_char_width;
-		for(;;) {
-			line_char_width = gr_maxExW(curr_line.c_str(), fontResource, mConsoleW);
-			if (line_char_width < curr_line.size()) {
-				rConsole.push_back(curr_line.substr(0, line_char_width));
-				rConsoleColor.push_back(curr_color);
-				curr_line = curr_line.substr(line_char_width);
-			} else {
-				rConsole.push_back(curr_line);
-				rConsoleColor.push_back(curr_color);
-				break;
-			}
-		}
-	}
-	RenderCount = rConsole.size();
+	// Don't try to continue to render without data
+	RenderCount = mRows.size();
+	if (RenderCount == 0)
+		return (mSlideout ? RenderSlideout() : 0);
 
 	// Find the start point
 	int start;
@@ -250,21 +322,42 @@ int GUIConsole::RenderConsole(void)
 		start = curLine - mMaxRows;
 	}
 
-	unsigned int line;
-	for (line = 0; line < mMaxRows; line++)
+	// Only the visible rows are copied out of the console
+	std::vector<std::string> texts;
+	std::vector<int> colors;
+	pthread_mutex_lock(&gConsoleLock);
+	while (mLineColors.size() < gConsoleColors.size())
 	{
-		if ((start + (int) line) >= 0 && (start + (int) line) < (int) RenderCount) {
-			if (rConsoleColor[start + line] == "normal") {
-				gr_color(mForegroundColor.red, mForegroundColor.green, mForegroundColor.blue, mForegroundColor.alpha);
-			} else {
-				COLOR mFontColor;
-				std::string color = rConsoleColor[start + line];
-				ConvertStrToColor(color, &mFontColor);
-				mFontColor.alpha = 255;
-				gr_color(mFontColor.red, mFontColor.green, mFontColor.blue, mFontColor.alpha);
-			}
-			gr_textExW(mConsoleX, mStartY + (line * mFontHeight), rConsole[start + line].c_str(), fontResource, mConsoleW + mConsoleX);
+		COLOR mFontColor = mForegroundColor;
+		if (!mLineColors.empty())
+		{
+			ConvertStrToColor(gConsoleColors[mLineColors.size()], &mFontColor);
+			mFontColor.alpha = 255;
+		}
+		mLineColors.push_back(mFontColor);
+	}
+	for (unsigned int line = 0; line < mMaxRows; line++)
+	{
+		int row = start + (int) line;
+		if (row < 0 || row >= (int) RenderCount || mRows[row].line + CONSOLE_MAX_LINES < gConsoleCount)
+		{
+			texts.push_back(std::string());
+			colors.push_back(-1);
+			continue;
 		}
+		const ConsoleLine& l = gConsole[mRows[row].line % CONSOLE_MAX_LINES];
+		texts.push_back(l.text.substr(mRows[row].offset, mRows[row].length));
+		colors.push_back(l.color);
+	}
+	pthread_mutex_unlock(&gConsoleLock);
+
+	for (unsigned int line = 0; line < mMaxRows; line++)
+	{
+		if (colors[line] < 0)
+			continue;
+		const COLOR& c = mLineColors[colors[line]];
+		gr_color(c.red, c.green, c.blue, c.alpha);
+		gr_textExW(mConsoleX, mStartY + (line * mFontHeight), texts[line].c_str(), fontResource, mConsoleW + mConsoleX);
 	}
 	return (mSlideout ? RenderSlideout() : 0);
 }
@@ -301,7 +394,7 @@ int GUIConsole::Update(void)
 		return 2;
 	}
 
-	if (mCurrentLine == -1 && mLastCount != gConsole.size())
+	if (mCurrentLine == -1 && mLastCount != gConsoleCount)
 	{
 		// We can use Render, and return for just a flip
 		Render();
@@ -137,7 +137,8 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIObject(node)
 	}
 
 	// Simple way to check for static state
-	mLastValue = gui_parse_text(mHeaderText);
+	mHeaderTemplate.Compile(mHeaderText);
+	mLastValue = mHeaderTemplate.Parse();
 	if (mLastValue != mHeaderText)
 		mHeaderIsStatic = 0;
 	else
@@ -584,7 +585,7 @@ int GUIFileSelector::Update(void)
 		return 0;
 
 	if (!mHeaderIsStatic) {
-		std::string newValue = gui_parse_text(mHeaderText);
+		std::string newValue = mHeaderTemplate.Parse();
 		if (mLastValue != newValue) {
 			mLastValue = newValue;
 			mUpdate = 1;
@@ -865,6 +866,15 @@ int GUIFileSelector::NotifyTouch(TOUCH_STATE state, int x, int y)
 	return 0;
 }
 
+bool GUIFileSelector::GetVarDependencies(std::set<std::string>& vars)
+{
+	if (!mHeaderIsStatic)
+		mHeaderTemplate.GetVars(vars);
+	vars.insert(mPathVar);
+	vars.insert(mSortVariable);
+	return GUIObject::GetVarDependencies(vars);
+}
+
 int GUIFileSelector::NotifyVarChange(const std::string& varName, const std::string& value)
 {
 	GUIObject::NotifyVarChange(varName, value);
@@ -877,7 +887,7 @@ int GUIFileSelector::NotifyVarChange(const std::string& varName, const std::stri
 		DataManager::SetValue(mVariable, "");
 	}
 	if (!mHeaderIsStatic) {
-		std::string newValue = gui_parse_text(mHeaderText);
+		std::string newValue = mHeaderTemplate.Parse();
 		if (mLastValue != newValue) {
 			mLastValue = newValue;
 			mStart = 0;
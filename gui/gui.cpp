@@ -87,7 +87,7 @@ static int gRecorder = -1;
 
 extern "C" void gr_write_frame_to_file(int fd);
 
-void flip(void)
+static void recordFrame(void)
 {
 	if (gRecorder != -1)
 	{
@@ -96,9 +96,37 @@ void flip(void)
 		write(gRecorder, &time, sizeof(timespec));
 		gr_write_frame_to_file(gRecorder);
 	}
+}
+
+void flip(void)
+{
+	recordFrame();
 	gr_flip();
 }
 
+// Flips only the areas changed by the last PageManager::Update()
+static void flipDamage(void)
+{
+	std::vector<GUIRect> damage;
+	if (!PageManager::GetDamage(damage))
+	{
+		flip();
+		return;
+	}
+
+	std::vector<gr_rect> rects(damage.size());
+	for (size_t i = 0; i < damage.size(); i++)
+	{
+		rects[i].x = damage[i].x;
+		rects[i].y = damage[i].y;
+		rects[i].w = damage[i].w;
+		rects[i].h = damage[i].h;
+	}
+	recordFrame();
+	if (!rects.empty())
+		gr_flip_rects(&rects[0], rects.size());
+}
+
 void rapidxml::parse_error_handler(const char *what, void *where)
 {
 	fprintf(stderr, "Parser error: %s\n", what);
@@ -181,6 +209,8 @@ void curtainClose()
 #endif
 }
 
+#define INPUT_RESCAN_MS 2000
+
 static void * input_thread(void *cookie)
 {
 
@@ -209,7 +239,22 @@ static void * input_thread(void *cookie)
 		struct input_event ev;
 		int state = 0, ret = 0;
 
-		ret = ev_get(&ev, dontwait);
+		// Sleep until there is input or the next hold/repeat is due, but
+		// come back every couple of seconds so ev_get can find new devices
+		int timeout = INPUT_RESCAN_MS;
+		if (dontwait)
+		{
+			struct timeval curTime;
+			gettimeofday(&curTime, NULL);
+			long elapsed = (curTime.tv_sec - touchStart.tv_sec) * 1000 + (curTime.tv_usec - touchStart.tv_usec) / 1000;
+			long delay = (touch_and_hold || key_repeat == 1) ? 500 : 100;
+			timeout = delay - elapsed + 1;
+			if (timeout < 0)
+				timeout = 0;
+		}
+		ev_wait(timeout);
+
+		ret = ev_get(&ev, 1);
 
 		if (ret < 0)
 		{
@@ -433,6 +478,10 @@ static void * input_thread(void *cookie)
 				key_repeat = 0;
 			}
 		}
+
+		// Let an idle render loop pick up whatever this changed
+		if (ret == 0 || dontwait)
+			gui_wakeup();
 	}
 	return NULL;
 }
@@ -551,6 +600,106 @@ static void loopTimer(void)
 	} while (1);
 }
 
+// Frames are 1/30th of a second apart while the pages change or animate.
+// After IDLE_FRAMES quiet frames the loop sleeps until gui_wakeup() is called
+// for input, a variable change or a forced render, or for IDLE_TIMEOUT_MS so
+// clocks and battery levels still refresh. A blanked screen sleeps until woken.
+#define IDLE_FRAMES 30
+#define IDLE_TIMEOUT_MS 1000
+
+struct FrameTimer
+{
+	timespec lastFrame;
+	int quietFrames;
+	unsigned int wakeSeq;
+	bool initialized;
+};
+
+static pthread_mutex_t gWakeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gWakeCond = PTHREAD_COND_INITIALIZER;
+static unsigned int gWakeSeq = 0;
+
+void gui_wakeup(void)
+{
+	pthread_mutex_lock(&gWakeMutex);
+	gWakeSeq++;
+	pthread_cond_broadcast(&gWakeCond);
+	pthread_mutex_unlock(&gWakeMutex);
+}
+
+// Tells the timer whether the last frame changed anything
+static void frameDone(FrameTimer* timer, bool changed)
+{
+	if (changed || PageManager::IsAnimating())
+		timer->quietFrames = 0;
+	else if (timer->quietFrames < IDLE_FRAMES)
+		timer->quietFrames++;
+}
+
+static void waitForFrame(FrameTimer* timer)
+{
+	if (!timer->initialized)
+	{
+		timer->initialized = true;
+		timer->quietFrames = 0;
+		clock_gettime(CLOCK_MONOTONIC, &timer->lastFrame);
+		pthread_mutex_lock(&gWakeMutex);
+		timer->wakeSeq = gWakeSeq;
+		pthread_mutex_unlock(&gWakeMutex);
+		return;
+	}
+
+	if (timer->quietFrames >= IDLE_FRAMES)
+	{
+		pthread_mutex_lock(&gWakeMutex);
+		if (timer->wakeSeq == gWakeSeq)
+		{
+#ifndef TW_NO_SCREEN_TIMEOUT
+			if (blankTimer.IsScreenOff())
+				pthread_cond_wait(&gWakeCond, &gWakeMutex);
+			else
+#endif
+			{
+				timespec deadline;
+				clock_gettime(CLOCK_REALTIME, &deadline);
+				deadline.tv_sec += IDLE_TIMEOUT_MS / 1000;
+				deadline.tv_nsec += (IDLE_TIMEOUT_MS % 1000) * 1000000L;
+				if (deadline.tv_nsec >= 1000000000L)
+				{
+					deadline.tv_sec++;
+					deadline.tv_nsec -= 1000000000L;
+				}
+				pthread_cond_timedwait(&gWakeCond, &gWakeMutex, &deadline);
+			}
+		}
+		if (timer->wakeSeq != gWakeSeq)
+			timer->quietFrames = 0;
+		timer->wakeSeq = gWakeSeq;
+		pthread_mutex_unlock(&gWakeMutex);
+		clock_gettime(CLOCK_MONOTONIC, &timer->lastFrame);
+		return;
+	}
+
+	for (;;)
+	{
+		timespec curTime;
+		clock_gettime(CLOCK_MONOTONIC, &curTime);
+
+		timespec diff = TWFunc::timespec_diff(timer->lastFrame, curTime);
+		if (diff.tv_sec || diff.tv_nsec > 33333333)
+		{
+			timer->lastFrame = curTime;
+			break;
+		}
+		usleep(33333 - (diff.tv_nsec / 1000));
+	}
+
+	// Wakeups from here on are handled by this frame
+	pthread_mutex_lock(&gWakeMutex);
+	timer->wakeSeq = gWakeSeq;
+	pthread_mutex_unlock(&gWakeMutex);
+}
+
 static int runPages(void)
 {
 	// Raise the curtain
@@ -573,11 +722,15 @@ static int runPages(void)
 	int32_t render_t, flip_t;
 #endif
 
+	FrameTimer timer;
+	timer.initialized = false;
+
 	for (;;)
 	{
-		loopTimer();
+		waitForFrame(&timer);
 
 		if (gGuiConsoleRunning) {
+			frameDone(&timer, false);
 			continue;
 		}
 
@@ -586,29 +739,30 @@ static int runPages(void)
 			int ret;
 
 			ret = PageManager::Update();
+			frameDone(&timer, ret > 0);
 
 #ifndef PRINT_RENDER_TIME
 			if (ret > 1)
-				PageManager::Render();
+				PageManager::RenderDamage();
 
 			if (ret > 0)
-				flip();
+				flipDamage();
 #else
 			if (ret > 1)
 			{
 				clock_gettime(CLOCK_MONOTONIC, &start);
-				PageManager::Render();
+				PageManager::RenderDamage();
 				clock_gettime(CLOCK_MONOTONIC, &end);
 				render_t = TWFunc::timespec_diff_ms(start, end);
 
-				flip();
+				flipDamage();
 				clock_gettime(CLOCK_MONOTONIC, &start);
 				flip_t = TWFunc::timespec_diff_ms(end, start);
 
 				LOGINFO("Render(): %u ms, flip(): %u ms, total: %u ms\n", render_t, flip_t, render_t+flip_t);
 			}
 			else if(ret == 1)
-				flip();
+				flipDamage();
 #endif
 		}
 		else
@@ -618,6 +772,7 @@ static int runPages(void)
 			pthread_mutex_unlock(&gForceRendermutex);
 			PageManager::Render();
 			flip();
+			frameDone(&timer, true);
 		}
 
 		if (DataManager::GetIntValue("tw_gui_done") != 0)
@@ -647,20 +802,24 @@ static int runPage(const char *page_name)
 
 	DataManager::SetValue("tw_loaded", 1);
 
+	FrameTimer timer;
+	timer.initialized = false;
+
 	for (;;)
 	{
-		loopTimer();
+		waitForFrame(&timer);
 
 		if (!gForceRender)
 		{
 			int ret;
 
 			ret = PageManager::Update();
+			frameDone(&timer, ret > 0);
 			if (ret > 1)
-				PageManager::Render();
+				PageManager::RenderDamage();
 
 			if (ret > 0)
-				flip();
+				flipDamage();
 		}
 		else
 		{
@@ -669,6 +828,7 @@ static int runPage(const char *page_name)
 			pthread_mutex_unlock(&gForceRendermutex);
 			PageManager::Render();
 			flip();
+			frameDone(&timer, true);
 		}
 		if (DataManager::GetIntValue("tw_page_done") != 0)
 		{
@@ -686,6 +846,7 @@ int gui_forceRender(void)
 	pthread_mutex_lock(&gForceRendermutex);
 	gForceRender = 1;
 	pthread_mutex_unlock(&gForceRendermutex);
+	gui_wakeup();
 	return 0;
 }
 
@@ -696,6 +857,7 @@ int gui_changePage(std::string newPage)
 	pthread_mutex_lock(&gForceRendermutex);
 	gForceRender = 1;
 	pthread_mutex_unlock(&gForceRendermutex);
+	gui_wakeup();
 	return 0;
 }
 
@@ -705,6 +867,7 @@ int gui_changeOverlay(std::string overlay)
 	pthread_mutex_lock(&gForceRendermutex);
 	gForceRender = 1;
 	pthread_mutex_unlock(&gForceRendermutex);
+	gui_wakeup();
 	return 0;
 }
 
@@ -714,6 +877,7 @@ int gui_changePackage(std::string newPackage)
 	pthread_mutex_lock(&gForceRendermutex);
 	gForceRender = 1;
 	pthread_mutex_unlock(&gForceRendermutex);
+	gui_wakeup();
 	return 0;
 }
 
@@ -753,6 +917,98 @@ std::string gui_parse_text(string inText)
 	}
 }
 
+void TextTemplate::Compile(const std::string& text)
+{
+	size_t pos = 0;
+	size_t next = 0, end = 0;
+	std::string literal;
+	Token token;
+
+	mText = text;
+	mTokens.clear();
+	mIsStatic = true;
+	mHasMagic = false;
+	mCached = false;
+	mCacheChangeCount = 0;
+	mCache.clear();
+
+	while (1)
+	{
+		next = text.find('%', pos);
+		if (next == std::string::npos)
+			break;
+
+		end = text.find('%', next + 1);
+		if (end == std::string::npos)
+			break;
+
+		mIsStatic = false;
+		literal.append(text, pos, next - pos);
+		if (next + 1 == end)
+			literal += '%';
+		else
+		{
+			if (!literal.empty())
+			{
+				token.text = literal;
+				token.handle = -1;
+				mTokens.push_back(token);
+				literal.clear();
+			}
+			token.text = text.substr(next + 1, (end - next) - 1);
+			token.handle = DataManager::GetHandle(token.text);
+			if (DataManager::IsMagicValue(token.handle))
+				mHasMagic = true;
+			mTokens.push_back(token);
+		}
+		pos = end + 1;
+	}
+
+	literal.append(text, pos, std::string::npos);
+	if (!literal.empty())
+	{
+		token.text = literal;
+		token.handle = -1;
+		mTokens.push_back(token);
+	}
+}
+
+std::string TextTemplate::Parse(void)
+{
+	if (mIsStatic)
+		return mText;
+
+	// Read the count first, a change while parsing makes the next call parse again
+	unsigned int changes = DataManager::GetChangeCount();
+	if (mCached && changes == mCacheChangeCount)
+		return mCache;
+
+	std::string str, value;
+	std::vector<Token>::iterator iter;
+	for (iter = mTokens.begin(); iter != mTokens.end(); ++iter)
+	{
+		if (iter->handle < 0)
+			str += iter->text;
+		else if (DataManager::GetValue(iter->handle, value) == 0)
+			str += value;
+	}
+
+	mCache = str;
+	mCached = !mHasMagic;
+	mCacheChangeCount = changes;
+	return str;
+}
+
+void TextTemplate::GetVars(std::set<std::string>& vars) const
+{
+	std::vector<Token>::const_iterator iter;
+	for (iter = mTokens.begin(); iter != mTokens.end(); ++iter)
+	{
+		if (iter->handle >= 0)
+			vars.insert(iter->text);
+	}
+}
+
 extern "C" int gui_init(void)
 {
 	int fd;
@@ -896,20 +1152,24 @@ static void * console_thread(void *cookie)
 {
 	PageManager::SwitchToConsole();
 
+	FrameTimer timer;
+	timer.initialized = false;
+
 	while (!gGuiConsoleTerminate)
 	{
-		loopTimer();
+		waitForFrame(&timer);
 
 		if (!gForceRender)
 		{
 			int ret;
 
 			ret = PageManager::Update();
+			frameDone(&timer, ret > 0);
 			if (ret > 1)
-				PageManager::Render();
+				PageManager::RenderDamage();
 
 			if (ret > 0)
-				flip();
+				flipDamage();
 
 			if (ret < 0)
 				LOGERR("An update request has failed.\n");
@@ -921,10 +1181,12 @@ static void * console_thread(void *cookie)
 			pthread_mutex_unlock(&gForceRendermutex);
 			PageManager::Render();
 			flip();
+			frameDone(&timer, true);
 		}
 	}
 	gGuiConsoleRunning = 0;
 	gForceRender = 1; // this will kickstart the GUI to render again
+	gui_wakeup();
 	PageManager::EndConsole();
 	LOGINFO("Console stopping\n");
 	return NULL;
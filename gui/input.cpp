@@ -591,6 +591,12 @@ int GUIInput::NotifyTouch(TOUCH_STATE state, int x, int y)
 	return 0;
 }
 
+bool GUIInput::GetVarDependencies(std::set<std::string>& vars)
+{
+	vars.insert(mVariable);
+	return GUIObject::GetVarDependencies(vars);
+}
+
 int GUIInput::NotifyVarChange(const std::string& varName, const std::string& value)
 {
 	GUIObject::NotifyVarChange(varName, value);
@@ -130,7 +130,8 @@ GUIListBox::GUIListBox(xml_node<>* node) : GUIObject(node)
 	}
 
 	// Simple way to check for static state
-	mLastValue = gui_parse_text(mHeaderText);
+	mHeaderTemplate.Compile(mHeaderText);
+	mLastValue = mHeaderTemplate.Parse();
 	if (mLastValue != mHeaderText)
 		mHeaderIsStatic = 0;
 	else
@@ -529,7 +530,7 @@ int GUIListBox::Update(void)
 		return 0;
 
 	if (!mHeaderIsStatic) {
-		std::string newValue = gui_parse_text(mHeaderText);
+		std::string newValue = mHeaderTemplate.Parse();
 		if (mLastValue != newValue) {
 			mLastValue = newValue;
 			mUpdate = 1;
@@ -760,6 +761,14 @@ int GUIListBox::NotifyTouch(TOUCH_STATE state, int x, int y)
 	return 0;
 }
 
+bool GUIListBox::GetVarDependencies(std::set<std::string>& vars)
+{
+	if (!mHeaderIsStatic)
+		mHeaderTemplate.GetVars(vars);
+	vars.insert(mVariable);
+	return GUIObject::GetVarDependencies(vars);
+}
+
 int GUIListBox::NotifyVarChange(const std::string& varName, const std::string& value)
 {
 	GUIObject::NotifyVarChange(varName, value);
@@ -768,7 +777,7 @@ int GUIListBox::NotifyVarChange(const std::string& varName, const std::string& v
 		return 0;
 
 	if (!mHeaderIsStatic) {
-		std::string newValue = gui_parse_text(mHeaderText);
+		std::string newValue = mHeaderTemplate.Parse();
 		if (mLastValue != newValue) {
 			mLastValue = newValue;
 			mStart = 0;
@@ -14,8 +14,10 @@
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include <string>
+#include <map>
 
 extern "C" {
 #include "../twcommon.h"
@@ -57,6 +59,9 @@ GUIObject::GUIObject(xml_node<>* node)
 		attr = condition->first_attribute("var2");
 		if (attr)   cond.mVar2 = attr->value();
 
+		cond.mVar1Handle = DataManager::GetHandle(cond.mVar1);
+		cond.mVar2Handle = DataManager::GetHandle(cond.mVar2);
+
 		mConditions.push_back(cond);
 
 		condition = condition->next_sibling("condition");
@@ -96,30 +101,29 @@ bool GUIObject::isConditionTrue(Condition* condition)
 
 	if (condition->mVar2.empty() && condition->mCompareOp != "modified")
 	{
-		if (!DataManager::GetStrValue(condition->mVar1).empty())
+		if (!DataManager::GetStrValue(condition->mVar1Handle).empty())
 			return bTrue;
 
 		return !bTrue;
 	}
 
 	string var1, var2;
-	if (DataManager::GetValue(condition->mVar1, var1))
+	if (DataManager::GetValue(condition->mVar1Handle, var1))
 		var1 = condition->mVar1;
-	if (DataManager::GetValue(condition->mVar2, var2))
+	if (DataManager::GetValue(condition->mVar2Handle, var2))
 		var2 = condition->mVar2;
 
 	// This is a special case, we stat the file and that determines our result
 	if (var1 == "fileexists")
 	{
-		struct stat st;
-		if (stat(var2.c_str(), &st) == 0)
+		if (checkPath(var2, false))
 			var2 = var1;
 		else
 			var2 = "FAILED";
 	}
 	if (var1 == "mounted")
 	{
-		if (isMounted(condition->mVar2))
+		if (checkPath(condition->mVar2, true))
 			var2 = var1;
 		else
 			var2 = "FAILED";
@@ -155,6 +159,20 @@ bool GUIObject::isConditionValid()
 	return !mConditions.empty();
 }
 
+bool GUIObject::GetVarDependencies(std::set<std::string>& vars)
+{
+	std::vector<Condition>::iterator iter;
+	for (iter = mConditions.begin(); iter != mConditions.end(); ++iter)
+	{
+		// var2 may be a literal, an extra entry only costs a lookup
+		if (!iter->mVar1.empty())
+			vars.insert(iter->mVar1);
+		if (!iter->mVar2.empty())
+			vars.insert(iter->mVar2);
+	}
+	return true;
+}
+
 int GUIObject::NotifyVarChange(const std::string& varName, const std::string& value)
 {
 	mConditionsResult = true;
@@ -185,6 +203,60 @@ int GUIObject::NotifyVarChange(const std::string& varName, const std::string& va
 	return 0;
 }
 
+struct PathCheck
+{
+	bool result;
+	unsigned int changeCount;
+	struct timespec time;
+};
+
+static std::map<std::string, PathCheck> pathChecks;
+static pthread_mutex_t pathChecksLock = PTHREAD_MUTEX_INITIALIZER;
+
+// fileexists and mounted results are reused while no variable changed and for
+// at most PATH_CHECK_INTERVAL_MS, so a page refresh stats each path and reads
+// the mount table only once
+#define PATH_CHECK_INTERVAL_MS 1000
+
+bool GUIObject::checkPath(const std::string& path, bool mounted)
+{
+	std::string key = (mounted ? "m:" : "e:") + path;
+	unsigned int changes = DataManager::GetChangeCount();
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&pathChecksLock);
+	std::map<std::string, PathCheck>::iterator pos = pathChecks.find(key);
+	if (pos != pathChecks.end() && pos->second.changeCount == changes)
+	{
+		long long age = (now.tv_sec - pos->second.time.tv_sec) * 1000LL + (now.tv_nsec - pos->second.time.tv_nsec) / 1000000;
+		if (age < PATH_CHECK_INTERVAL_MS)
+		{
+			bool result = pos->second.result;
+			pthread_mutex_unlock(&pathChecksLock);
+			return result;
+		}
+	}
+	pthread_mutex_unlock(&pathChecksLock);
+
+	bool result;
+	if (mounted)
+		result = isMounted(path);
+	else
+	{
+		struct stat st;
+		result = (stat(path.c_str(), &st) == 0);
+	}
+
+	pthread_mutex_lock(&pathChecksLock);
+	PathCheck& check = pathChecks[key];
+	check.result = result;
+	check.changeCount = changes;
+	check.time = now;
+	pthread_mutex_unlock(&pathChecksLock);
+	return result;
+}
+
 bool GUIObject::isMounted(string vol)
 {
 	FILE *fp;
@@ -23,6 +23,7 @@
 
 #include "rapidxml.hpp"
 #include <vector>
+#include <deque>
 #include <string>
 #include <map>
 #include <set>
@@ -68,9 +69,16 @@ public:
 	//  Return 0 if nothing to update, 1 on success and contiue, >1 if full render required, and <0 on error
 	virtual int Update(void) { return 0; }
 
+	// IsAnimating - Returns true while Update has more frames to show without any input or variable change
+	virtual bool IsAnimating(void) { return false; }
+
 	// GetRenderPos - Returns the current position of the object
 	virtual int GetRenderPos(int& x, int& y, int& w, int& h) { x = mRenderX; y = mRenderY; w = mRenderW; h = mRenderH; return 0; }
 
+	// GetDamageRect - Returns the screen area covered by the object, both where it was last drawn and where it will be drawn next
+	//  Return 0 on success, <0 if the area is not known
+	virtual int GetDamageRect(int& x, int& y, int& w, int& h) { GetRenderPos(x, y, w, h); return (w > 0 && h > 0) ? 0 : -1; }
+
 	// SetRenderPos - Update the position of the object
 	//  Return 0 on success, <0 on error
 	virtual int SetRenderPos(int x, int y, int w = 0, int h = 0) { mRenderX = x; mRenderY = y; if (w || h) { mRenderW = w; mRenderH = h; } return 0; }
@@ -134,16 +142,23 @@ public:
 	//  Returns 0 on success, <0 on error
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
 
+	// GetVarDependencies - Adds the variables NotifyVarChange has to be called for
+	//  Return false to be notified of every variable change
+	virtual bool GetVarDependencies(std::set<std::string>& vars);
+
 protected:
 	class Condition
 	{
 	public:
 		Condition() {
 			mLastResult = true;
+			mVar1Handle = mVar2Handle = -1;
 		}
 
 		std::string mVar1;
 		std::string mVar2;
+		int mVar1Handle;
+		int mVar2Handle;
 		std::string mCompareOp;
 		std::string mLastVal;
 		bool mLastResult;
@@ -153,6 +168,7 @@ protected:
 
 protected:
 	bool isMounted(std::string vol);
+	bool checkPath(const std::string& path, bool mounted);
 	bool isConditionTrue(Condition* condition);
 
 	bool mConditionsResult;
@@ -195,8 +211,12 @@ public:
 	// Retrieve the size of the current string (dynamic strings may change per call)
 	virtual int GetCurrentBounds(int& w, int& h);
 
+	// Returns the area of the last drawn string and of the current string
+	virtual int GetDamageRect(int& x, int& y, int& w, int& h);
+
 	// Notify of a variable change
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+	virtual bool GetVarDependencies(std::set<std::string>& vars);
 
 	// Set maximum width in pixels
 	virtual int SetMaxWidth(unsigned width);
@@ -209,6 +229,7 @@ public:
 
 protected:
 	std::string mText;
+	TextTemplate mTemplate;
 	std::string mLastValue;
 	COLOR mColor;
 	COLOR mHighlightColor;
@@ -219,9 +240,11 @@ protected:
 	unsigned maxWidth;
 	unsigned charSkip;
 	bool hasHighlightColor;
+	int mDrawnX, mDrawnY, mDrawnW, mDrawnH;
 
 protected:
 	std::string parseText(void);
+	void GetTextRect(const std::string& value, int& x, int& y, int& w, int& h);
 };
 
 // GUIImage - Used for static image
@@ -280,6 +303,8 @@ protected:
 	public:
 		std::string mFunction;
 		std::string mArg;
+		TextTemplate mFunctionTemplate;
+		TextTemplate mArgTemplate;
 	};
 
 	std::vector<Action> mActions;
@@ -349,13 +374,24 @@ protected:
 	int mLastTouchX, mLastTouchY;
 	int mSlideout;
 	SlideoutState mSlideoutState;
-	std::vector<std::string> rConsole;
-	std::vector<std::string> rConsoleColor;
 	bool mRender;
 
+	// A wrapped row, referring to part of a console line
+	struct ConsoleRow
+	{
+		unsigned int line;
+		unsigned int offset;
+		unsigned int length;
+	};
+	std::deque<ConsoleRow> mRows;
+	int mWrapWidth;                     // width and font mRows were wrapped for
+	void* mWrapFont;
+	std::vector<COLOR> mLineColors;     // interned console color ids resolved to colors
+
 protected:
 	virtual int RenderSlideout(void);
 	virtual int RenderConsole(void);
+	void UpdateRows(void* fontResource);
 };
 
 class GUIButton : public GUIObject, public RenderObject, public ActionObject
@@ -452,6 +488,7 @@ public:
 
 	// NotifyVarChange - Notify of a variable change
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+	virtual bool GetVarDependencies(std::set<std::string>& vars);
 
 	// SetPos - Update the position of the render object
 	//  Return 0 on success, <0 on error
@@ -509,6 +546,7 @@ protected:
 	int scrollingSpeed;
 	int scrollingY;
 	int mHeaderIsStatic;
+	TextTemplate mHeaderTemplate;
 	int touchDebounce;
 	unsigned mFontHeight;
 	unsigned mLineHeight;
@@ -556,6 +594,7 @@ public:
 
 	// NotifyVarChange - Notify of a variable change
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+	virtual bool GetVarDependencies(std::set<std::string>& vars);
 
 	// SetPos - Update the position of the render object
 	//  Return 0 on success, <0 on error
@@ -619,6 +658,7 @@ protected:
 	COLOR mHighlightColor;
 	COLOR mFontHighlightColor;
 	int mHeaderIsStatic;
+	TextTemplate mHeaderTemplate;
 	int startSelection;
 	int touchDebounce;
 };
@@ -644,6 +684,7 @@ public:
 
 	// NotifyVarChange - Notify of a variable change
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+	virtual bool GetVarDependencies(std::set<std::string>& vars);
 
 	// SetPos - Update the position of the render object
 	//  Return 0 on success, <0 on error
@@ -702,6 +743,7 @@ protected:
 	COLOR mHighlightColor;
 	COLOR mFontHighlightColor;
 	int mHeaderIsStatic;
+	TextTemplate mHeaderTemplate;
 	int startSelection;
 	int touchDebounce;
 	bool updateList;
@@ -722,6 +764,8 @@ public:
 	//  Return 0 if nothing to update, 1 on success and contiue, >1 if full render required, and <0 on error
 	virtual int Update(void);
 
+	virtual bool IsAnimating(void);
+
 protected:
 	AnimationResource* mAnimation;
 	int mFrame;
@@ -748,6 +792,9 @@ public:
 	// NotifyVarChange - Notify of a variable change
 	//  Returns 0 on success, <0 on error
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+	virtual bool GetVarDependencies(std::set<std::string>& vars);
+
+	virtual bool IsAnimating(void) { return mSlideFrames > 0; }
 
 protected:
 	Resource* mEmptyBar;
@@ -873,6 +920,7 @@ public:
 
 	// Notify of a variable change
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+	virtual bool GetVarDependencies(std::set<std::string>& vars);
 
 	// NotifyTouch - Notify of a touch event
 	//  Return 0 on success, >0 to ignore remainder of touch, and <0 on error
@@ -961,6 +1009,7 @@ public:
 
 	// Notify of a variable change
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+	virtual bool GetVarDependencies(std::set<std::string>& vars);
 
 	// SetPageFocus - Notify when a page gains or loses focus
 	virtual void SetPageFocus(int inFocus);
@@ -34,6 +34,7 @@
 #include <stdlib.h>
 
 #include <string>
+#include <algorithm>
 
 extern "C" {
 #include "../twcommon.h"
@@ -46,6 +47,9 @@ extern "C" {
 #include "blanktimer.hpp"
 #endif
 
+// Damaged areas are merged once there are more than this, gr_flip_rects copies them one by one
+#define MAX_DAMAGE_RECTS 8
+
 extern int gGuiRunning;
 #ifndef TW_NO_SCREEN_TIMEOUT
 extern blanktimer blankTimer;
@@ -55,6 +59,7 @@ std::map<std::string, PageSet*> PageManager::mPageSets;
 PageSet* PageManager::mCurrentSet;
 PageSet* PageManager::mBaseSet = NULL;
 MouseCursor *PageManager::mMouseCursor = NULL;
+bool PageManager::mCursorDamage = false;
 HardwareKeyboard *PageManager::mHardwareKeyboard = NULL;
 
 // Helper routine to convert a string to a color declaration
@@ -160,9 +165,49 @@ int ActionObject::SetActionPos(int x, int y, int w, int h)
 	return 0;
 }
 
+static bool RectsIntersect(const GUIRect& rect, int x, int y, int w, int h)
+{
+	return x < rect.x + rect.w && rect.x < x + w && y < rect.y + rect.h && rect.y < y + h;
+}
+
+// Adds an area to a damage list, merging it with the areas it overlaps
+static void AddDamage(std::vector<GUIRect>& rects, int x, int y, int w, int h)
+{
+	if (x < 0)  { w += x; x = 0; }
+	if (y < 0)  { h += y; y = 0; }
+	if (x + w > gr_fb_width())   w = gr_fb_width() - x;
+	if (y + h > gr_fb_height())  h = gr_fb_height() - y;
+	if (w <= 0 || h <= 0)
+		return;
+
+	size_t i = 0;
+	while (i < rects.size())
+	{
+		// Too many areas get merged into one, the bounding box of all of them
+		if (RectsIntersect(rects[i], x, y, w, h) || rects.size() >= MAX_DAMAGE_RECTS)
+		{
+			int right = std::max(x + w, rects[i].x + rects[i].w);
+			int bottom = std::max(y + h, rects[i].y + rects[i].h);
+			x = std::min(x, rects[i].x);
+			y = std::min(y, rects[i].y);
+			w = right - x;
+			h = bottom - y;
+			rects.erase(rects.begin() + i);
+			i = 0;
+		}
+		else
+			i++;
+	}
+
+	GUIRect rect = { x, y, w, h };
+	rects.push_back(rect);
+}
+
 Page::Page(xml_node<>* page, std::vector<xml_node<>*> *templates /* = NULL */)
 {
 	mTouchStart = NULL;
+	mFullDamage = true;
+	mConditionsChangeCount = 0;
 
 	// We can memset the whole structure, because the alpha channel is ignored
 	memset(&mBackground, 0, sizeof(COLOR));
@@ -190,6 +235,7 @@ Page::Page(xml_node<>* page, std::vector<xml_node<>*> *templates /* = NULL */)
 
 	// This is a recursive routine for template handling
 	ProcessNode(page, templates);
+	BuildVarIndex();
 
 	return;
 }
@@ -404,19 +450,122 @@ int Page::Update(void)
 {
 	int retCode = 0;
 
+	mDamage.clear();
+	mRedraw.clear();
+	mFullDamage = false;
+
 	std::vector<RenderObject*>::iterator iter;
 	for (iter = mRenders.begin(); iter != mRenders.end(); iter++)
 	{
 		int ret = (*iter)->Update();
 		if (ret < 0)
 			LOGERR("An update request has failed.\n");
-		else if (ret > retCode)
-			retCode = ret;
+		else if (ret > 0)
+		{
+			int x, y, w, h;
+			if ((*iter)->GetDamageRect(x, y, w, h) != 0)
+				mFullDamage = true;
+			else
+			{
+				AddDamage(mDamage, x, y, w, h);
+				if (ret > 1)
+					AddDamage(mRedraw, x, y, w, h);
+			}
+			if (ret > retCode)
+				retCode = ret;
+		}
 	}
 
+	// Objects shown or hidden by a condition don't report it from Update()
+	if (ConditionsChanged())
+	{
+		mFullDamage = true;
+		retCode = 2;
+	}
+
+	// Past half of the screen, rendering everything is cheaper than tracking the areas
+	int area = 0;
+	std::vector<GUIRect>::iterator rect;
+	for (rect = mDamage.begin(); rect != mDamage.end(); rect++)
+		area += rect->w * rect->h;
+	if (area > gr_fb_width() * gr_fb_height() / 2)
+		mFullDamage = true;
+
 	return retCode;
 }
 
+bool Page::IsAnimating(void)
+{
+	std::vector<RenderObject*>::iterator iter;
+	for (iter = mRenders.begin(); iter != mRenders.end(); iter++)
+	{
+		if ((*iter)->IsAnimating())
+			return true;
+	}
+	return false;
+}
+
+// Conditions are evaluated again only after a variable changed, not on every
+// frame. fileexists and mounted follow too, the actions that mount or create
+// files set variables when they are done.
+bool Page::ConditionsChanged(void)
+{
+	// Read the count first, a change while evaluating makes the next call evaluate again
+	unsigned int changes = DataManager::GetChangeCount();
+	bool changed = (mLastConditions.size() != mObjects.size());
+	if (!changed && changes == mConditionsChangeCount)
+		return false;
+	mConditionsChangeCount = changes;
+	mLastConditions.resize(mObjects.size());
+
+	for (size_t i = 0; i < mObjects.size(); i++)
+	{
+		bool result = mObjects[i]->isConditionTrue();
+		if (mLastConditions[i] != result)
+		{
+			mLastConditions[i] = result;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+int Page::RenderDamage(void)
+{
+	if (mFullDamage)
+		return Render();
+
+	std::vector<GUIRect>::iterator rect;
+	for (rect = mRedraw.begin(); rect != mRedraw.end(); rect++)
+	{
+		gr_clip(rect->x, rect->y, rect->w, rect->h);
+		gr_color(mBackground.red, mBackground.green, mBackground.blue, mBackground.alpha);
+		gr_fill(rect->x, rect->y, rect->w, rect->h);
+
+		// Objects without a known area are rendered too, the clip keeps them in place
+		std::vector<RenderObject*>::iterator iter;
+		for (iter = mRenders.begin(); iter != mRenders.end(); iter++)
+		{
+			int x, y, w, h;
+			if ((*iter)->GetDamageRect(x, y, w, h) == 0 && !RectsIntersect(*rect, x, y, w, h))
+				continue;
+			if ((*iter)->Render())
+				LOGERR("A render request has failed.\n");
+		}
+	}
+	gr_noclip();
+	return 0;
+}
+
+bool Page::GetDamage(std::vector<GUIRect>& rects)
+{
+	if (mFullDamage)
+		return false;
+
+	rects = mDamage;
+	return true;
+}
+
 int Page::NotifyTouch(TOUCH_STATE state, int x, int y)
 {
 	// By default, return 1 to ignore further touches if nobody is listening
@@ -526,10 +675,47 @@ void Page::SetPageFocus(int inFocus)
 	return;
 }
 
+// Maps each variable to the objects depending on it, so a change only
+// reaches those. The lists keep the page order of the objects.
+void Page::BuildVarIndex(void)
+{
+	std::vector<std::set<std::string> > deps(mObjects.size());
+	std::set<std::string> allVars;
+	std::vector<bool> allDeps(mObjects.size());
+
+	for (size_t i = 0; i < mObjects.size(); i++)
+	{
+		allDeps[i] = !mObjects[i]->GetVarDependencies(deps[i]);
+		if (allDeps[i])
+			mAllVarObjects.push_back(mObjects[i]);
+		else
+			allVars.insert(deps[i].begin(), deps[i].end());
+	}
+
+	std::set<std::string>::iterator var;
+	for (var = allVars.begin(); var != allVars.end(); ++var)
+	{
+		std::vector<GUIObject*>& objects = mVarObjects[*var];
+		for (size_t i = 0; i < mObjects.size(); i++)
+		{
+			if (allDeps[i] || deps[i].count(*var))
+				objects.push_back(mObjects[i]);
+		}
+	}
+}
+
 int Page::NotifyVarChange(std::string varName, std::string value)
 {
+	// An empty name means everything has to be refreshed
+	std::vector<GUIObject*>* objects = &mObjects;
+	if (!varName.empty())
+	{
+		std::map<std::string, std::vector<GUIObject*> >::iterator pos = mVarObjects.find(varName);
+		objects = (pos != mVarObjects.end() ? &pos->second : &mAllVarObjects);
+	}
+
 	std::vector<GUIObject*>::iterator iter;
-	for (iter = mObjects.begin(); iter != mObjects.end(); ++iter)
+	for (iter = objects->begin(); iter != objects->end(); ++iter)
 	{
 		if ((*iter)->NotifyVarChange(varName, value))
 			LOGERR("An action handler errored on NotifyVarChange.\n");
@@ -870,6 +1056,30 @@ int PageSet::Update(void)
 	return ret;
 }
 
+bool PageSet::IsAnimating(void)
+{
+	if (mCurrentPage && mCurrentPage->IsAnimating())
+		return true;
+	return (mOverlayPage && mOverlayPage->IsAnimating());
+}
+
+int PageSet::RenderDamage(void)
+{
+	// The overlay page is drawn over the whole current page
+	if (mOverlayPage)
+		return Render();
+
+	return (mCurrentPage ? mCurrentPage->RenderDamage() : -1);
+}
+
+bool PageSet::GetDamage(std::vector<GUIRect>& rects)
+{
+	if (mOverlayPage || !mCurrentPage)
+		return false;
+
+	return mCurrentPage->GetDamage(rects);
+}
+
 int PageSet::NotifyTouch(TOUCH_STATE state, int x, int y)
 {
 	if (mOverlayPage)
@@ -1164,15 +1374,47 @@ int PageManager::Update(void)
 
 	int res = (mCurrentSet ? mCurrentSet->Update() : -1);
 
+	mCursorDamage = false;
 	if(mMouseCursor)
 	{
 		int c_res = mMouseCursor->Update();
 		if(c_res > res)
 			res = c_res;
+		mCursorDamage = (c_res > 0);
 	}
 	return res;
 }
 
+bool PageManager::IsAnimating(void)
+{
+#ifndef TW_NO_SCREEN_TIMEOUT
+	if(blankTimer.IsScreenOff())
+		return false;
+#endif
+
+	return (mCurrentSet && mCurrentSet->IsAnimating());
+}
+
+int PageManager::RenderDamage(void)
+{
+	// The cursor may have moved anywhere
+	if (mCursorDamage)
+		return Render();
+
+	int res = (mCurrentSet ? mCurrentSet->RenderDamage() : -1);
+	if(mMouseCursor)
+		mMouseCursor->Render();
+	return res;
+}
+
+bool PageManager::GetDamage(std::vector<GUIRect>& rects)
+{
+	if (mCursorDamage || !mCurrentSet)
+		return false;
+
+	return mCurrentSet->GetDamage(rects);
+}
+
 int PageManager::NotifyTouch(TOUCH_STATE state, int x, int y)
 {
 	return (mCurrentSet ? mCurrentSet->NotifyTouch(state, x, y) : -1);
@@ -1204,4 +1446,5 @@ extern "C" void gui_notifyVarChange(const char *name, const char* value)
 		return;
 
 	PageManager::NotifyVarChange(name, value);
+	gui_wakeup();
 }
@@ -9,6 +9,11 @@
 #include "../minzipold/Zip.h"
 #endif
 
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+
 typedef struct {
 	unsigned char red;
 	unsigned char green;
@@ -16,13 +21,49 @@ typedef struct {
 	unsigned char alpha;
 } COLOR;
 
+typedef struct {
+	int x, y, w, h;
+} GUIRect;
+
 // Utility Functions
 int ConvertStrToColor(std::string str, COLOR* color);
 int gui_forceRender(void);
 int gui_changePage(std::string newPage);
 int gui_changeOverlay(std::string newPage);
+void gui_wakeup(void);
 std::string gui_parse_text(string inText);
 
+// Text with %var% references, split once into literals and variable handles.
+// Parse() gives the same result as gui_parse_text and is cached until a
+// DataManager value changes.
+class TextTemplate
+{
+public:
+	TextTemplate() { Compile(""); }
+	explicit TextTemplate(const std::string& text) { Compile(text); }
+
+	void Compile(const std::string& text);
+	std::string Parse(void);
+	bool IsStatic(void) const { return mIsStatic; }
+	const std::string& GetText(void) const { return mText; }
+	void GetVars(std::set<std::string>& vars) const;
+
+private:
+	struct Token
+	{
+		std::string text;   // literal text, or the variable name
+		int handle;         // variable handle, or -1 for a literal
+	};
+
+	std::string mText;
+	std::vector<Token> mTokens;
+	bool mIsStatic;
+	bool mHasMagic;         // magic values can't be cached
+	bool mCached;
+	unsigned int mCacheChangeCount;
+	std::string mCache;
+};
+
 class Resource;
 class ResourceManager;
 class RenderObject;
@@ -43,6 +84,7 @@ public:
 public:
 	virtual int Render(void);
 	virtual int Update(void);
+	virtual bool IsAnimating(void);
 	virtual int NotifyTouch(TOUCH_STATE state, int x, int y);
 	virtual int NotifyKey(int key, bool down);
 	virtual int NotifyKeyboard(int key);
@@ -50,6 +92,11 @@ public:
 	virtual int NotifyVarChange(std::string varName, std::string value);
 	virtual void SetPageFocus(int inFocus);
 
+	// Renders only the areas changed by the last Update(), or the whole page
+	virtual int RenderDamage(void);
+	// Returns the areas changed by the last Update(), or false if the whole screen has to be flipped
+	virtual bool GetDamage(std::vector<GUIRect>& rects);
+
 protected:
 	std::string mName;
 	std::vector<GUIObject*> mObjects;
@@ -60,8 +107,19 @@ protected:
 	ActionObject* mTouchStart;
 	COLOR mBackground;
 
+	std::vector<GUIRect> mDamage;       // areas to flip
+	std::vector<GUIRect> mRedraw;       // areas to render before flipping
+	bool mFullDamage;
+	std::vector<bool> mLastConditions;
+	unsigned int mConditionsChangeCount; // variable change count mLastConditions was evaluated at
+
+	std::map<std::string, std::vector<GUIObject*> > mVarObjects; // objects to notify, per variable
+	std::vector<GUIObject*> mAllVarObjects;                      // objects notified of every variable
+
 protected:
 	bool ProcessNode(xml_node<>* page, std::vector<xml_node<>*> *templates = NULL, int depth = 0);
+	bool ConditionsChanged(void);
+	void BuildVarIndex(void);
 };
 
 class PageSet
@@ -85,6 +143,9 @@ public:
 	// These are routing routines
 	int Render(void);
 	int Update(void);
+	bool IsAnimating(void);
+	int RenderDamage(void);
+	bool GetDamage(std::vector<GUIRect>& rects);
 	int NotifyTouch(TOUCH_STATE state, int x, int y);
 	int NotifyKey(int key, bool down);
 	int NotifyKeyboard(int key);
@@ -130,6 +191,9 @@ public:
 	// These are routing routines
 	static int Render(void);
 	static int Update(void);
+	static bool IsAnimating(void);
+	static int RenderDamage(void);
+	static bool GetDamage(std::vector<GUIRect>& rects);
 	static int NotifyTouch(TOUCH_STATE state, int x, int y);
 	static int NotifyKey(int key, bool down);
 	static int NotifyKeyboard(int key);
@@ -149,6 +213,7 @@ protected:
 	static PageSet* mCurrentSet;
 	static PageSet* mBaseSet;
 	static MouseCursor *mMouseCursor;
+	static bool mCursorDamage;
 	static HardwareKeyboard *mHardwareKeyboard;
 };
 
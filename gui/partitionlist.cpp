@@ -132,7 +132,8 @@ GUIPartitionList::GUIPartitionList(xml_node<>* node) : GUIObject(node)
 	}
 
 	// Simple way to check for static state
-	mLastValue = gui_parse_text(mHeaderText);
+	mHeaderTemplate.Compile(mHeaderText);
+	mLastValue = mHeaderTemplate.Parse();
 	if (mLastValue != mHeaderText)
 		mHeaderIsStatic = 0;
 	else
@@ -532,7 +533,7 @@ int GUIPartitionList::Update(void)
 		return 0;
 
 	if (!mHeaderIsStatic) {
-		std::string newValue = gui_parse_text(mHeaderText);
+		std::string newValue = mHeaderTemplate.Parse();
 		if (mLastValue != newValue) {
 			mLastValue = newValue;
 			mUpdate = 1;
@@ -827,6 +828,14 @@ int GUIPartitionList::NotifyTouch(TOUCH_STATE state, int x, int y)
 	return 0;
 }
 
+bool GUIPartitionList::GetVarDependencies(std::set<std::string>& vars)
+{
+	if (!mHeaderIsStatic)
+		mHeaderTemplate.GetVars(vars);
+	vars.insert(mVariable);
+	return GUIObject::GetVarDependencies(vars);
+}
+
 int GUIPartitionList::NotifyVarChange(const std::string& varName, const std::string& value)
 {
 	GUIObject::NotifyVarChange(varName, value);
@@ -835,7 +844,7 @@ int GUIPartitionList::NotifyVarChange(const std::string& varName, const std::str
 		return 0;
 
 	if (!mHeaderIsStatic) {
-		std::string newValue = gui_parse_text(mHeaderText);
+		std::string newValue = mHeaderTemplate.Parse();
 		if (mLastValue != newValue) {
 			mLastValue = newValue;
 			mStart = 0;
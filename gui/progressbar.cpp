@@ -176,6 +176,13 @@ int GUIProgressBar::Update(void)
 	return 2;
 }
 
+bool GUIProgressBar::GetVarDependencies(std::set<std::string>& vars)
+{
+	vars.insert("ui_progress_portion");
+	vars.insert("ui_progress_frames");
+	return GUIObject::GetVarDependencies(vars);
+}
+
 int GUIProgressBar::NotifyVarChange(const std::string& varName, const std::string& value)
 {
 	GUIObject::NotifyVarChange(varName, value);
@@ -443,6 +443,14 @@ int GUISliderValue::NotifyTouch(TOUCH_STATE state, int x, int y)
 	return 0;
 }
 
+bool GUISliderValue::GetVarDependencies(std::set<std::string>& vars)
+{
+	vars.insert(mVariable);
+	if (mLabel && !mLabel->GetVarDependencies(vars))
+		return false;
+	return GUIObject::GetVarDependencies(vars);
+}
+
 int GUISliderValue::NotifyVarChange(const std::string& varName, const std::string& value)
 {
 	GUIObject::NotifyVarChange(varName, value);
@@ -16,6 +16,7 @@
 #include <stdlib.h>
 
 #include <string>
+#include <algorithm>
 
 extern "C" {
 #include "../twcommon.h"
@@ -39,6 +40,7 @@ GUIText::GUIText(xml_node<>* node)
 	charSkip = 0;
 	isHighlighted = false;
 	hasHighlightColor = false;
+	mDrawnX = mDrawnY = mDrawnW = mDrawnH = 0;
 
 	if (!node)
 		return;
@@ -92,6 +94,7 @@ GUIText::GUIText(xml_node<>* node)
 
 	child = node->first_node("text");
 	if (child)  mText = child->value();
+	mTemplate.Compile(mText);
 
 	// Simple way to check for static state
 	mLastValue = parseText();
@@ -120,23 +123,12 @@ int GUIText::Render(void)
 
 	mVarChanged = 0;
 
-	int x = mRenderX, y = mRenderY;
-	int width = gr_measureEx(displayValue.c_str(), fontResource);
-
-	if (mPlacement != TOP_LEFT && mPlacement != BOTTOM_LEFT)
-	{
-		if (mPlacement == CENTER || mPlacement == CENTER_X_ONLY)
-			x -= (width / 2);
-		else
-			x -= width;
-	}
-	if (mPlacement != TOP_LEFT && mPlacement != TOP_RIGHT)
-	{
-		if (mPlacement == CENTER)
-			y -= (mFontHeight / 2);
-		else if (mPlacement == BOTTOM_LEFT || mPlacement == BOTTOM_RIGHT)
-			y -= mFontHeight;
-	}
+	int x, y, w, h;
+	GetTextRect(displayValue, x, y, w, h);
+	mDrawnX = x;
+	mDrawnY = y;
+	mDrawnW = w;
+	mDrawnH = h;
 
 	if (hasHighlightColor && isHighlighted)
 		gr_color(mHighlightColor.red, mHighlightColor.green, mHighlightColor.blue, mHighlightColor.alpha);
@@ -176,6 +168,57 @@ int GUIText::Update(void)
 	return 2;
 }
 
+void GUIText::GetTextRect(const std::string& value, int& x, int& y, int& w, int& h)
+{
+	void* fontResource = NULL;
+
+	if (mFont)
+		fontResource = mFont->GetResource();
+
+	x = mRenderX;
+	y = mRenderY;
+	w = gr_measureEx(value.c_str(), fontResource);
+	h = mFontHeight;
+
+	if (mPlacement != TOP_LEFT && mPlacement != BOTTOM_LEFT)
+	{
+		if (mPlacement == CENTER || mPlacement == CENTER_X_ONLY)
+			x -= (w / 2);
+		else
+			x -= w;
+	}
+	if (mPlacement != TOP_LEFT && mPlacement != TOP_RIGHT)
+	{
+		if (mPlacement == CENTER)
+			y -= (mFontHeight / 2);
+		else if (mPlacement == BOTTOM_LEFT || mPlacement == BOTTOM_RIGHT)
+			y -= mFontHeight;
+	}
+
+	if (maxWidth && w > (int) maxWidth)
+		w = maxWidth;
+}
+
+int GUIText::GetDamageRect(int& x, int& y, int& w, int& h)
+{
+	std::string displayValue = mLastValue;
+
+	if (charSkip)
+		displayValue.erase(0, charSkip);
+
+	GetTextRect(displayValue, x, y, w, h);
+	if (mDrawnW > 0 && mDrawnH > 0)
+	{
+		int right = std::max(x + w, mDrawnX + mDrawnW);
+		int bottom = std::max(y + h, mDrawnY + mDrawnH);
+		x = std::min(x, mDrawnX);
+		y = std::min(y, mDrawnY);
+		w = right - x;
+		h = bottom - y;
+	}
+	return (w > 0 && h > 0) ? 0 : -1;
+}
+
 int GUIText::GetCurrentBounds(int& w, int& h)
 {
 	void* fontResource = NULL;
@@ -191,35 +234,14 @@ int GUIText::GetCurrentBounds(int& w, int& h)
 
 std::string GUIText::parseText(void)
 {
-	static int counter = 0;
-	std::string str = mText;
-	size_t pos = 0;
-	size_t next = 0, end = 0;
-
-	while (1)
-	{
-		next = str.find('%', pos);
-		if (next == std::string::npos) return str;
-		end = str.find('%', next + 1);
-		if (end == std::string::npos) return str;
-
-		// We have a block of data
-		std::string var = str.substr(next + 1, (end - next) - 1);
-		str.erase(next, (end - next) + 1);
-
-		if (next + 1 == end)
-		{
-			str.insert(next, 1, '%');
-		}
-		else
-		{
-			std::string value;
-			if (DataManager::GetValue(var, value) == 0)
-				str.insert(next, value);
-		}
+	return mTemplate.Parse();
+}
 
-		pos = next + 1;
-	}
+bool GUIText::GetVarDependencies(std::set<std::string>& vars)
+{
+	if (!mIsStatic)
+		mTemplate.GetVars(vars);
+	return GUIObject::GetVarDependencies(vars);
 }
 
 int GUIText::NotifyVarChange(const std::string& varName, const std::string& value)
@@ -113,6 +113,9 @@ else
     LOCAL_SHARED_LIBRARIES += libft2
     LOCAL_C_INCLUDES += external/freetype/include
     LOCAL_SRC_FILES += truetype.c
+    ifneq ($(TW_TTF_ATLAS_SIZE_KB),)
+        LOCAL_CFLAGS += -DTTF_ATLAS_MAX_BYTES="($(TW_TTF_ATLAS_SIZE_KB)*1024)"
+    endif
 endif
 
 LOCAL_SHARED_LIBRARIES += libz libc libcutils libjpeg libpng
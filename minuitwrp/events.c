@@ -743,15 +743,20 @@ int ev_get(struct input_event *ev, unsigned dont_wait)
             }
         }
 
-        usleep(1000);
-    } while(dont_wait == 0);
+        if (dont_wait)
+            break;
+        // nothing usable was read, block until there is more (or it is time to look for new devices)
+        poll(ev_fds, ev_count, 2000);
+    } while(1);
 
     return -1;
 }
 
+// Waits up to timeout ms (-1 for ever) for input, returns 0 if there is some
 int ev_wait(int timeout)
 {
-    return -1;
+    int r = poll(ev_fds, ev_count, timeout);
+    return (r > 0 ? 0 : -1);
 }
 
 void ev_dispatch(void)
@@ -16,6 +16,7 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <errno.h>
@@ -31,6 +32,12 @@
 
 #include <pixelflinger/pixelflinger.h>
 
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "minui.h"
 
 #ifdef BOARD_USE_CUSTOM_RECOVERY_FONT
@@ -53,6 +60,7 @@
 #endif
 
 #define NUM_BUFFERS 2
+#define MAX_FLIP_RECTS 8
 #define MAX_DISPLAY_DIM  2048
 
 // #define PRINT_SCREENINFO 1 // Enables printing of screen info to log
@@ -74,6 +82,10 @@ static unsigned gr_active_fb = 0;
 static unsigned double_buffering = 0;
 static int gr_is_curr_clr_opaque = 0;
 
+/* areas copied by the last flip; -1 means the whole screen */
+static gr_rect gr_last_flip_rects[MAX_FLIP_RECTS];
+static int gr_last_flip_count = -1;
+
 static int gr_fb_fd = -1;
 static int gr_vt_fd = -1;
 
@@ -337,38 +349,152 @@ static void set_active_framebuffer(unsigned n)
     }
 }
 
+#if PIXEL_SIZE == 4
+typedef uint32_t gr_raw_pixel;
+#else
+typedef uint16_t gr_raw_pixel;
+#endif
+
+/* copies count pixels from src to dst in reverse order */
+static void gr_reverse_row(gr_raw_pixel *dst, const gr_raw_pixel *src, int count)
+{
+    src += count;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#if PIXEL_SIZE == 4
+    for (; count >= 4; count -= 4, dst += 4) {
+        uint32x4_t v;
+        src -= 4;
+        v = vrev64q_u32(vld1q_u32(src));
+        vst1q_u32(dst, vcombine_u32(vget_high_u32(v), vget_low_u32(v)));
+    }
+#else
+    for (; count >= 8; count -= 8, dst += 8) {
+        uint16x8_t v;
+        src -= 8;
+        v = vrev64q_u16(vld1q_u16(src));
+        vst1q_u16(dst, vcombine_u16(vget_high_u16(v), vget_low_u16(v)));
+    }
+#endif
+#elif defined(__SSE2__)
+#if PIXEL_SIZE == 4
+    for (; count >= 4; count -= 4, dst += 4) {
+        __m128i v;
+        src -= 4;
+        v = _mm_loadu_si128((const __m128i*) src);
+        _mm_storeu_si128((__m128i*) dst, _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+    }
+#else
+    for (; count >= 8; count -= 8, dst += 8) {
+        __m128i v;
+        src -= 8;
+        v = _mm_loadu_si128((const __m128i*) src);
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        _mm_storeu_si128((__m128i*) dst, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    }
+#endif
+#endif
+
+    while (count-- > 0)
+        *dst++ = *--src;
+}
+
+/* copies an area of the memory surface to the active framebuffer */
+static void gr_copy_rect(const gr_rect *r)
+{
+    int x = r->x, y = r->y, w = r->w, h = r->h;
+
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (x + w > (int) vi.xres) w = vi.xres - x;
+    if (y + h > (int) vi.yres) h = vi.yres - y;
+    if (w <= 0 || h <= 0)
+        return;
+
+    GGLSurface *fb = &gr_framebuffer[gr_active_fb];
+    size_t src_stride = gr_mem_surface.stride * PIXEL_SIZE;
+    size_t dst_stride = fb->stride * PIXEL_SIZE;
+    unsigned char *src = gr_mem_surface.data + (y * gr_mem_surface.stride + x) * PIXEL_SIZE;
+
+#ifdef BOARD_HAS_FLIPPED_SCREEN
+    /* the panel is mounted upside down, so rotate by 180 degrees while
+     * copying and leave the memory surface as it was drawn */
+    unsigned char *dst = fb->data + ((vi.yres - 1 - y) * fb->stride + (vi.xres - x - w)) * PIXEL_SIZE;
+    while (h--) {
+        gr_reverse_row((gr_raw_pixel*) dst, (const gr_raw_pixel*) src, w);
+        src += src_stride;
+        dst -= dst_stride;
+    }
+#else
+    unsigned char *dst = fb->data + (y * fb->stride + x) * PIXEL_SIZE;
+    if (src_stride == dst_stride && (size_t) w * PIXEL_SIZE == src_stride) {
+        /* whole rows, one copy */
+        memcpy(dst, src, h * src_stride);
+        return;
+    }
+    while (h--) {
+        memcpy(dst, src, w * PIXEL_SIZE);
+        src += src_stride;
+        dst += dst_stride;
+    }
+#endif
+}
+
 void gr_flip(void)
 {
     if (-EINVAL == overlay_display_frame(gr_fb_fd, gr_mem_surface.data,
                                          (fi.line_length * vi.yres))) {
-        GGLContext *gl = gr_context;
+        gr_rect screen = { 0, 0, vi.xres, vi.yres };
 
         /* swap front and back buffers */
         if (double_buffering)
             gr_active_fb = (gr_active_fb + 1) & 1;
 
-#ifdef BOARD_HAS_FLIPPED_SCREEN
-        /* flip buffer 180 degrees for devices with physicaly inverted screens */
-        unsigned int i;
-        unsigned int j;
-        uint8_t tmp;
-        for (i = 0; i < ((vi.xres_virtual * vi.yres)/2); i++) {
-            for (j = 0; j < PIXEL_SIZE; j++) {
-                tmp = gr_mem_surface.data[i * PIXEL_SIZE + j];
-                gr_mem_surface.data[i * PIXEL_SIZE + j] = gr_mem_surface.data[(vi.xres_virtual * vi.yres * PIXEL_SIZE) - ((i+1) * PIXEL_SIZE) + j];
-                gr_mem_surface.data[(vi.xres_virtual * vi.yres * PIXEL_SIZE) - ((i+1) * PIXEL_SIZE) + j] = tmp;
-            }
-        }
-#endif
-
         /* copy data from the in-memory surface to the buffer we're about
          * to make active. */
-        memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
-               vi.xres_virtual * vi.yres * PIXEL_SIZE);
+        gr_copy_rect(&screen);
 
         /* inform the display driver */
         set_active_framebuffer(gr_active_fb);
+
+        /* the other buffer needs the whole screen at the next partial flip */
+        gr_last_flip_rects[0] = screen;
+        gr_last_flip_count = 1;
+        return;
     }
+    gr_last_flip_count = -1;
+}
+
+void gr_flip_rects(const gr_rect *rects, int count)
+{
+    int i;
+
+    if (count <= 0)
+        return;
+
+    if (has_overlay || count > MAX_FLIP_RECTS) {
+        gr_flip();
+        return;
+    }
+
+    if (double_buffering) {
+        /* the buffer we are about to make active missed the previous flip */
+        if (gr_last_flip_count < 0) {
+            gr_flip();
+            return;
+        }
+        gr_active_fb = (gr_active_fb + 1) & 1;
+        for (i = 0; i < gr_last_flip_count; i++)
+            gr_copy_rect(&gr_last_flip_rects[i]);
+    }
+    for (i = 0; i < count; i++) {
+        gr_copy_rect(&rects[i]);
+        gr_last_flip_rects[i] = rects[i];
+    }
+    gr_last_flip_count = count;
+
+    set_active_framebuffer(gr_active_fb);
 }
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
@@ -574,6 +700,21 @@ void gr_fill(int x, int y, int w, int h)
         gl->enable(gl, GGL_BLEND);
 }
 
+void gr_clip(int x, int y, int w, int h)
+{
+    GGLContext *gl = gr_context;
+
+    gl->scissor(gl, x, y, w, h);
+    gl->enable(gl, GGL_SCISSOR_TEST);
+}
+
+void gr_noclip(void)
+{
+    GGLContext *gl = gr_context;
+
+    gl->disable(gl, GGL_SCISSOR_TEST);
+}
+
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
     if (gr_context == NULL) {
         return;
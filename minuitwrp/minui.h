@@ -20,6 +20,10 @@
 typedef void* gr_surface;
 typedef unsigned short gr_pixel;
 
+typedef struct {
+    int x, y, w, h;
+} gr_rect;
+
 #define FONT_TYPE_TWRP 0
 
 #ifndef TW_DISABLE_TTF
@@ -33,10 +37,15 @@ int gr_fb_width(void);
 int gr_fb_height(void);
 gr_pixel *gr_fb_data(void);
 void gr_flip(void);
+// copies only the given areas of the memory surface to the screen
+void gr_flip_rects(const gr_rect *rects, int count);
 int gr_fb_blank(int blank);
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
 void gr_fill(int x, int y, int w, int h);
+// limits all drawing to the given area until gr_noclip()
+void gr_clip(int x, int y, int w, int h);
+void gr_noclip(void);
 
 int gr_textEx(int x, int y, const char *s, void* font);
 int gr_textExW(int x, int y, const char *s, void* font, int max_width);
@@ -3,7 +3,9 @@
 #include <unistd.h>
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "minui.h"
 
@@ -16,7 +18,41 @@
 #include <pthread.h>
 
 #define STRING_CACHE_MAX_ENTRIES 400
-#define STRING_CACHE_TRUNCATE_ENTRIES 150
+#define KERNING_CACHE_MAX_ENTRIES 4096
+#define CHAR_CACHE_MAX_ENTRIES 8192
+
+// Glyph bitmaps live in one A8 atlas per font, this is its upper bound
+#ifndef TTF_ATLAS_MAX_BYTES
+#define TTF_ATLAS_MAX_BYTES (2*1024*1024)
+#endif
+#define TTF_ATLAS_MAX_WIDTH 1024
+
+// Glyphs rendered into the atlas when the font is loaded, as long as
+// they fit into half of it: ASCII, CJK punctuation and fullwidth forms
+static const struct { unsigned first, last; } atlas_prefill_ranges[] = {
+    { 0x0020, 0x007E },
+    { 0x3000, 0x303F },
+    { 0xFF01, 0xFF5E },
+};
+
+// Common Hanzi, most frequent first, prefilled after the ranges above
+// for fonts that have them, so Chinese text rarely misses the atlas
+static const char atlas_prefill_hanzi[] =
+    "的一是不了在人有我他这个们中来上大为和国地到以说时要就出会可也你对生能而子那得于"
+    "着下自之年过发后作里用道行所然家种事成方多经么去法学如都同现当没动面起看定天分还"
+    "进好小部其些主样理心她本前开但因只从想实日军者意无力它与长把机十民第公此已工使情"
+    "明性知全三又关点正业外将两高间由问很最重并物手应战向头文体政美相见被利什二等产或"
+    "新己制身果加西斯月话合回特代内信表化老给世位次度门任常先海通教儿原东声提立及比员"
+    "解水名真论处走义各入几口认条平系气题活尔更别打女变四神总何电数安少报才结反受目太"
+    "量再感建务做接必场件计管期市直德资命山金指克许统区保至队形社便空决治展马科司五基"
+    "眼书非则听白却界达光放强即像难且权思王象完设式色路记南品住告类求据程北边死张该交"
+    "规万取拉格望觉术领共确传师观清今切院让识候带导争运笑飞风步改收根干造言联持组每济"
+    "车亲极林服快办议往元英士证近失转夫令准布始怎呢存未远叫台单影具罗字爱击流备兵连调"
+    "深商算质团集百需价花党华城石级整府离况亚请技际约示复病息究线似官火断精满支视消越"
+    "器容照须九增研写称企八功吗包片史委乎查轻易早曾除农找装广显吧阿李标谈吃图念六引历"
+    "首医局突专费号尽另周较注语仅考落青随选列武红响虽推势参希古众构房半节土投某案黑维"
+    "革划敢微谁倒宣京养派毛奇刚黄底温举跟顾校刻紧担守积供待急富讲责群乐吸送独适宁低施"
+    "险怕爷夜板脚协哪状岁副额修营";
 
 typedef struct
 {
@@ -25,6 +61,52 @@ typedef struct
     char *path;
 } TrueTypeFontKey;
 
+typedef struct
+{
+    int index;
+    int advance;
+    FT_BBox bbox;
+    int left;               // bitmap position relative to the pen
+    int top;
+    int width;
+    int height;
+    int slot;               // atlas cell holding the bitmap, -1 when evicted
+} TrueTypeCacheEntry;
+
+typedef struct
+{
+    int left;
+    int right;
+} KerningCacheKey;
+
+typedef struct
+{
+    GGLSurface surface;
+    int cell_w;
+    int cell_h;
+    int cols;
+    int rows;               // rows allocated so far
+    int max_rows;
+    int used;               // cells handed out so far
+    int hand;               // clock hand for eviction
+    int generation;         // changes when surface data moves
+    TrueTypeCacheEntry **owners;
+    uint8_t *referenced;
+} GlyphAtlas;
+
+typedef struct
+{
+    unsigned glyph_hits;
+    unsigned glyph_misses;
+    unsigned atlas_hits;
+    unsigned atlas_misses;
+    unsigned atlas_evictions;
+    unsigned string_hits;
+    unsigned string_misses;
+    unsigned kerning_hits;
+    unsigned kerning_misses;
+} TrueTypeStats;
+
 typedef struct
 {
     int type;
@@ -34,30 +116,40 @@ typedef struct
     int max_height;
     int base;
     FT_Face face;
+    int ascii_glyphs[128];  // char index of ASCII characters, -1 until looked up
+    Hashmap *char_cache;    // unicode code point -> char index for the rest
+    Hashmap *kerning_cache;
     Hashmap *glyph_cache;
     Hashmap *string_cache;
     struct StringCacheEntry *string_cache_head;
     struct StringCacheEntry *string_cache_tail;
+    GlyphAtlas atlas;
+    TrueTypeStats stats;
     pthread_mutex_t mutex;
     TrueTypeFontKey *key;
 } TrueTypeFont;
 
 typedef struct
 {
-    FT_BBox bbox;
-    FT_BitmapGlyph glyph;
-} TrueTypeCacheEntry;
+    char *text;
+} StringCacheKey;
 
+// One decoded character of a laid out string
 typedef struct
 {
-    char *text;
-    int max_width;
-} StringCacheKey;
+    int glyph;              // char index, 0 if the font doesn't have it
+    int x;                  // pen position, including kerning
+    int end;                // pen position after the advance
+    int offset;             // byte offset of the character in the string
+} GlyphRunItem;
 
+// A string laid out once and shared by measuring, wrapping and drawing
 struct StringCacheEntry
 {
-    GGLSurface surface;
-    int rendered_len;
+    int width;
+    int length;             // bytes in the string
+    int count;
+    GlyphRunItem *items;
     StringCacheKey *key;
     struct StringCacheEntry *prev;
     struct StringCacheEntry *next;
@@ -78,6 +170,10 @@ static FontData font_data = {
     .mutex = PTHREAD_MUTEX_INITIALIZER,
 };
 
+static void gr_ttf_atlas_init(TrueTypeFont *font);
+static void gr_ttf_atlas_prefill(TrueTypeFont *font);
+static int gr_ttf_char_index(TrueTypeFont *font, unsigned c);
+
 #define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
 #define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
 
@@ -86,15 +182,62 @@ static FontData font_data = {
 static const uint32_t FNV_prime = 16777619U;
 static const uint32_t offset_basis = 2166136261U;
 
-int utf8_to_unicode(unsigned c1, unsigned c2, unsigned c3)
+// Decodes one UTF-8 sequence and advances *s past it. Malformed or
+// truncated sequences decode to U+FFFD and consume a single byte.
+static unsigned utf8_decode(const char **s)
 {
-    unsigned short unicode;
+    const unsigned char *p = (const unsigned char*)*s;
+    unsigned c = p[0], min;
+    int i, len;
+
+    if(c < 0x80)
+    {
+        *s += 1;
+        return c;
+    }
+    else if((c & 0xE0) == 0xC0)
+    {
+        len = 2;
+        min = 0x80;
+        c &= 0x1F;
+    }
+    else if((c & 0xF0) == 0xE0)
+    {
+        len = 3;
+        min = 0x800;
+        c &= 0x0F;
+    }
+    else if((c & 0xF8) == 0xF0)
+    {
+        len = 4;
+        min = 0x10000;
+        c &= 0x07;
+    }
+    else
+    {
+        *s += 1;
+        return 0xFFFD;
+    }
 
-    unicode = (c1 & 0x1F) << 12;
-    unicode |= (c2 & 0x3F) << 6;
-    unicode |= (c3 & 0x3F);
+    for(i = 1; i < len; ++i)
+    {
+        if((p[i] & 0xC0) != 0x80)
+        {
+            *s += 1;
+            return 0xFFFD;
+        }
+        c = (c << 6) | (p[i] & 0x3F);
+    }
 
-    return unicode;
+    // overlong forms, surrogates and values past the unicode range
+    if(c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+    {
+        *s += 1;
+        return 0xFFFD;
+    }
+
+    *s += len;
+    return c;
 }
 
 static uint32_t fnv_hash(void *data, uint32_t len)
@@ -133,7 +276,20 @@ static bool gr_ttf_string_cache_equals(void *keyA, void *keyB)
 {
     StringCacheKey *a = keyA;
     StringCacheKey *b = keyB;
-    return a->max_width == b->max_width && strcmp(a->text, b->text) == 0;
+    return strcmp(a->text, b->text) == 0;
+}
+
+static bool gr_ttf_kerning_cache_equals(void *keyA, void *keyB)
+{
+    KerningCacheKey *a = keyA;
+    KerningCacheKey *b = keyB;
+    return a->left == b->left && a->right == b->right;
+}
+
+static int gr_ttf_kerning_cache_hash(void *key)
+{
+    KerningCacheKey *k = key;
+    return fnv_hash_add(fnv_hash_add(offset_basis, k->left), k->right);
 }
 
 static int gr_ttf_string_cache_hash(void *key)
@@ -217,9 +373,14 @@ void *gr_ttf_loadFont(const char *filename, int size, int dpi)
     res->max_height = -1;
     res->base = -1;
     res->refcount = 1;
+    memset(res->ascii_glyphs, -1, sizeof(res->ascii_glyphs));
+    res->char_cache = hashmapCreate(32, hashmapIntHash, hashmapIntEquals);
+    res->kerning_cache = hashmapCreate(32, gr_ttf_kerning_cache_hash, gr_ttf_kerning_cache_equals);
     res->glyph_cache = hashmapCreate(32, hashmapIntHash, hashmapIntEquals);
     res->string_cache = hashmapCreate(128, gr_ttf_string_cache_hash, gr_ttf_string_cache_equals);
     pthread_mutex_init(&res->mutex, 0);
+    gr_ttf_atlas_init(res);
+    gr_ttf_atlas_prefill(res);
 
     if(!font_data.fonts)
         font_data.fonts = hashmapCreate(4, gr_ttf_font_cache_hash, gr_ttf_font_cache_equals);
@@ -241,9 +402,7 @@ exit:
 
 static bool gr_ttf_freeFontCache(void *key, void *value, void *context)
 {
-    TrueTypeCacheEntry *e = value;
-    FT_Done_Glyph((FT_Glyph)e->glyph);
-    free(e);
+    free(value);
     free(key);
     return true;
 }
@@ -255,7 +414,7 @@ static bool gr_ttf_freeStringCache(void *key, void *value, void *context)
     free(k);
 
     StringCacheEntry *e = value;
-    free(e->surface.data);
+    free(e->items);
     free(e);
     return true;
 }
@@ -284,6 +443,13 @@ void gr_ttf_freeFont(void *font)
         hashmapFree(d->string_cache);
         hashmapForEach(d->glyph_cache, gr_ttf_freeFontCache, NULL);
         hashmapFree(d->glyph_cache);
+        hashmapForEach(d->char_cache, gr_ttf_freeFontCache, NULL);
+        hashmapFree(d->char_cache);
+        hashmapForEach(d->kerning_cache, gr_ttf_freeFontCache, NULL);
+        hashmapFree(d->kerning_cache);
+        free(d->atlas.surface.data);
+        free(d->atlas.owners);
+        free(d->atlas.referenced);
         pthread_mutex_destroy(&d->mutex);
         free(d);
     }
@@ -296,190 +462,345 @@ static TrueTypeCacheEntry *gr_ttf_glyph_cache_peek(TrueTypeFont *font, int char_
     return hashmapGet(font->glyph_cache, &char_index);
 }
 
-static TrueTypeCacheEntry *gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_index)
+static void gr_ttf_atlas_init(TrueTypeFont *font)
 {
-    TrueTypeCacheEntry *res = hashmapGet(font->glyph_cache, &char_index);
-    if(!res)
+    GlyphAtlas *a = &font->atlas;
+    FT_Size_Metrics *m = &font->face->size->metrics;
+    int cells;
+
+    // cells fit the largest glyph of the face, glyphs that don't are clipped
+    a->cell_w = MAX((m->max_advance >> 6) + 2, 1);
+    a->cell_h = MAX(((m->ascender - m->descender) >> 6) + 2, 1);
+    a->cols = MAX(TTF_ATLAS_MAX_WIDTH / a->cell_w, 1);
+    a->max_rows = MAX(TTF_ATLAS_MAX_BYTES / (a->cols * a->cell_w * a->cell_h), 1);
+    a->rows = 0;
+    a->used = 0;
+    a->hand = 0;
+    a->generation = 0;
+
+    cells = a->cols * a->max_rows;
+    a->owners = calloc(cells, sizeof(TrueTypeCacheEntry*));
+    a->referenced = calloc(cells, 1);
+
+    a->surface.version = sizeof(a->surface);
+    a->surface.width = a->cols * a->cell_w;
+    a->surface.height = 0;
+    a->surface.stride = a->surface.width;
+    a->surface.data = NULL;
+    a->surface.format = GGL_PIXEL_FORMAT_A_8;
+}
+
+// Returns a free atlas cell, growing the atlas or evicting the least
+// recently drawn glyph when needed
+static int gr_ttf_atlas_alloc(TrueTypeFont *font)
+{
+    GlyphAtlas *a = &font->atlas;
+    int slot;
+
+    if(a->used < a->rows * a->cols)
+        return a->used++;
+
+    if(a->rows < a->max_rows)
     {
-        int error = FT_Load_Glyph(font->face, char_index, FT_LOAD_RENDER);
-        if(error)
+        int rows = MIN(MAX(a->rows * 2, 4), a->max_rows);
+        void *data = realloc(a->surface.data, rows * a->cell_h * a->surface.stride);
+        if(data)
         {
-            fprintf(stderr, "Failed to load glyph idx %d: %d\n", char_index, error);
-            return NULL;
+            a->surface.data = data;
+            a->surface.height = rows * a->cell_h;
+            a->rows = rows;
+            ++a->generation;
+            return a->used++;
         }
+        if(a->rows == 0)
+            return -1;
+    }
 
-        FT_BitmapGlyph glyph;
-        error = FT_Get_Glyph(font->face->glyph, (FT_Glyph*)&glyph);
-        if(error)
-        {
-            fprintf(stderr, "Failed to copy glyph %d: %d\n", char_index, error);
-            return NULL;
-        }
+    // clock: skip cells drawn since the hand last passed
+    for(;;)
+    {
+        slot = a->hand;
+        a->hand = (a->hand + 1) % (a->rows * a->cols);
+        if(!a->referenced[slot])
+            break;
+        a->referenced[slot] = 0;
+    }
 
-        res = malloc(sizeof(TrueTypeCacheEntry));
-        memset(res, 0, sizeof(TrueTypeCacheEntry));
-        res->glyph = glyph;
-        FT_Glyph_Get_CBox((FT_Glyph)glyph, FT_GLYPH_BBOX_PIXELS, &res->bbox);
+    if(a->owners[slot])
+        a->owners[slot]->slot = -1;
+    a->owners[slot] = NULL;
+    ++font->stats.atlas_evictions;
+    return slot;
+}
 
-        int *key = malloc(sizeof(int));
-        *key = char_index;
+// Copies the bitmap of the glyph currently loaded in the face to an atlas cell
+static int gr_ttf_atlas_put(TrueTypeFont *font, TrueTypeCacheEntry *e)
+{
+    GlyphAtlas *a = &font->atlas;
+    FT_GlyphSlot g = font->face->glyph;
+    uint8_t *src_itr, *dest_itr;
+    int y, w, h;
 
-        hashmapPut(font->glyph_cache, key, res);
+    if(g->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY)
+    {
+        fprintf(stderr, "Unsupported pixel mode in FT_GlyphSlot %d\n", g->bitmap.pixel_mode);
+        return -1;
     }
 
-    return res;
+    int slot = gr_ttf_atlas_alloc(font);
+    if(slot < 0)
+        return -1;
+
+    e->left = g->bitmap_left;
+    e->top = g->bitmap_top;
+    e->width = w = MIN((int)g->bitmap.width, a->cell_w);
+    e->height = h = MIN((int)g->bitmap.rows, a->cell_h);
+    e->slot = slot;
+    a->owners[slot] = e;
+    a->referenced[slot] = 1;
+
+    src_itr = g->bitmap.buffer;
+    dest_itr = (uint8_t*)a->surface.data + (slot / a->cols) * a->cell_h * a->surface.stride
+            + (slot % a->cols) * a->cell_w;
+    for(y = 0; y < h; ++y)
+    {
+        memcpy(dest_itr, src_itr, w);
+        src_itr += g->bitmap.pitch;
+        dest_itr += a->surface.stride;
+    }
+    return 0;
 }
 
-static int gr_ttf_copy_glyph_to_surface(GGLSurface *dest, FT_BitmapGlyph glyph, int offX, int offY, int base)
+static TrueTypeCacheEntry *gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_index)
 {
-    int y;
-    uint8_t *src_itr = glyph->bitmap.buffer;
-    uint8_t *dest_itr = dest->data;
+    TrueTypeCacheEntry *res = hashmapGet(font->glyph_cache, &char_index);
+    if(res)
+    {
+        ++font->stats.glyph_hits;
+        return res;
+    }
+
+    ++font->stats.glyph_misses;
 
-    if(glyph->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY)
+    int error = FT_Load_Glyph(font->face, char_index, FT_LOAD_RENDER);
+    if(error)
     {
-        fprintf(stderr, "Unsupported pixel mode in FT_BitmapGlyph %d\n", glyph->bitmap.pixel_mode);
-        return -1;
+        fprintf(stderr, "Failed to load glyph idx %d: %d\n", char_index, error);
+        return NULL;
     }
 
-    dest_itr += (offY + base - glyph->top)*dest->stride + (offX + glyph->left);
+    FT_GlyphSlot g = font->face->glyph;
+
+    res = malloc(sizeof(TrueTypeCacheEntry));
+    memset(res, 0, sizeof(TrueTypeCacheEntry));
+    res->index = char_index;
+    res->advance = g->advance.x >> 6;
+    res->bbox.xMin = g->bitmap_left;
+    res->bbox.xMax = g->bitmap_left + g->bitmap.width;
+    res->bbox.yMin = g->bitmap_top - g->bitmap.rows;
+    res->bbox.yMax = g->bitmap_top;
+    res->slot = -1;
+
+    // the bitmap is rendered already, so put it into the atlas right away
+    gr_ttf_atlas_put(font, res);
+
+    int *key = malloc(sizeof(int));
+    *key = char_index;
 
-    for(y = 0; y < glyph->bitmap.rows; ++y)
+    hashmapPut(font->glyph_cache, key, res);
+    return res;
+}
+
+// Makes sure the bitmap of a glyph is in the atlas
+static int gr_ttf_glyph_atlas_get(TrueTypeFont *font, TrueTypeCacheEntry *e)
+{
+    if(e->slot >= 0)
     {
-        memcpy(dest_itr, src_itr, glyph->bitmap.width);
-        src_itr += glyph->bitmap.pitch;
-        dest_itr += dest->stride;
+        ++font->stats.atlas_hits;
+        font->atlas.referenced[e->slot] = 1;
+        return 0;
     }
-    return 0;
+
+    ++font->stats.atlas_misses;
+
+    int error = FT_Load_Glyph(font->face, e->index, FT_LOAD_RENDER);
+    if(error)
+    {
+        fprintf(stderr, "Failed to load glyph idx %d: %d\n", e->index, error);
+        return -1;
+    }
+    return gr_ttf_atlas_put(font, e);
 }
 
-static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const char *text, int max_width)
+static void gr_ttf_atlas_prefill(TrueTypeFont *font)
 {
-    TrueTypeFont *f = font;
-    TrueTypeCacheEntry *ent;
-    int max_len = 0, total_w = 0;
-    unsigned char c, c2, c3;
-    int i, x, diff, char_idx, prev_idx = 0;
-    int height, base;
-    FT_Vector delta;
-    uint8_t *data = NULL;
-    const char *text_itr = text;
-    int *char_idxs;
-	
-    char_idxs = (int*)malloc(strlen(text) * sizeof(int));
-    while((c = *text_itr++))
+    GlyphAtlas *a = &font->atlas;
+    unsigned i, c;
+
+    for(i = 0; i < sizeof(atlas_prefill_ranges)/sizeof(atlas_prefill_ranges[0]); ++i)
     {
-        if (c < 0x80)
+        for(c = atlas_prefill_ranges[i].first; c <= atlas_prefill_ranges[i].last; ++c)
         {
-            char_idx = FT_Get_Char_Index(f->face, c);
-        }
-        else
-        {
-            c2 = *text_itr++;
-            c3 = *text_itr++;
-            char_idx = FT_Get_Char_Index(f->face, utf8_to_unicode(c, c2, c3));
+            if(a->used >= a->cols * a->max_rows / 2)
+                return;
+
+            int char_idx = gr_ttf_char_index(font, c);
+            if(char_idx)
+                gr_ttf_glyph_cache_get(font, char_idx);
         }
-        char_idxs[max_len] = char_idx;
-        ent = gr_ttf_glyph_cache_get(f, char_idx);
-        if(ent)
-        {
-            diff = ent->glyph->root.advance.x >> 16;
+    }
 
-            if(FT_HAS_KERNING(f->face) && prev_idx && char_idx)
-            {
-                FT_Get_Kerning(f->face, prev_idx, char_idx, FT_KERNING_DEFAULT, &delta);
-                diff += delta.x >> 6;
-            }
+    // fonts without CJK glyphs stop at the first one
+    const char *itr = atlas_prefill_hanzi;
+    while(*itr && a->used < a->cols * a->max_rows / 2)
+    {
+        int char_idx = gr_ttf_char_index(font, utf8_decode(&itr));
+        if(!char_idx)
+            return;
+        gr_ttf_glyph_cache_get(font, char_idx);
+    }
+}
 
-            if(max_width != -1 && total_w + diff > max_width)
-                break;
+static int gr_ttf_char_index(TrueTypeFont *font, unsigned c)
+{
+    int *res;
 
-            total_w += diff;
-        }
-        prev_idx = char_idx;
-        ++max_len;
+    if(c < 128)
+    {
+        if(font->ascii_glyphs[c] == -1)
+            font->ascii_glyphs[c] = FT_Get_Char_Index(font->face, c);
+        return font->ascii_glyphs[c];
     }
 
-    if(font->max_height == -1)
-        gr_ttf_getMaxFontHeight(font);
+    res = hashmapGet(font->char_cache, &c);
+    if(res)
+        return *res;
 
-    if(font->max_height == -1) 
+    int char_idx = FT_Get_Char_Index(font->face, c);
+    if(hashmapSize(font->char_cache) < CHAR_CACHE_MAX_ENTRIES)
     {
-        free(char_idxs);
-    return -1;
+        int *key = malloc(sizeof(int));
+        *key = c;
+        res = malloc(sizeof(int));
+        *res = char_idx;
+        hashmapPut(font->char_cache, key, res);
     }
+    return char_idx;
+}
 
-    height = font->max_height;
+static int gr_ttf_kerning(TrueTypeFont *font, int left, int right)
+{
+    FT_Vector delta;
+    KerningCacheKey k = {
+        .left = left,
+        .right = right
+    };
 
-    data = malloc(total_w*height);
-    memset(data, 0, total_w*height);
-    x = 0;
-    prev_idx = 0;
+    int *res = hashmapGet(font->kerning_cache, &k);
+    if(res)
+    {
+        ++font->stats.kerning_hits;
+        return *res;
+    }
 
-    surface->version = sizeof(*surface);
-    surface->width = total_w;
-    surface->height = height;
-    surface->stride = total_w;
-    surface->data = (void*)data;
-    surface->format = GGL_PIXEL_FORMAT_A_8;
+    ++font->stats.kerning_misses;
+    FT_Get_Kerning(font->face, left, right, FT_KERNING_DEFAULT, &delta);
 
-    for(i = 0; i < max_len; ++i)
+    // past the limit pairs are still correct, just looked up every time
+    if(hashmapSize(font->kerning_cache) < KERNING_CACHE_MAX_ENTRIES)
     {
-        char_idx = char_idxs[i];
-        if(FT_HAS_KERNING(f->face) && prev_idx && char_idx)
-        {
-            FT_Get_Kerning(f->face, prev_idx, char_idx, FT_KERNING_DEFAULT, &delta);
-            x += delta.x >> 6;
-        }
+        KerningCacheKey *key = malloc(sizeof(KerningCacheKey));
+        *key = k;
+        res = malloc(sizeof(int));
+        *res = delta.x >> 6;
+        hashmapPut(font->kerning_cache, key, res);
+    }
+    return delta.x >> 6;
+}
+
+// Decodes text and lays out all of its glyphs
+static void gr_ttf_layout_text(TrueTypeFont *font, StringCacheEntry *entry, const char *text)
+{
+    TrueTypeFont *f = font;
+    TrueTypeCacheEntry *ent;
+    int total_w = 0;
+    int char_idx, prev_idx = 0;
+    const char *text_itr = text;
+    bool kerning = FT_HAS_KERNING(f->face);
+
+    entry->length = strlen(text);
+    entry->items = malloc(MAX(entry->length, 1) * sizeof(GlyphRunItem));
+
+    while(*text_itr)
+    {
+        GlyphRunItem *item = &entry->items[entry->count++];
+
+        item->offset = text_itr - text;
+        char_idx = gr_ttf_char_index(f, utf8_decode(&text_itr));
+
+        if(kerning && prev_idx && char_idx)
+            total_w += gr_ttf_kerning(f, prev_idx, char_idx);
+
+        item->glyph = char_idx;
+        item->x = total_w;
 
         ent = gr_ttf_glyph_cache_get(f, char_idx);
         if(ent)
-        {
-            gr_ttf_copy_glyph_to_surface(surface, ent->glyph, x, 0, font->base);
-            x += ent->glyph->root.advance.x >> 16;
-        }
+            total_w += ent->advance;
 
+        item->end = total_w;
         prev_idx = char_idx;
     }
 
-    free(char_idxs);
-    return max_len;
+    entry->width = total_w;
 }
 
-static StringCacheEntry *gr_ttf_string_cache_peek(TrueTypeFont *font, const char *text, int max_width)
+// Returns how many characters of a laid out string fit into max_width
+static int gr_ttf_fit_count(StringCacheEntry *e, int max_width)
 {
-    StringCacheEntry *res;
-    StringCacheKey k = {
-        .text = (char*)text,
-        .max_width = max_width
-    };
+    int i;
+
+    if(max_width == -1)
+        return e->count;
 
-    return hashmapGet(font->string_cache, &k);
+    for(i = 0; i < e->count; ++i)
+        if(e->items[i].end > max_width)
+            break;
+    return i;
 }
 
-static StringCacheEntry *gr_ttf_string_cache_get(TrueTypeFont *font, const char *text, int max_width)
+static StringCacheEntry *gr_ttf_string_cache_get(TrueTypeFont *font, const char *text)
 {
     StringCacheEntry *res;
     StringCacheKey k = {
-        .text = (char*)text,
-        .max_width = max_width
+        .text = (char*)text
     };
 
     res = hashmapGet(font->string_cache, &k);
     if(!res)
     {
-        res = malloc(sizeof(StringCacheEntry));
-        memset(res, 0, sizeof(StringCacheEntry));
-        res->rendered_len = gr_ttf_render_text(font, &res->surface, text, max_width);
-        if(res->rendered_len < 0)
+        ++font->stats.string_misses;
+
+        // drop the least recently used entry to make room
+        if(hashmapSize(font->string_cache) >= STRING_CACHE_MAX_ENTRIES)
         {
-            free(res);
-            return NULL;
+            StringCacheEntry *ent = font->string_cache_head;
+            font->string_cache_head = ent->next;
+            if(font->string_cache_head)
+                font->string_cache_head->prev = NULL;
+            else
+                font->string_cache_tail = NULL;
+
+            hashmapRemove(font->string_cache, ent->key);
+            gr_ttf_freeStringCache(ent->key, ent, NULL);
         }
 
+        res = malloc(sizeof(StringCacheEntry));
+        memset(res, 0, sizeof(StringCacheEntry));
+        gr_ttf_layout_text(font, res, text);
+
         StringCacheKey *new_key = malloc(sizeof(StringCacheKey));
         memset(new_key, 0, sizeof(StringCacheKey));
-        new_key->max_width = max_width;
         new_key->text = strdup(text);
 
         res->key = new_key;
@@ -495,39 +816,26 @@ static StringCacheEntry *gr_ttf_string_cache_get(TrueTypeFont *font, const char
 
         hashmapPut(font->string_cache, new_key, res);
     }
-    else if(res->next)
+    else
     {
-        // move this entry to the tail of the linked list
-        // if it isn't already there
-        if(res->prev)
-            res->prev->next = res->next;
-
-        res->next->prev = res->prev;
-
-        if(!res->prev)
-            font->string_cache_head = res->next;
+        ++font->stats.string_hits;
 
-        res->next = NULL;
-        res->prev = font->string_cache_tail;
-        res->prev->next = res;
-        font->string_cache_tail = res;
-
-        // truncate old entries
-        if(hashmapSize(font->string_cache) >= STRING_CACHE_MAX_ENTRIES)
+        if(res->next)
         {
-            printf("Truncating string cache entries.\n");
-            int i;
-            StringCacheEntry *ent;
-            for(i = 0; i < STRING_CACHE_TRUNCATE_ENTRIES; ++i)
-            {
-                ent = font->string_cache_head;
-                font->string_cache_head = ent->next;
-                font->string_cache_head->prev = NULL;
+            // move this entry to the tail of the linked list
+            // if it isn't already there
+            if(res->prev)
+                res->prev->next = res->next;
 
-                hashmapRemove(font->string_cache, ent->key);
+            res->next->prev = res->prev;
 
-                gr_ttf_freeStringCache(ent->key, ent, NULL);
-            }
+            if(!res->prev)
+                font->string_cache_head = res->next;
+
+            res->next = NULL;
+            res->prev = font->string_cache_tail;
+            res->prev->next = res;
+            font->string_cache_tail = res;
         }
     }
     return res;
@@ -539,70 +847,40 @@ int gr_ttf_measureEx(const char *s, void *font)
     int res = -1;
 
     pthread_mutex_lock(&f->mutex);
-    StringCacheEntry *e = gr_ttf_string_cache_get(font, s, -1);
+    StringCacheEntry *e = gr_ttf_string_cache_get(font, s);
     if(e)
-        res = e->surface.width;
+        res = e->width;
     pthread_mutex_unlock(&f->mutex);
 
     return res;
 }
 
+// Returns the length in bytes of the longest run of whole characters that
+// fits into max_width, but always at least one character so that callers
+// wrapping text make progress
 int gr_ttf_maxExW(const char *s, void *font, int max_width)
 {
     TrueTypeFont *f = font;
-    TrueTypeCacheEntry *ent;
-    int max_len = 0, total_w = 0;
-    unsigned char c, c2, c3;
-    int char_idx, prev_idx = 0;
-    FT_Vector delta;
-    StringCacheEntry *e;
+    int res = 0;
 
     pthread_mutex_lock(&f->mutex);
-
-    e = gr_ttf_string_cache_peek(font, s, max_width);
-    if(e)
+    StringCacheEntry *e = gr_ttf_string_cache_get(font, s);
+    if(e && e->count > 0)
     {
-        max_len = e->rendered_len;
-        pthread_mutex_unlock(&f->mutex);
-        return max_len;
-    }
-
-    for(; (c = *s++); ++max_len)
-    {
-        if (c < 0x80)
-        {
-            char_idx = FT_Get_Char_Index(f->face, c);
-        }
-        else
-        {
-            c2 = *s++;
-            c3 = *s++;
-            char_idx = FT_Get_Char_Index(f->face, utf8_to_unicode(c, c2, c3));
-        }
-        if(FT_HAS_KERNING(f->face) && prev_idx && char_idx)
-        {
-            FT_Get_Kerning(f->face, prev_idx, char_idx, FT_KERNING_DEFAULT, &delta);
-            total_w += delta.x >> 6;
-        }
-        prev_idx = char_idx;
-
-        if(total_w > max_width)
-            break;
-
-        ent = gr_ttf_glyph_cache_get(f, char_idx);
-        if(!ent)
-            continue;
-
-        total_w += ent->glyph->root.advance.x >> 16;
+        int n = MAX(gr_ttf_fit_count(e, max_width), 1);
+        res = n < e->count ? e->items[n].offset : e->length;
     }
     pthread_mutex_unlock(&f->mutex);
-    return max_len > 0 ? max_len - 1 : 0;
+
+    return res;
 }
 
 int gr_ttf_textExWH(void *context, int x, int y, const char *s, void *pFont, int max_width, int max_height)
 {
     GGLContext *gl = context;
     TrueTypeFont *font = pFont;
+    GlyphAtlas *a = &font->atlas;
+    int i, generation = -1;
 
     // not actualy max width, but max_width + x
     if(max_width != -1)
@@ -612,17 +890,21 @@ int gr_ttf_textExWH(void *context, int x, int y, const char *s, void *pFont, int
             return 0;
     }
 
+    if(font->max_height == -1)
+        gr_ttf_getMaxFontHeight(font);
+
     pthread_mutex_lock(&font->mutex);
 
-    StringCacheEntry *e = gr_ttf_string_cache_get(font, s, max_width);
-    if(!e)
+    StringCacheEntry *e = gr_ttf_string_cache_get(font, s);
+    if(!e || font->max_height == -1)
     {
         pthread_mutex_unlock(&font->mutex);
         return -1;
     }
 
-    int y_bottom = y + e->surface.height;
-    int res = e->rendered_len;
+    int y_bottom = y + font->max_height;
+    int x_right = max_width != -1 ? x + max_width : INT_MAX;
+    int res = gr_ttf_fit_count(e, max_width);
 
     if(max_height != -1 && max_height < y_bottom)
     {
@@ -634,14 +916,34 @@ int gr_ttf_textExWH(void *context, int x, int y, const char *s, void *pFont, int
         }
     }
 
-    gl->bindTexture(gl, &e->surface);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
     gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
     gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
     gl->enable(gl, GGL_TEXTURE_2D);
 
-    gl->texCoord2i(gl, -x, -y);
-    gl->recti(gl, x, y, x + e->surface.width, y_bottom);
+    // blit every glyph from the atlas, clipped to the line
+    for(i = 0; i < res; ++i)
+    {
+        TrueTypeCacheEntry *ent = gr_ttf_glyph_cache_get(font, e->items[i].glyph);
+        if(!ent || gr_ttf_glyph_atlas_get(font, ent) < 0)
+            continue;
+
+        if(generation != a->generation)
+        {
+            gl->bindTexture(gl, &a->surface);
+            generation = a->generation;
+        }
+
+        int gx = x + e->items[i].x + ent->left;
+        int gy = y + font->base - ent->top;
+        int x1 = MAX(gx, x), y1 = MAX(gy, y);
+        int x2 = MIN(gx + ent->width, x_right), y2 = MIN(gy + ent->height, y_bottom);
+        if(x1 >= x2 || y1 >= y2)
+            continue;
+
+        gl->texCoord2i(gl, (ent->slot % a->cols) * a->cell_w - gx, (ent->slot / a->cols) * a->cell_h - gy);
+        gl->recti(gl, x1, y1, x2, y2);
+    }
 
     pthread_mutex_unlock(&font->mutex);
     return res;
@@ -716,7 +1018,7 @@ static bool gr_ttf_dump_stats_count_string_cache(void *key, void *value, void *c
 {
     int *string_cache_size = context;
     StringCacheEntry *e = value;
-    *string_cache_size += e->surface.height*e->surface.width + sizeof(StringCacheEntry);
+    *string_cache_size += e->count*sizeof(GlyphRunItem) + sizeof(StringCacheEntry);
     return true;
 }
 
@@ -724,27 +1026,37 @@ static bool gr_ttf_dump_stats_font(void *key, void *value, void *context)
 {
     TrueTypeFontKey *k = key;
     TrueTypeFont *f = value;
-    int *total_string_cache_size = context;
+    int *total_cache_size = context;
     int string_cache_size = 0;
+    int atlas_size;
 
     pthread_mutex_lock(&f->mutex);
 
     hashmapForEach(f->string_cache, gr_ttf_dump_stats_count_string_cache, &string_cache_size);
+    atlas_size = f->atlas.surface.stride*f->atlas.surface.height;
 
     printf("  Font %s (size %d, dpi %d):\n"
             "    refcount: %d\n"
             "    max_height: %d\n"
             "    base: %d\n"
-            "    glyph_cache: %d entries\n"
-            "    string_cache: %d entries (%.2f kB)\n",
+            "    char_cache: %d entries\n"
+            "    kerning_cache: %d entries, %u hits, %u misses\n"
+            "    glyph_cache: %d entries, %u hits, %u misses\n"
+            "    atlas: %d/%d cells of %dx%d (%.2f kB), %u hits, %u misses, %u evictions\n"
+            "    string_cache: %d entries (%.2f kB), %u hits, %u misses\n",
             k->path, k->size, k->dpi,
             f->refcount, f->max_height, f->base,
-            hashmapSize(f->glyph_cache),
-            hashmapSize(f->string_cache), ((double)string_cache_size)/1024);
+            hashmapSize(f->char_cache),
+            hashmapSize(f->kerning_cache), f->stats.kerning_hits, f->stats.kerning_misses,
+            hashmapSize(f->glyph_cache), f->stats.glyph_hits, f->stats.glyph_misses,
+            f->atlas.used, f->atlas.cols*f->atlas.max_rows, f->atlas.cell_w, f->atlas.cell_h,
+            ((double)atlas_size)/1024, f->stats.atlas_hits, f->stats.atlas_misses, f->stats.atlas_evictions,
+            hashmapSize(f->string_cache), ((double)string_cache_size)/1024,
+            f->stats.string_hits, f->stats.string_misses);
 
     pthread_mutex_unlock(&f->mutex);
 
-    *total_string_cache_size += string_cache_size;
+    *total_cache_size += string_cache_size + atlas_size;
     return true;
 }
 
@@ -757,10 +1069,10 @@ void gr_ttf_dump_stats(void)
         printf("no truetype fonts loaded.\n");
     else
     {
-        int total_string_cache_size = 0;
+        int total_cache_size = 0;
         printf("%d fonts loaded.\n", hashmapSize(font_data.fonts));
-        hashmapForEach(font_data.fonts, gr_ttf_dump_stats_font, &total_string_cache_size);
-        printf("  Total string cache size: %.2f kB\n", ((double)total_string_cache_size)/1024);
+        hashmapForEach(font_data.fonts, gr_ttf_dump_stats_font, &total_cache_size);
+        printf("  Total cache size: %.2f kB\n", ((double)total_cache_size)/1024);
     }
 
     pthread_mutex_unlock(&font_data.mutex);
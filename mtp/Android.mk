@@ -15,12 +15,14 @@ LOCAL_SRC_FILES = \
     MtpDevice.cpp \
     MtpDeviceInfo.cpp \
     MtpEventPacket.cpp \
+    MtpFileTransfer.cpp \
     MtpObjectInfo.cpp \
     MtpPacket.cpp \
     MtpProperty.cpp \
     MtpRequestPacket.cpp \
     MtpResponsePacket.cpp \
     MtpServer.cpp \
+    MtpStats.cpp \
     MtpStorage.cpp \
     MtpStorageInfo.cpp \
     MtpStringBuffer.cpp \
@@ -52,12 +54,14 @@ LOCAL_SRC_FILES = \
     MtpDevice.cpp \
     MtpDeviceInfo.cpp \
     MtpEventPacket.cpp \
+    MtpFileTransfer.cpp \
     MtpObjectInfo.cpp \
     MtpPacket.cpp \
     MtpProperty.cpp \
     MtpRequestPacket.cpp \
     MtpResponsePacket.cpp \
     MtpServer.cpp \
+    MtpStats.cpp \
     MtpStorage.cpp \
     MtpStorageInfo.cpp \
     MtpStringBuffer.cpp \
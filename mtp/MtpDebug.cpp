@@ -21,11 +21,11 @@
 #include <stdio.h>
 
 #define MTP_DEBUG_BUFFER_SIZE 2048
-static int debug_enabled = 0;
+int mtp_debug_enabled = 0;
 
 extern "C" void mtpdebug(const char *fmt, ...)
 {
-	if (debug_enabled) {
+	if (mtp_debug_enabled) {
 		char buf[MTP_DEBUG_BUFFER_SIZE];		// We're going to limit a single request to 512 bytes
 
 		va_list ap;
@@ -419,6 +419,6 @@ const char* MtpDebug::getDevicePropCodeName(MtpPropertyCode code) {
 }
 
 void MtpDebug::enableDebug(void) {
-	debug_enabled = 1;
+	mtp_debug_enabled = 1;
 	MTPD("MTP debug logging enabled\n");
 }
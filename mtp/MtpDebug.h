@@ -28,9 +28,11 @@
 extern "C" {
 #endif
 void mtpdebug(const char *fmt, ...);
+extern int mtp_debug_enabled;
 
 #define MTPI(...) fprintf(stdout, __VA_ARGS__)
-#define MTPD(...) mtpdebug(__VA_ARGS__)
+// the arguments are not evaluated at all unless debugging is enabled
+#define MTPD(...) do { if (mtp_debug_enabled) mtpdebug(__VA_ARGS__); } while (0)
 #define MTPE(...) fprintf(stdout, "E:" __VA_ARGS__)
 
 #ifdef __cplusplus
@@ -44,6 +46,7 @@ public:
 	static const char* getObjectPropCodeName(MtpPropertyCode code);
 	static const char* getDevicePropCodeName(MtpPropertyCode code);
 	static void enableDebug();
+	static bool isDebugEnabled() { return mtp_debug_enabled != 0; }
 };
 
 
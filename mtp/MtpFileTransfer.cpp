@@ -0,0 +1,375 @@
+/*
+ * Copyright (C) 2014 TeamWin - bigbiff and Dees_Troy mtp database conversion to C++
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "MtpFileTransfer.h"
+#include "MtpDebug.h"
+#include "mtp.h"
+
+// buffers are page aligned and a multiple of the page size, so they also work with O_DIRECT
+#define TRANSFER_ALIGNMENT 4096
+
+static uint64_t nowMicroseconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int writeFully(int fd, const char* buf, size_t length) {
+	while (length > 0) {
+		ssize_t ret = write(fd, buf, length);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		length -= ret;
+	}
+	return 0;
+}
+
+static void putLE16(char* buf, uint16_t value) {
+	buf[0] = value & 0xFF;
+	buf[1] = (value >> 8) & 0xFF;
+}
+
+static void putLE32(char* buf, uint32_t value) {
+	putLE16(buf, value & 0xFFFF);
+	putLE16(buf + 2, value >> 16);
+}
+
+MtpFileTransfer::MtpFileTransfer(size_t chunkSize)
+	:	mChunkSize(0),
+		mMaxPacketSize(MTP_TRANSFER_DEFAULT_PACKET_SIZE),
+		mThread(0),
+		mMode(MODE_SEND),
+		mFileFD(-1),
+		mOffset(0),
+		mRemaining(0),
+		mNextSlot(0),
+		mLeadIn(0),
+		mProducerDone(false),
+		mAbort(false),
+		mDiskError(0),
+		mTotalBytes(0),
+		mTotalMicroseconds(0),
+		mLastBytesPerSecond(0)
+{
+	for (int i = 0; i < 2; i++) {
+		mSlots[i].data = NULL;
+		mSlots[i].length = 0;
+		mSlots[i].full = false;
+	}
+	pthread_mutex_init(&mLock, NULL);
+	pthread_cond_init(&mCond, NULL);
+	setChunkSize(chunkSize);
+}
+
+MtpFileTransfer::~MtpFileTransfer() {
+	freeBuffers();
+	pthread_cond_destroy(&mCond);
+	pthread_mutex_destroy(&mLock);
+}
+
+void MtpFileTransfer::setChunkSize(size_t chunkSize) {
+	chunkSize = (chunkSize + TRANSFER_ALIGNMENT - 1) & ~(size_t)(TRANSFER_ALIGNMENT - 1);
+	if (chunkSize == 0)
+		chunkSize = TRANSFER_ALIGNMENT;
+	if (chunkSize != mChunkSize) {
+		freeBuffers();
+		mChunkSize = chunkSize;
+	}
+}
+
+void MtpFileTransfer::resetCounters() {
+	mTotalBytes = 0;
+	mTotalMicroseconds = 0;
+	mLastBytesPerSecond = 0;
+}
+
+bool MtpFileTransfer::allocateBuffers() {
+	for (int i = 0; i < 2; i++) {
+		if (mSlots[i].data)
+			continue;
+		void* buf;
+		if (posix_memalign(&buf, TRANSFER_ALIGNMENT, mChunkSize)) {
+			MTPE("MtpFileTransfer: unable to allocate %u byte buffer\n", mChunkSize);
+			freeBuffers();
+			return false;
+		}
+		mSlots[i].data = (char*) buf;
+	}
+	return true;
+}
+
+void MtpFileTransfer::freeBuffers() {
+	for (int i = 0; i < 2; i++) {
+		free(mSlots[i].data);
+		mSlots[i].data = NULL;
+	}
+}
+
+void* MtpFileTransfer::diskThreadStart(void* cookie) {
+	((MtpFileTransfer*) cookie)->diskThread();
+	return NULL;
+}
+
+int MtpFileTransfer::startDiskThread(Mode mode, int fileFD, uint64_t offset, uint64_t length) {
+	mMode = mode;
+	mFileFD = fileFD;
+	mOffset = offset;
+	mRemaining = length;
+	mNextSlot = 0;
+	mLeadIn = mode == MODE_SEND ? MTP_CONTAINER_HEADER_SIZE : 0;
+	mProducerDone = false;
+	mAbort = false;
+	mDiskError = 0;
+	mSlots[0].full = mSlots[1].full = false;
+	int ret = pthread_create(&mThread, NULL, diskThreadStart, this);
+	if (ret) {
+		MTPE("MtpFileTransfer: unable to start disk thread\n");
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+// Waits for the disk thread to finish and returns the errno of the transfer, or 0.
+// error is the errno of a failed USB operation, which also stops the disk thread.
+int MtpFileTransfer::finishDiskThread(int error) {
+	pthread_mutex_lock(&mLock);
+	if (error)
+		mAbort = true;
+	pthread_cond_broadcast(&mCond);
+	pthread_mutex_unlock(&mLock);
+	pthread_join(mThread, NULL);
+	return error ? error : mDiskError;
+}
+
+// Returns the slot once it has the requested state, or NULL if the transfer is over.
+MtpFileTransfer::Slot* MtpFileTransfer::waitForSlot(bool full) {
+	Slot* slot = &mSlots[mNextSlot];
+	pthread_mutex_lock(&mLock);
+	while (slot->full != full && !mAbort && !mDiskError && !(full && mProducerDone))
+		pthread_cond_wait(&mCond, &mLock);
+	bool ok = slot->full == full && !mAbort && !mDiskError;
+	pthread_mutex_unlock(&mLock);
+	return ok ? slot : NULL;
+}
+
+void MtpFileTransfer::releaseSlot(Slot* slot, bool full) {
+	pthread_mutex_lock(&mLock);
+	slot->full = full;
+	pthread_cond_broadcast(&mCond);
+	pthread_mutex_unlock(&mLock);
+}
+
+void MtpFileTransfer::diskThread() {
+	// both sides walk the two slots in the same order, each with its own index
+	int index = 0;
+	int error = 0;
+	size_t leadIn = mLeadIn;
+	while (!error) {
+		Slot* slot = &mSlots[index];
+		if (mMode == MODE_SEND) {
+			if (mRemaining == 0)
+				break;
+			pthread_mutex_lock(&mLock);
+			while (slot->full && !mAbort)
+				pthread_cond_wait(&mCond, &mLock);
+			bool abort = mAbort;
+			pthread_mutex_unlock(&mLock);
+			if (abort)
+				break;
+			// slots are sent as they are, so only the last one may be short of a whole chunk
+			size_t want = mChunkSize - leadIn;
+			if (mRemaining < want)
+				want = mRemaining;
+			size_t got = 0;
+			while (got < want) {
+				ssize_t ret = pread(mFileFD, slot->data + leadIn + got, want - got, mOffset + got);
+				if (ret < 0 && errno == EINTR)
+					continue;
+				if (ret <= 0) {
+					// a file that shrank while sending is an error too
+					error = ret < 0 ? errno : EIO;
+					break;
+				}
+				got += ret;
+			}
+			if (error)
+				break;
+			slot->length = leadIn + got;
+			leadIn = 0;
+			mOffset += got;
+			mRemaining -= got;
+			releaseSlot(slot, true);
+		} else {
+			pthread_mutex_lock(&mLock);
+			while (!slot->full && !mAbort && !mProducerDone)
+				pthread_cond_wait(&mCond, &mLock);
+			bool stop = mAbort || !slot->full;
+			pthread_mutex_unlock(&mLock);
+			if (stop)
+				break;
+			size_t written = 0;
+			while (written < slot->length) {
+				ssize_t ret = pwrite(mFileFD, slot->data + written, slot->length - written, mOffset + written);
+				if (ret < 0) {
+					if (errno == EINTR)
+						continue;
+					error = errno;
+					break;
+				}
+				written += ret;
+			}
+			mOffset += written;
+			if (!error)
+				releaseSlot(slot, false);
+		}
+		index ^= 1;
+	}
+
+	pthread_mutex_lock(&mLock);
+	if (error) {
+		MTPE("MtpFileTransfer: disk I/O failed: %s\n", strerror(error));
+		mDiskError = error;
+	}
+	if (mMode == MODE_SEND)
+		mProducerDone = true;
+	pthread_cond_broadcast(&mCond);
+	pthread_mutex_unlock(&mLock);
+}
+
+void MtpFileTransfer::addToCounters(uint64_t bytes, uint64_t startTime) {
+	uint64_t elapsed = nowMicroseconds() - startTime;
+	mTotalBytes += bytes;
+	mTotalMicroseconds += elapsed;
+	mLastBytesPerSecond = elapsed ? bytes * 1000000 / elapsed : 0;
+	MTPD("MtpFileTransfer: %llu bytes in %llu us, %llu bytes/s\n", bytes, elapsed, mLastBytesPerSecond);
+}
+
+int MtpFileTransfer::sendFile(int usbFD, int fileFD, uint64_t offset, uint64_t length,
+		MtpOperationCode code, MtpTransactionID transactionID) {
+	if (!allocateBuffers()) {
+		errno = ENOMEM;
+		return -1;
+	}
+	uint64_t startTime = nowMicroseconds();
+	uint64_t total = length + MTP_CONTAINER_HEADER_SIZE;
+	char header[MTP_CONTAINER_HEADER_SIZE];
+	putLE32(header + MTP_CONTAINER_LENGTH_OFFSET, total > 0xFFFFFFFFULL ? 0xFFFFFFFF : total);
+	putLE16(header + MTP_CONTAINER_TYPE_OFFSET, MTP_CONTAINER_TYPE_DATA);
+	putLE16(header + MTP_CONTAINER_CODE_OFFSET, code);
+	putLE32(header + MTP_CONTAINER_TRANSACTION_ID_OFFSET, transactionID);
+
+	if (startDiskThread(MODE_SEND, fileFD, offset, length))
+		return -1;
+	int error = 0;
+	uint64_t sent = 0;
+	size_t leadIn = sizeof(header);
+	// without data the header is the whole data phase
+	if (length == 0 && writeFully(usbFD, header, sizeof(header)))
+		error = errno;
+	mNextSlot = 0;
+	while (!error && sent < length) {
+		Slot* slot = waitForSlot(true);
+		if (!slot)
+			break;
+		// the disk thread left room for the header in front of the first chunk
+		memcpy(slot->data, header, leadIn);
+		if (writeFully(usbFD, slot->data, slot->length)) {
+			error = errno;
+			break;
+		}
+		sent += slot->length - leadIn;
+		leadIn = 0;
+		releaseSlot(slot, false);
+		mNextSlot ^= 1;
+	}
+	error = finishDiskThread(error);
+	if (!error && sent < length)
+		error = EIO;
+	// a data phase that ends exactly on a packet boundary is terminated by a zero length packet
+	if (!error && total % mMaxPacketSize == 0 && write(usbFD, header, 0) < 0)
+		error = errno;
+	if (error) {
+		MTPE("MtpFileTransfer: send failed after %llu of %llu bytes: %s\n", sent, length, strerror(error));
+		errno = error;
+		return -1;
+	}
+	addToCounters(length, startTime);
+	return 0;
+}
+
+int MtpFileTransfer::receiveFile(int usbFD, int fileFD, uint64_t offset, uint64_t length) {
+	if (!allocateBuffers()) {
+		errno = ENOMEM;
+		return -1;
+	}
+	uint64_t startTime = nowMicroseconds();
+	bool untilShortPacket = length == 0xFFFFFFFF;
+
+	if (startDiskThread(MODE_RECEIVE, fileFD, offset, length))
+		return -1;
+	int error = 0;
+	uint64_t received = 0;
+	mNextSlot = 0;
+	while (untilShortPacket || received < length) {
+		Slot* slot = waitForSlot(false);
+		if (!slot)
+			break;
+		size_t want = mChunkSize;
+		if (!untilShortPacket && length - received < want)
+			want = length - received;
+		ssize_t ret;
+		do {
+			ret = read(usbFD, slot->data, want);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0) {
+			error = errno;
+			break;
+		}
+		received += ret;
+		if (ret > 0) {
+			slot->length = ret;
+			releaseSlot(slot, true);
+			mNextSlot ^= 1;
+		}
+		// a short packet ends the data phase
+		if ((size_t)ret < want)
+			break;
+	}
+	pthread_mutex_lock(&mLock);
+	mProducerDone = true;
+	pthread_mutex_unlock(&mLock);
+	error = finishDiskThread(error);
+	if (!error && !untilShortPacket && received < length)
+		error = EIO;
+	if (error) {
+		MTPE("MtpFileTransfer: receive failed after %llu bytes: %s\n", received, strerror(error));
+		errno = error;
+		return -1;
+	}
+	addToCounters(received, startTime);
+	return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2014 TeamWin - bigbiff and Dees_Troy mtp database conversion to C++
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_FILE_TRANSFER_H
+#define _MTP_FILE_TRANSFER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include "MtpTypes.h"
+
+#define MTP_TRANSFER_DEFAULT_CHUNK_SIZE (256 * 1024)
+#define MTP_TRANSFER_DEFAULT_PACKET_SIZE 512
+
+// Userspace replacement for the MTP_SEND_FILE_WITH_HEADER and MTP_RECEIVE_FILE
+// ioctls, for USB drivers that do not implement them (e.g. FunctionFS).
+// A disk thread reads or writes one buffer while the calling thread moves the
+// other buffer over USB, so disk and USB I/O overlap.
+class MtpFileTransfer {
+public:
+    MtpFileTransfer(size_t chunkSize = MTP_TRANSFER_DEFAULT_CHUNK_SIZE);
+    virtual ~MtpFileTransfer();
+
+    void                setChunkSize(size_t chunkSize);
+    inline size_t       getChunkSize() const { return mChunkSize; }
+    // needed to know when the data phase must be terminated by a zero length packet
+    inline void         setMaxPacketSize(size_t size) { mMaxPacketSize = size; }
+
+    // Sends a data container header followed by length bytes of fileFD starting at offset.
+    // The header goes out in the same write as the start of the data, a short write would end the data phase.
+    // Returns 0 on success, -1 with errno set on failure.
+    int                 sendFile(int usbFD, int fileFD, uint64_t offset, uint64_t length,
+                                MtpOperationCode code, MtpTransactionID transactionID);
+    // Receives length bytes of data phase payload into fileFD starting at offset.
+    // A length of 0xFFFFFFFF reads until a short packet is received.
+    // Returns 0 on success, -1 with errno set on failure.
+    int                 receiveFile(int usbFD, int fileFD, uint64_t offset, uint64_t length);
+
+    // throughput counters, accumulated over all transfers since the last reset
+    inline uint64_t     getTotalBytes() const { return mTotalBytes; }
+    inline uint64_t     getTotalMicroseconds() const { return mTotalMicroseconds; }
+    inline uint64_t     getLastBytesPerSecond() const { return mLastBytesPerSecond; }
+    void                resetCounters();
+
+private:
+    struct Slot {
+        char*           data;
+        size_t          length;
+        bool            full;
+    };
+
+    enum Mode {
+        MODE_SEND,
+        MODE_RECEIVE
+    };
+
+    static void*        diskThreadStart(void* cookie);
+    void                diskThread();
+    bool                allocateBuffers();
+    void                freeBuffers();
+    int                 startDiskThread(Mode mode, int fileFD, uint64_t offset, uint64_t length);
+    int                 finishDiskThread(int error);
+    Slot*               waitForSlot(bool full);
+    void                releaseSlot(Slot* slot, bool full);
+    void                addToCounters(uint64_t bytes, uint64_t startTime);
+
+    size_t              mChunkSize;
+    size_t              mMaxPacketSize;
+    Slot                mSlots[2];
+
+    // state shared with the disk thread, protected by mLock
+    pthread_mutex_t     mLock;
+    pthread_cond_t      mCond;
+    pthread_t           mThread;
+    Mode                mMode;
+    int                 mFileFD;
+    uint64_t            mOffset;
+    uint64_t            mRemaining;
+    int                 mNextSlot;      // slot the disk thread uses next
+    size_t              mLeadIn;        // bytes kept free in front of the first slot for the container header
+    bool                mProducerDone;  // no more slots will be filled
+    bool                mAbort;         // the calling thread gave up
+    int                 mDiskError;     // errno of a failed disk operation
+
+    uint64_t            mTotalBytes;
+    uint64_t            mTotalMicroseconds;
+    uint64_t            mLastBytesPerSecond;
+};
+
+#endif // _MTP_FILE_TRANSFER_H
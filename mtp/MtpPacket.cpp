@@ -68,6 +68,9 @@ void MtpPacket::dump() {
 	char buffer[500];
 	char* bufptr = buffer;
 
+	if (!MtpDebug::isDebugEnabled())
+		return;
+
 	for (size_t i = 0; i < mPacketSize; i++) {
 		sprintf(bufptr, "%02X ", mBuffer[i]);
 		bufptr += strlen(bufptr);
@@ -36,8 +36,11 @@
 #include "MtpServer.h"
 #include "MtpStorage.h"
 #include "MtpStringBuffer.h"
+#include "MtpStats.h"
 
 #include <linux/usb/f_mtp.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
 
 static const MtpOperationCode kSupportedOperationCodes[] = {
 	MTP_OPERATION_GET_DEVICE_INFO,
@@ -107,7 +110,8 @@ MtpServer::MtpServer(int fd, MtpDatabase* database, bool ptp,
 		mSessionOpen(false),
 		mSendObjectHandle(kInvalidObjectHandle),
 		mSendObjectFormat(0),
-		mSendObjectFileSize(0)
+		mSendObjectFileSize(0),
+		mFileIoctlsSupported(true)
 {
 }
 
@@ -176,6 +180,7 @@ void MtpServer::run() {
 		}
 		MtpOperationCode operation = mRequest.getOperationCode();
 		MtpTransactionID transaction = mRequest.getTransactionID();
+		uint64_t requestStart = MtpStats::now();
 
 		MTPD("operation: %s", MtpDebug::getOperationCodeName(operation));
 		mRequest.dump();
@@ -234,7 +239,10 @@ void MtpServer::run() {
 		} else {
 			MTPD("skipping response\n");
 		}
+		MtpStats::addRequest(operation, MtpStats::now() - requestStart);
+		MtpStats::writeFile(false);
 	}
+	MtpStats::writeFile(true);
 
 	// commit any open edits
 	int count = mObjectEditList.size();
@@ -316,9 +324,73 @@ void MtpServer::removeEditObject(MtpObjectHandle handle) {
 }
 
 void MtpServer::commitEdit(ObjectEdit* edit) {
+	mDatabase->lockMutex();
 	mDatabase->endSendObject((const char *)edit->mPath, edit->mHandle, edit->mFormat, true);
+	mDatabase->unlockMutex();
+}
+
+// The transfers have to know the packet size of the endpoint to end a data
+// phase that fills its last packet with a zero length packet. FunctionFS
+// can tell it, and it also tells the bus speed to size the chunks for.
+void MtpServer::useUserspaceTransfers() {
+	size_t packetSize = MTP_TRANSFER_DEFAULT_PACKET_SIZE;
+
+	MTPI("MTP file ioctls not supported by the kernel, using userspace transfers\n");
+	mFileIoctlsSupported = false;
+#ifdef FUNCTIONFS_ENDPOINT_DESC
+	struct usb_endpoint_descriptor desc;
+	if (ioctl(mFD, FUNCTIONFS_ENDPOINT_DESC, &desc) == 0 && (desc.wMaxPacketSize & 0x7FF) != 0)
+		packetSize = desc.wMaxPacketSize & 0x7FF;
+	else
+		MTPI("Unable to get the endpoint's packet size, using %u\n", (unsigned) packetSize);
+#endif
+	mTransfer.setMaxPacketSize(packetSize);
+	if (packetSize >= 1024)
+		mTransfer.setChunkSize(1024 * 1024);   // SuperSpeed
+	else if (packetSize >= 512)
+		mTransfer.setChunkSize(MTP_TRANSFER_DEFAULT_CHUNK_SIZE);
+	else
+		mTransfer.setChunkSize(64 * 1024);     // full speed
+	MTPI("Userspace transfers use %u byte packets and %u byte chunks\n", (unsigned) packetSize, (unsigned) mTransfer.getChunkSize());
+}
+
+int MtpServer::sendFile(mtp_file_range& mfr) {
+	uint64_t start = MtpStats::now();
+	int ret = -1;
+	if (mFileIoctlsSupported) {
+		ret = ioctl(mFD, MTP_SEND_FILE_WITH_HEADER, (unsigned long)&mfr);
+		MTPD("MTP_SEND_FILE_WITH_HEADER returned %d\n", ret);
+		if (ret < 0 && errno == ENOTTY)
+			useUserspaceTransfers();
+	}
+	if (!mFileIoctlsSupported)
+		ret = mTransfer.sendFile(mFD, mfr.fd, mfr.offset, mfr.length, mfr.command, mfr.transaction_id);
+	if (ret >= 0)
+		MtpStats::addTransfer(mfr.length, MtpStats::now() - start);
+	return ret;
 }
 
+int MtpServer::receiveFile(mtp_file_range& mfr) {
+	uint64_t start = MtpStats::now();
+	int ret = -1;
+	if (mFileIoctlsSupported) {
+		ret = ioctl(mFD, MTP_RECEIVE_FILE, (unsigned long)&mfr);
+		MTPD("MTP_RECEIVE_FILE returned %d\n", ret);
+		if (ret < 0 && errno == ENOTTY)
+			useUserspaceTransfers();
+	}
+	if (!mFileIoctlsSupported)
+		ret = mTransfer.receiveFile(mFD, mfr.fd, mfr.offset, mfr.length);
+	if (ret >= 0) {
+		// the length is open ended when receiving until a short packet, so ask the file
+		struct stat st;
+		uint64_t bytes = mfr.length;
+		if (bytes == 0xFFFFFFFF)
+			bytes = fstat(mfr.fd, &st) == 0 && (uint64_t)st.st_size > (uint64_t)mfr.offset ? st.st_size - mfr.offset : 0;
+		MtpStats::addTransfer(bytes, MtpStats::now() - start);
+	}
+	return ret;
+}
 
 bool MtpServer::handleRequest() {
 	android::Mutex::Autolock autoLock(mMutex);
@@ -538,6 +610,12 @@ MtpResponseCode MtpServer::doCloseSession() {
 		return MTP_RESPONSE_SESSION_NOT_OPEN;
 	mSessionID = 0;
 	mSessionOpen = false;
+	// objects the host did not close properly still get their new size
+	while (mObjectEditList.size() > 0) {
+		ObjectEdit* edit = mObjectEditList[0];
+		commitEdit(edit);
+		removeEditObject(edit->mHandle);
+	}
 	mDatabase->sessionEnded();
 	return MTP_RESPONSE_OK;
 }
@@ -826,8 +904,7 @@ MtpResponseCode MtpServer::doGetObject() {
 	mfr.transaction_id = mRequest.getTransactionID();
 
 	// then transfer the file
-	int ret = ioctl(mFD, MTP_SEND_FILE_WITH_HEADER, (unsigned long)&mfr);
-	MTPD("MTP_SEND_FILE_WITH_HEADER returned %d\n", ret);
+	int ret = sendFile(mfr);
 	close(mfr.fd);
 	if (ret < 0) {
 		if (errno == ECANCELED)
@@ -882,6 +959,8 @@ MtpResponseCode MtpServer::doGetPartialObject(MtpOperationCode operation) {
 	if (result != MTP_RESPONSE_OK) {
 		return result;
 	}
+	if (offset > (uint64_t)fileLength)
+		return MTP_RESPONSE_INVALID_PARAMETER;
 	if (offset + length > (uint64_t)fileLength)
 		length = fileLength - offset;
 
@@ -898,8 +977,7 @@ MtpResponseCode MtpServer::doGetPartialObject(MtpOperationCode operation) {
 	mResponse.setParameter(1, length);
 
 	// transfer the file
-	int ret = ioctl(mFD, MTP_SEND_FILE_WITH_HEADER, (unsigned long)&mfr);
-	MTPD("MTP_SEND_FILE_WITH_HEADER returned %d\n", ret);
+	int ret = sendFile(mfr);
 	close(mfr.fd);
 	if (ret < 0) {
 		if (errno == ECANCELED)
@@ -1027,6 +1105,7 @@ MtpResponseCode MtpServer::doSendObject() {
 	MtpResponseCode result = MTP_RESPONSE_OK;
 	mode_t mask;
 	int ret = 0, initialData;
+	bool keepPartial = false;
 
 	if (mSendObjectHandle == kInvalidObjectHandle) {
 		MTPE("Expected SendObjectInfo before SendObject");
@@ -1070,16 +1149,19 @@ MtpResponseCode MtpServer::doSendObject() {
 
 		MTPD("receiving %s\n", (const char *)mSendObjectFilePath);
 		// transfer the file
-		ret = ioctl(mFD, MTP_RECEIVE_FILE, (unsigned long)&mfr);
+		ret = receiveFile(mfr);
 	}
 	close(mfr.fd);
 
 	if (ret < 0) {
-		unlink(mSendObjectFilePath);
-		if (errno == ECANCELED)
+		if (errno == ECANCELED) {
+			// keep what was received, so the host can resume with
+			// BeginEditObject / SendPartialObject at the current object size
 			result = MTP_RESPONSE_TRANSACTION_CANCELLED;
-		else
+			keepPartial = true;
+		} else {
 			result = MTP_RESPONSE_GENERAL_ERROR;
+		}
 	}
 
 done:
@@ -1088,7 +1170,7 @@ done:
 	mData.reset();
 	mDatabase->lockMutex();
 	mDatabase->endSendObject(mSendObjectFilePath, mSendObjectHandle, mSendObjectFormat,
-			result == MTP_RESPONSE_OK);
+			result == MTP_RESPONSE_OK || keepPartial);
 	mDatabase->unlockMutex();
 	mSendObjectHandle = kInvalidObjectHandle;
 	MTPD("result: %d\n", result);
@@ -1246,36 +1328,44 @@ MtpResponseCode MtpServer::doSendPartialObject() {
 	int ret = mData.read(mFD);
 	if (ret < MTP_CONTAINER_HEADER_SIZE)
 		return MTP_RESPONSE_GENERAL_ERROR;
-	int initialData = ret - MTP_CONTAINER_HEADER_SIZE;
+	uint32_t initialData = ret - MTP_CONTAINER_HEADER_SIZE;
+	if (initialData > length)
+		initialData = length;
+	uint64_t end = offset;
 
 	if (initialData > 0) {
-		ret = write(edit->mFD, mData.getData(), initialData);
-		offset += initialData;
-		length -= initialData;
+		ret = pwrite(edit->mFD, mData.getData(), initialData, offset);
+		if (ret > 0)
+			end += ret;
 	}
 
-	if (length > 0) {
+	if (ret >= 0 && length > initialData) {
 		mtp_file_range  mfr;
 		mfr.fd = edit->mFD;
-		mfr.offset = offset;
-		mfr.length = length;
+		mfr.offset = offset + initialData;
+		mfr.length = length - initialData;
 
 		// transfer the file
-		ret = ioctl(mFD, MTP_RECEIVE_FILE, (unsigned long)&mfr);
-		MTPD("MTP_RECEIVE_FILE returned %d", ret);
+		ret = receiveFile(mfr);
+		if (ret >= 0)
+			end = offset + length;
 	}
+	// reset so we don't attempt to send this back
+	mData.reset();
 	if (ret < 0) {
+		// whatever made it to disk before a cancel counts, so the next range can continue from there
+		int error = errno;
+		struct stat st;
+		if (fstat(edit->mFD, &st) == 0 && (uint64_t)st.st_size > edit->mSize)
+			edit->mSize = st.st_size;
 		mResponse.setParameter(1, 0);
-		if (errno == ECANCELED)
+		if (error == ECANCELED)
 			return MTP_RESPONSE_TRANSACTION_CANCELLED;
 		else
 			return MTP_RESPONSE_GENERAL_ERROR;
 	}
 
-	// reset so we don't attempt to send this back
-	mData.reset();
-	mResponse.setParameter(1, length);
-	uint64_t end = offset + length;
+	mResponse.setParameter(1, end - offset);
 	if (end > edit->mSize) {
 		edit->mSize = end;
 	}
@@ -28,7 +28,9 @@
 #include "MtpEventPacket.h"
 #include "mtp.h"
 #include "MtpUtils.h"
+#include "MtpFileTransfer.h"
 
+struct mtp_file_range;
 
 class MtpDatabase;
 class MtpStorage;
@@ -70,6 +72,10 @@ private:
 
 	pthread_mutex_t mtpMutex;
 
+    // userspace transfers for kernels without the MTP file ioctls
+    MtpFileTransfer     mTransfer;
+    bool                mFileIoctlsSupported;
+
     // represents an MTP object that is being edited using the android extensions
     // for direct editing (BeginEditObject, SendPartialObject, TruncateObject and EndEditObject)
     class ObjectEdit {
@@ -121,6 +127,10 @@ private:
 
     bool                handleRequest();
 
+    void                useUserspaceTransfers();
+    int                 sendFile(mtp_file_range& mfr);
+    int                 receiveFile(mtp_file_range& mfr);
+
     MtpResponseCode     doGetDeviceInfo();
     MtpResponseCode     doOpenSession();
     MtpResponseCode     doCloseSession();
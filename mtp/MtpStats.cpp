@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2014 TeamWin - bigbiff and Dees_Troy mtp database conversion to C++
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <string>
+
+#include "MtpStats.h"
+#include "MtpDebug.h"
+
+#define MAX_OPCODES 64
+// latency histogram buckets: <100us, <1ms, <10ms, <100ms, <1s, >=1s
+#define HISTOGRAM_BUCKETS 6
+
+struct OpcodeStats {
+	MtpOperationCode code;
+	uint32_t count;
+	uint64_t totalMicros;
+	uint64_t maxMicros;
+	uint32_t histogram[HISTOGRAM_BUCKETS];
+};
+
+static OpcodeStats opcodes[MAX_OPCODES];
+static int opcodeCount = 0;
+
+static uint64_t startTime = MtpStats::now();
+static uint64_t lastWrite = 0;
+
+static uint32_t transfers = 0;
+static uint64_t transferBytes = 0;
+static uint64_t transferMicros = 0;
+static uint64_t lastTransferBytesPerSecond = 0;
+
+// updated from several threads
+static uint64_t lockWaits = 0;
+static uint64_t lockWaitMicros = 0;
+static uint64_t lockWaitMaxMicros = 0;
+static uint64_t inotifyEvents = 0;
+static uint32_t inotifyBatches = 0;
+static uint32_t inotifyMaxBatch = 0;
+
+uint64_t MtpStats::now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void MtpStats::addRequest(MtpOperationCode code, uint64_t micros) {
+	OpcodeStats* op = NULL;
+	for (int i = 0; i < opcodeCount; i++) {
+		if (opcodes[i].code == code) {
+			op = &opcodes[i];
+			break;
+		}
+	}
+	if (!op) {
+		if (opcodeCount == MAX_OPCODES)
+			return;
+		op = &opcodes[opcodeCount++];
+		memset(op, 0, sizeof(*op));
+		op->code = code;
+	}
+	op->count++;
+	op->totalMicros += micros;
+	if (micros > op->maxMicros)
+		op->maxMicros = micros;
+	int bucket = 0;
+	for (uint64_t limit = 100; bucket < HISTOGRAM_BUCKETS - 1 && micros >= limit; limit *= 10)
+		bucket++;
+	op->histogram[bucket]++;
+}
+
+void MtpStats::addTransfer(uint64_t bytes, uint64_t micros) {
+	transfers++;
+	transferBytes += bytes;
+	transferMicros += micros;
+	lastTransferBytesPerSecond = micros ? bytes * 1000000 / micros : 0;
+}
+
+void MtpStats::addLockWait(uint64_t micros) {
+	__sync_fetch_and_add(&lockWaits, 1);
+	__sync_fetch_and_add(&lockWaitMicros, micros);
+	uint64_t max = lockWaitMaxMicros;
+	while (micros > max && !__sync_bool_compare_and_swap(&lockWaitMaxMicros, max, micros))
+		max = lockWaitMaxMicros;
+}
+
+void MtpStats::addInotifyBatch(uint32_t events) {
+	__sync_fetch_and_add(&inotifyEvents, events);
+	__sync_fetch_and_add(&inotifyBatches, 1);
+	uint32_t max = inotifyMaxBatch;
+	while (events > max && !__sync_bool_compare_and_swap(&inotifyMaxBatch, max, events))
+		max = inotifyMaxBatch;
+}
+
+void MtpStats::writeFile(bool force) {
+	uint64_t current = now();
+	if (!force && current - lastWrite < 1000000)
+		return;
+	lastWrite = current;
+
+	std::string tmpPath = MTP_STATS_FILE ".tmp";
+	FILE* fp = fopen(tmpPath.c_str(), "w");
+	if (!fp)
+		return;
+	fprintf(fp, "uptime_s=%llu\n", (current - startTime) / 1000000);
+	fprintf(fp, "transfers=%u\n", transfers);
+	fprintf(fp, "transfer_bytes=%llu\n", transferBytes);
+	fprintf(fp, "transfer_avg_bytes_per_s=%llu\n", transferMicros ? transferBytes * 1000000 / transferMicros : 0);
+	fprintf(fp, "transfer_last_bytes_per_s=%llu\n", lastTransferBytesPerSecond);
+	fprintf(fp, "lock_waits=%llu\n", lockWaits);
+	fprintf(fp, "lock_wait_total_us=%llu\n", lockWaitMicros);
+	fprintf(fp, "lock_wait_max_us=%llu\n", lockWaitMaxMicros);
+	fprintf(fp, "inotify_events=%llu\n", inotifyEvents);
+	fprintf(fp, "inotify_avg_queue=%llu\n", inotifyBatches ? inotifyEvents / inotifyBatches : 0);
+	fprintf(fp, "inotify_max_queue=%u\n", inotifyMaxBatch);
+	fprintf(fp, "# opcode count avg_us max_us <100us <1ms <10ms <100ms <1s >=1s\n");
+	for (int i = 0; i < opcodeCount; i++) {
+		OpcodeStats& op = opcodes[i];
+		fprintf(fp, "%s %u %llu %llu", MtpDebug::getOperationCodeName(op.code), op.count,
+				op.totalMicros / op.count, op.maxMicros);
+		for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+			fprintf(fp, " %u", op.histogram[b]);
+		fprintf(fp, "\n");
+	}
+	fclose(fp);
+	rename(tmpPath.c_str(), MTP_STATS_FILE);
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2014 TeamWin - bigbiff and Dees_Troy mtp database conversion to C++
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_STATS_H
+#define _MTP_STATS_H
+
+#include <stdint.h>
+#include "MtpTypes.h"
+
+// written by the MTP process at most once per second, readable from the GUI or adb
+#define MTP_STATS_FILE "/tmp/mtp_stats"
+
+// Cheap always-on counters for diagnosing slow hosts without a debug build.
+// Request counters are only updated from the MTP thread; lock and inotify
+// counters may be updated from any thread.
+class MtpStats {
+public:
+	static uint64_t now();	// monotonic time in microseconds
+
+	static void addRequest(MtpOperationCode code, uint64_t micros);
+	static void addTransfer(uint64_t bytes, uint64_t micros);
+	static void addLockWait(uint64_t micros);
+	static void addInotifyBatch(uint32_t events);
+
+	// rewrites MTP_STATS_FILE if force is set or a second has passed since the last write
+	static void writeFile(bool force);
+};
+
+#endif // _MTP_STATS_H
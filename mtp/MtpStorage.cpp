@@ -22,6 +22,7 @@
 #include "MtpServer.h"
 #include "MtpEventPacket.h"
 #include "MtpDatabase.h"
+#include "MtpStats.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -36,9 +37,103 @@
 #include <signal.h>
 #include <sys/inotify.h>
 #include <fcntl.h>
+#include <time.h>
+#include <set>
+#include <algorithm>
 
 #define WATCH_FLAGS ( IN_CREATE | IN_DELETE | IN_MOVE | IN_MODIFY )
 
+// directories with more entries than this get their entries stat'ed by a small thread pool
+#define PARALLEL_STAT_THRESHOLD 64
+#define STAT_THREADS 4
+// upper limit of subdirectories queued for background reading per opened directory
+#define MAX_PREFETCH_DIRS 32
+
+// object database snapshots, see saveDB()
+#define MTP_DB_DIR "/tmp/mtpdb"
+#define MTP_DB_MAGIC "TWMTPDB1"
+#define MTP_DB_FLAG_DIR 1
+#define MTP_DB_FLAG_READ 2
+// minimum number of seconds between two snapshots
+#define MTP_DB_SAVE_INTERVAL 5
+
+// Handles are unique across all storages of this process. Handles from a
+// snapshot are only reused if the snapshot was written by the same handle
+// sequence, i.e. it carries the same run id.
+static MtpObjectHandle lastHandle = 0;
+static uint64_t dbRunId = 0;
+
+struct StatJob {
+	int dfd;
+	std::vector<MtpStorage::DirEntry>* entries;
+	size_t start;
+	size_t end;
+};
+
+static void* statEntries(void* cookie) {
+	StatJob* job = (StatJob*) cookie;
+	for (size_t i = job->start; i < job->end; i++) {
+		MtpStorage::DirEntry& e = (*job->entries)[i];
+		// Because exfat-fuse causes issues with dirent, we will use stat
+		// for some things that dirent should be able to do
+		e.valid = fstatat(job->dfd, e.name.c_str(), &e.st, AT_SYMLINK_NOFOLLOW) == 0;
+	}
+	return NULL;
+}
+
+template <class T>
+static void putValue(std::string& buf, T value) {
+	buf.append((const char*) &value, sizeof(value));
+}
+
+static void putString(std::string& buf, const std::string& str) {
+	putValue<uint16_t>(buf, str.size());
+	buf.append(str);
+}
+
+struct DBRecord {
+	MtpObjectHandle handle;
+	MtpObjectHandle parent;
+	uint8_t flags;
+	uint64_t size;
+	uint64_t mtime;
+	std::string name;
+	uint64_t dirInode;
+	uint64_t dirMtime;
+};
+
+class DBReader {
+	const std::string& buf;
+	size_t pos;
+public:
+	bool ok;
+	DBReader(const std::string& b) : buf(b), pos(0), ok(true) {}
+	bool atEnd() const { return pos >= buf.size(); }
+
+	template <class T>
+	T get() {
+		T value = 0;
+		if (pos + sizeof(T) > buf.size()) {
+			ok = false;
+			return value;
+		}
+		memcpy(&value, buf.data() + pos, sizeof(T));
+		pos += sizeof(T);
+		return value;
+	}
+
+	std::string getString() {
+		uint16_t len = get<uint16_t>();
+		if (!ok || pos + len > buf.size()) {
+			ok = false;
+			return "";
+		}
+		std::string str(buf, pos, len);
+		pos += len;
+		return str;
+	}
+};
+
 MtpStorage::MtpStorage(MtpStorageID id, const char* filePath,
 		const char* description, uint64_t reserveSpace,
 		bool removable, uint64_t maxFileSize, MtpServer* refserver)
@@ -53,6 +148,9 @@ MtpStorage::MtpStorage(MtpStorageID id, const char* filePath,
 {
 	MTPI("MtpStorage id: %d path: %s\n", id, filePath);
 	inotify_thread = 0;
+	prefetch_thread = 0;
+	prefetchStop = false;
+	dbDirty = 0;
 	sendEvents = false;
 	handleCurrentlySending = 0;
 	use_mutex = true;
@@ -64,10 +162,20 @@ MtpStorage::MtpStorage(MtpStorageID id, const char* filePath,
 		MTPE("Failed to init inMutex\n");
 		use_mutex = false;
 	}
-	
+	pthread_mutex_init(&prefetchMutex, NULL);
+	pthread_cond_init(&prefetchCond, NULL);
 }
 
 MtpStorage::~MtpStorage() {
+	if (prefetch_thread) {
+		pthread_mutex_lock(&prefetchMutex);
+		prefetchStop = true;
+		pthread_cond_signal(&prefetchCond);
+		pthread_mutex_unlock(&prefetchMutex);
+		pthread_join(prefetch_thread, NULL);
+	}
+	pthread_cond_destroy(&prefetchCond);
+	pthread_mutex_destroy(&prefetchMutex);
 	if (inotify_thread) {
 		// TODO: what does this do? manpage says it does not kill the thread
 		pthread_kill(inotify_thread, 0);
@@ -125,16 +233,27 @@ int MtpStorage::createDB() {
 	mtpstorageparent = getPath();
 	// root directory is special: handle 0, parent 0, and empty path
 	mtpmap[0] = new Tree(0, 0, "");
+	bool restored = loadDB();
 	MTPD("MtpStorage::createDB DONE\n");
 	if (use_mutex) {
 		MTPD("Starting inotify thread\n");
 		sendEvents = true;
 		inotify_thread = inotify();
+		if (pthread_create(&prefetch_thread, NULL, prefetch_thread_start, this) != 0) {
+			MTPE("Failed to start prefetch thread\n");
+			prefetch_thread = 0;
+		}
 	} else {
 		MTPD("NOT starting inotify thread\n");
 	}
-	// for debugging and caching purposes, read the root dir already now
-	readDir(mtpstorageparent, mtpmap[0]);
+	if (restored) {
+		// dirs from the snapshot are checked against the filesystem when the host opens them
+		MTPI("restored object database for '%s'\n", mtpstorageparent.c_str());
+	} else {
+		// for debugging and caching purposes, read the root dir already now
+		if (readDir(mtpstorageparent, mtpmap[0]) == 0)
+			queuePrefetch(mtpmap[0]);
+	}
 	// all other dirs are read on demand
 	return 0;
 }
@@ -159,7 +278,11 @@ MtpObjectHandleList* MtpStorage::getObjectList(MtpStorageID storageID, MtpObject
 		std::string path = getNodePath(tree);
 		MTPD("reading directory on demand for tree %p (%u), path: %s\n", tree, tree->Mtpid(), path.c_str());
 		readDir(path, tree);
+	} else if (tree->wasRestored()) {
+		revalidateDir(tree);
 	}
+	// also when the dir was read before, e.g. by the prefetcher, so it keeps one level ahead of the host
+	queuePrefetch(tree);
 
 	mtpmap[parent]->getmtpids(list);
 	MTPD("returning %u objects in %s.\n", list->size(), tree->getName().c_str());
@@ -238,8 +361,16 @@ void MtpStorage::endSendObject(const char* path, MtpObjectHandle handle, MtpObje
 	if (!node)
 		return;	// just ignore if this is for another storage
 
+	if (!succeeded) {
+		// the file was removed again, so drop the handle reserved by beginSendObject
+		MTPD("endSendObject: transfer of handle %u failed, removing node\n", handle);
+		handleCurrentlySending = 0;
+		deleteFile(handle);
+		return;
+	}
 	node->addProperties(path, mStorageID);
 	handleCurrentlySending = 0;
+	markDBDirty();
 	// TODO: are we supposed to send an event about an upload by the initiator?
 	if (sendEvents)
 		mServer->sendObjectAdded(node->Mtpid());
@@ -265,46 +396,260 @@ int MtpStorage::getObjectFilePath(MtpObjectHandle handle, MtpString& outFilePath
 	return 0;
 }
 
-int MtpStorage::readDir(const std::string& path, Tree* tree)
+int MtpStorage::scanDir(const std::string& path, std::vector<DirEntry>& entries, struct stat& dirst)
 {
 	struct dirent *de;
-	int storageID = getStorageID();
-	MtpObjectHandle parent = tree->Mtpid();
 
 	DIR *d = opendir(path.c_str());
-	MTPD("reading dir '%s', parent handle %u\n", path.c_str(), parent);
+	MTPD("scanning dir '%s'\n", path.c_str());
 	if (d == NULL) {
 		MTPE("error opening '%s' -- error: %s\n", path.c_str(), strerror(errno));
 		return -1;
 	}
-	// TODO: for refreshing dirs: capture old entries here
 	while ((de = readdir(d)) != NULL) {
-		// Because exfat-fuse causes issues with dirent, we will use stat
-		// for some things that dirent should be able to do
-		std::string item = path + "/" + de->d_name;
-		struct stat st;
-		if (lstat(item.c_str(), &st)) {
-			MTPE("Error running lstat on '%s'\n", item.c_str());
-			return -1;
-		}
-		// TODO: if we want to use this for refreshing dirs too, first find existing name and overwrite
 		if (strcmp(de->d_name, ".") == 0)
 			continue;
 		if (strcmp(de->d_name, "..") == 0)
 			continue;
-		Node* node = addNewNode(st.st_mode & S_IFDIR, tree, de->d_name);
-		node->addProperties(item, storageID);
+		DirEntry e;
+		e.name = de->d_name;
+		e.valid = false;
+		entries.push_back(e);
+	}
+
+	// stat relative to the directory fd so the kernel does not resolve the full path for every entry
+	int dfd = dirfd(d);
+	if (fstat(dfd, &dirst))
+		memset(&dirst, 0, sizeof(dirst));
+	size_t count = entries.size();
+	if (count > PARALLEL_STAT_THRESHOLD) {
+		StatJob jobs[STAT_THREADS];
+		pthread_t threads[STAT_THREADS];
+		bool started[STAT_THREADS];
+		size_t chunk = (count + STAT_THREADS - 1) / STAT_THREADS;
+		for (int t = 0; t < STAT_THREADS; t++) {
+			jobs[t].dfd = dfd;
+			jobs[t].entries = &entries;
+			jobs[t].start = t * chunk < count ? t * chunk : count;
+			jobs[t].end = jobs[t].start + chunk < count ? jobs[t].start + chunk : count;
+			started[t] = pthread_create(&threads[t], NULL, statEntries, &jobs[t]) == 0;
+			if (!started[t])
+				statEntries(&jobs[t]);
+		}
+		for (int t = 0; t < STAT_THREADS; t++) {
+			if (started[t])
+				pthread_join(threads[t], NULL);
+		}
+	} else {
+		StatJob job;
+		job.dfd = dfd;
+		job.entries = &entries;
+		job.start = 0;
+		job.end = count;
+		statEntries(&job);
+	}
+	closedir(d);
+	return 0;
+}
+
+void MtpStorage::populateTree(Tree* tree, const std::vector<DirEntry>& entries, const struct stat& dirst)
+{
+	int storageID = getStorageID();
+	MTPD("populating tree %p (%u) with %u entries\n", tree, tree->Mtpid(), entries.size());
+
+	// entries restored from the object database keep their handles if they still exist
+	std::map<std::string, Node*> existing;
+	MtpObjectHandleList list;
+	tree->getmtpids(&list);
+	for (MtpObjectHandleList::iterator it = list.begin(); it != list.end(); ++it) {
+		Node* node = tree->findNode(*it);
+		if (node)
+			existing[node->getName()] = node;
+	}
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		const DirEntry& e = entries[i];
+		if (!e.valid) {
+			// the entry probably disappeared between readdir and stat
+			MTPE("Error running lstat on '%s'\n", e.name.c_str());
+			continue;
+		}
+		std::map<std::string, Node*>::iterator found = existing.find(e.name);
+		if (found != existing.end() && found->second->isDir() == S_ISDIR(e.st.st_mode)) {
+			found->second->updateProperty(MTP_PROPERTY_OBJECT_SIZE, e.st.st_size, "", MTP_TYPE_UINT64);
+			found->second->updateProperty(MTP_PROPERTY_DATE_MODIFIED, e.st.st_mtime, "", MTP_TYPE_UINT64);
+			existing.erase(found);
+			continue;
+		}
+		Node* node = addNewNode(S_ISDIR(e.st.st_mode), tree, e.name);
+		node->addProperties(e.st, storageID);
 		//if (sendEvents)
 		//	mServer->sendObjectAdded(node->Mtpid());
 		//	sending events here makes simple-mtpfs very slow, and it is probably the wrong thing to do anyway
 	}
-	closedir(d);
-	// TODO: for refreshing dirs: remove entries that no longer exist (with their nodes)
+
+	// whatever is left over no longer exists on disk
+	for (std::map<std::string, Node*>::iterator it = existing.begin(); it != existing.end(); ++it) {
+		MtpObjectHandle handle = it->second->Mtpid();
+		MTPD("removing stale entry '%s', handle %u\n", it->first.c_str(), handle);
+		if (it->second->isDir())
+			forgetTree(static_cast<Tree*>(it->second));
+		tree->deleteNode(handle);
+	}
+
 	tree->setAlreadyRead(true);
+	tree->setRestored(false);
+	// a dir changed within the last second could change again without a new mtime,
+	// so it is not trusted from the snapshot and gets read again after a restart
+	tree->setDirStat(dirst.st_ino, dirst.st_mtime < time(NULL) - 1 ? dirst.st_mtime : 0);
 	addInotify(tree);
+	markDBDirty();
+}
+
+// Removes a tree and all trees below it from mtpmap and inotify, before the
+// nodes themselves are deleted by the parent tree.
+void MtpStorage::forgetTree(Tree* tree)
+{
+	MtpObjectHandleList list;
+	tree->getmtpids(&list);
+	for (MtpObjectHandleList::iterator it = list.begin(); it != list.end(); ++it) {
+		Node* node = tree->findNode(*it);
+		if (node && node->isDir())
+			forgetTree(static_cast<Tree*>(node));
+	}
+	for (std::map<int, Tree*>::iterator it = inotifymap.begin(); it != inotifymap.end(); ++it) {
+		if (it->second == tree) {
+			inotify_rm_watch(inotify_fd, it->first);
+			inotifymap.erase(it);
+			break;
+		}
+	}
+	mtpmap.erase(tree->Mtpid());
+}
+
+int MtpStorage::readDir(const std::string& path, Tree* tree)
+{
+	std::vector<DirEntry> entries;
+	struct stat dirst;
+	MTPD("reading dir '%s', parent handle %u\n", path.c_str(), tree->Mtpid());
+	if (scanDir(path, entries, dirst))
+		return -1;
+	populateTree(tree, entries, dirst);
 	return 0;
 }
 
+void MtpStorage::revalidateDir(Tree* tree)
+{
+	std::string path = getNodePath(tree);
+	struct stat st;
+	tree->setRestored(false);
+	if (lstat(path.c_str(), &st) == 0 && (uint64_t)st.st_ino == tree->getDirInode()
+			&& (uint64_t)st.st_mtime == tree->getDirMtime()) {
+		MTPD("restored dir '%s' is unchanged\n", path.c_str());
+		// files rewritten in place do not change the dir, so their sizes and dates are checked again
+		int dirfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dirfd >= 0) {
+			MtpObjectHandleList list;
+			tree->getmtpids(&list);
+			for (MtpObjectHandleList::iterator it = list.begin(); it != list.end(); ++it) {
+				Node* node = tree->findNode(*it);
+				struct stat fst;
+				if (!node || node->isDir() || fstatat(dirfd, node->getName().c_str(), &fst, AT_SYMLINK_NOFOLLOW) != 0)
+					continue;
+				if (node->getIntProperty(MTP_PROPERTY_OBJECT_SIZE) != (uint64_t)fst.st_size
+						|| node->getIntProperty(MTP_PROPERTY_DATE_MODIFIED) != (uint64_t)fst.st_mtime) {
+					node->updateProperty(MTP_PROPERTY_OBJECT_SIZE, fst.st_size, "", MTP_TYPE_UINT64);
+					node->updateProperty(MTP_PROPERTY_DATE_MODIFIED, fst.st_mtime, "", MTP_TYPE_UINT64);
+					markDBDirty();
+				}
+			}
+			close(dirfd);
+		}
+		addInotify(tree);
+		return;
+	}
+	MTPD("restored dir '%s' has changed, reading it again\n", path.c_str());
+	readDir(path, tree);
+}
+
+void MtpStorage::queuePrefetch(Tree* tree)
+{
+	if (!prefetch_thread)
+		return;
+	MtpObjectHandleList list;
+	tree->getmtpids(&list);
+	int queued = 0;
+	pthread_mutex_lock(&prefetchMutex);
+	for (MtpObjectHandleList::iterator it = list.begin(); it != list.end() && queued < MAX_PREFETCH_DIRS; ++it) {
+		Node* node = tree->findNode(*it);
+		// a dir listed again before the prefetcher got to it is queued only once
+		if (node && node->isDir() && !static_cast<Tree*>(node)->wasAlreadyRead()
+				&& std::find(prefetchQueue.begin(), prefetchQueue.end(), *it) == prefetchQueue.end()) {
+			prefetchQueue.push_back(*it);
+			queued++;
+		}
+	}
+	if (queued)
+		pthread_cond_signal(&prefetchCond);
+	pthread_mutex_unlock(&prefetchMutex);
+}
+
+void* MtpStorage::prefetch_thread_start(void* cookie)
+{
+	((MtpStorage*) cookie)->prefetch_t();
+	return NULL;
+}
+
+void MtpStorage::prefetch_t()
+{
+	time_t lastSave = time(NULL);
+	pthread_mutex_lock(&prefetchMutex);
+	while (!prefetchStop) {
+		// this thread also writes the object database, at most every few seconds
+		if (dbDirty && time(NULL) - lastSave >= MTP_DB_SAVE_INTERVAL) {
+			pthread_mutex_unlock(&prefetchMutex);
+			saveDB();
+			lastSave = time(NULL);
+			pthread_mutex_lock(&prefetchMutex);
+			continue;
+		}
+		if (prefetchQueue.empty()) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += MTP_DB_SAVE_INTERVAL;
+			pthread_cond_timedwait(&prefetchCond, &prefetchMutex, &ts);
+			continue;
+		}
+		MtpObjectHandle handle = prefetchQueue.front();
+		prefetchQueue.pop_front();
+		pthread_mutex_unlock(&prefetchMutex);
+
+		std::string path;
+		lockMutex(1);
+		iter it = mtpmap.find(handle);
+		bool needed = it != mtpmap.end() && !it->second->wasAlreadyRead();
+		if (needed)
+			path = getNodePath(it->second);
+		unlockMutex(1);
+
+		// the slow part runs without the storage lock, so requests from the host are not blocked
+		std::vector<DirEntry> entries;
+		struct stat dirst;
+		if (needed && scanDir(path, entries, dirst) == 0) {
+			lockMutex(1);
+			it = mtpmap.find(handle);
+			// the host may have opened, deleted or renamed the dir in the meantime
+			if (it != mtpmap.end() && !it->second->wasAlreadyRead() && getNodePath(it->second) == path) {
+				MTPD("prefetched dir '%s', handle %u\n", path.c_str(), handle);
+				populateTree(it->second, entries, dirst);
+			}
+			unlockMutex(1);
+		}
+		pthread_mutex_lock(&prefetchMutex);
+	}
+	pthread_mutex_unlock(&prefetchMutex);
+}
+
 int MtpStorage::deleteFile(MtpObjectHandle handle) {
 	MTPD("MtpStorage::deleteFile handle: %u\n", handle);
 	Node* node = findNode(handle);
@@ -325,6 +670,7 @@ int MtpStorage::deleteFile(MtpObjectHandle handle) {
 
 	MTPD("deleting handle: %u\n", handle);
 	tree->deleteNode(handle);
+	markDBDirty();
 	MTPD("deleted\n");
 	return 0;
 }
@@ -523,6 +869,7 @@ int MtpStorage::renameObject(MtpObjectHandle handle, std::string newName) {
 				MTPD("old: '%s', new: '%s'\n", oldName.c_str(), newFullName.c_str());
 				if (rename(oldName.c_str(), newFullName.c_str()) == 0) {
 					node->rename(newName);
+					markDBDirty();
 					return 0;
 				} else {
 					MTPE("MtpStorage::renameObject failed, handle: %u, new name: '%s'\n", handle, newName.c_str());
@@ -644,6 +991,7 @@ void MtpStorage::handleInotifyEvent(struct inotify_event* event)
 			if (orig_size != new_size) {
 				MTPD("size changed from %llu to %llu on mtpid: %u\n", orig_size, new_size, node->Mtpid());
 				node->updateProperty(MTP_PROPERTY_OBJECT_SIZE, new_size, "", MTP_TYPE_UINT64);
+				markDBDirty();
 				mServer->sendObjectUpdated(node->Mtpid());
 			}
 		} else {
@@ -669,6 +1017,7 @@ int MtpStorage::inotify_t(void) {
 
 	while (true) {
 		int i = 0;
+		uint32_t events = 0;
 		int len = read(inotify_fd, buf, EVENT_BUF_LEN);
 
 		if (len < 0) {
@@ -686,7 +1035,10 @@ int MtpStorage::inotify_t(void) {
 				unlockMutex(1);
 			}
 			i += EVENT_SIZE + event->len;
+			events++;
 		}
+		if (events)
+			MtpStats::addInotifyBatch(events);
 	}
 
 	for (std::map<int, Tree*>::iterator i = inotifymap.begin(); i != inotifymap.end(); i++) {
@@ -739,10 +1091,8 @@ Node* MtpStorage::findNodeByPath(const std::string& path) {
 
 Node* MtpStorage::addNewNode(bool isDir, Tree* tree, const std::string& name)
 {
-	// global counter for new object handles
-	static MtpObjectHandle mtpid = 0;
-
-	++mtpid;
+	// prefetch threads of several storages may allocate handles at the same time
+	MtpObjectHandle mtpid = __sync_add_and_fetch(&lastHandle, 1);
 	MTPD("adding new %s node for %s, new handle: %u\n", isDir ? "dir" : "file", name.c_str(), mtpid);
 	MtpObjectHandle parent = tree->Mtpid();
 	MTPD("parent tree: %x, handle: %u, name: %s\n", tree, parent, tree->getName().c_str());
@@ -752,6 +1102,7 @@ Node* MtpStorage::addNewNode(bool isDir, Tree* tree, const std::string& name)
 	else
 		node = new Node(mtpid, parent, name);
 	tree->addEntry(node);
+	markDBDirty();
 	return node;
 }
 
@@ -791,6 +1142,7 @@ std::string MtpStorage::getNodePath(Node* node) {
 void MtpStorage::lockMutex(int thread_type) {
 	if (!use_mutex)
 		return; // mutex is disabled
+	uint64_t start = MtpStats::now();
 	if (thread_type) {
 		// inotify thread
 		pthread_mutex_lock(&inMutex);
@@ -808,6 +1160,7 @@ void MtpStorage::lockMutex(int thread_type) {
 			pthread_mutex_lock(&mtpMutex);
 		}
 	}
+	MtpStats::addLockWait(MtpStats::now() - start);
 }
 
 void MtpStorage::unlockMutex(int thread_type) {
@@ -816,3 +1169,185 @@ void MtpStorage::unlockMutex(int thread_type) {
 	pthread_mutex_unlock(&inMutex);
 	pthread_mutex_unlock(&mtpMutex);
 }
+
+std::string MtpStorage::getDBPath() {
+	char name[64];
+	snprintf(name, sizeof(name), "/storage_%08x.db", mStorageID);
+	return std::string(MTP_DB_DIR) + name;
+}
+
+void MtpStorage::serializeTree(std::string& buf, Tree* tree) {
+	MtpObjectHandleList list;
+	tree->getmtpids(&list);
+	for (MtpObjectHandleList::iterator it = list.begin(); it != list.end(); ++it) {
+		Node* node = tree->findNode(*it);
+		if (!node || node->Mtpid() == handleCurrentlySending)
+			continue;
+		uint8_t flags = 0;
+		Tree* subtree = NULL;
+		if (node->isDir()) {
+			subtree = static_cast<Tree*>(node);
+			flags |= MTP_DB_FLAG_DIR;
+			if (subtree->wasAlreadyRead())
+				flags |= MTP_DB_FLAG_READ;
+		}
+		putValue<uint32_t>(buf, node->Mtpid());
+		putValue<uint32_t>(buf, node->getMtpParentId());
+		putValue<uint8_t>(buf, flags);
+		putValue<uint64_t>(buf, node->getProperty(MTP_PROPERTY_OBJECT_SIZE).valueInt);
+		putValue<uint64_t>(buf, node->getProperty(MTP_PROPERTY_DATE_MODIFIED).valueInt);
+		putString(buf, node->getName());
+		if (flags & MTP_DB_FLAG_READ) {
+			putValue<uint64_t>(buf, subtree->getDirInode());
+			putValue<uint64_t>(buf, subtree->getDirMtime());
+		}
+		// parents are always written before their children
+		if (subtree)
+			serializeTree(buf, subtree);
+	}
+}
+
+// dbDirty is set by the MTP, inotify and prefetch threads, also while the storage mutex is disabled
+void MtpStorage::markDBDirty() {
+	__sync_lock_test_and_set(&dbDirty, 1);
+}
+
+void MtpStorage::saveDB() {
+	std::string buf;
+	lockMutex(1);
+	if (!__sync_bool_compare_and_swap(&dbDirty, 1, 0)) {
+		unlockMutex(1);
+		return;
+	}
+	if (dbRunId == 0)
+		dbRunId = ((uint64_t)time(NULL) << 32) | (uint32_t)getpid();
+	Tree* root = mtpmap[0];
+	buf.append(MTP_DB_MAGIC, strlen(MTP_DB_MAGIC));
+	putValue<uint64_t>(buf, dbRunId);
+	putValue<uint32_t>(buf, lastHandle);
+	putValue<uint32_t>(buf, mStorageID);
+	putString(buf, mtpstorageparent);
+	putValue<uint8_t>(buf, root->wasAlreadyRead() ? MTP_DB_FLAG_READ : 0);
+	putValue<uint64_t>(buf, root->getDirInode());
+	putValue<uint64_t>(buf, root->getDirMtime());
+	serializeTree(buf, root);
+	unlockMutex(1);
+
+	// write to a temp file and rename, so a killed MTP process never leaves a torn snapshot
+	std::string dbPath = getDBPath();
+	std::string tmpPath = dbPath + ".tmp";
+	mkdir(MTP_DB_DIR, 0700);
+	FILE* fp = fopen(tmpPath.c_str(), "wb");
+	if (!fp) {
+		MTPE("Unable to open '%s' for writing: %s\n", tmpPath.c_str(), strerror(errno));
+		return;
+	}
+	bool ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+	ok = fclose(fp) == 0 && ok;
+	if (!ok || rename(tmpPath.c_str(), dbPath.c_str()) != 0) {
+		MTPE("Unable to write object database '%s'\n", dbPath.c_str());
+		unlink(tmpPath.c_str());
+		return;
+	}
+	MTPD("saved object database '%s', %u bytes\n", dbPath.c_str(), buf.size());
+}
+
+bool MtpStorage::loadDB() {
+	std::string dbPath = getDBPath();
+	FILE* fp = fopen(dbPath.c_str(), "rb");
+	if (!fp)
+		return false;
+	std::string buf;
+	char chunk[65536];
+	size_t len;
+	while ((len = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+		buf.append(chunk, len);
+	fclose(fp);
+
+	if (buf.compare(0, strlen(MTP_DB_MAGIC), MTP_DB_MAGIC) != 0) {
+		MTPE("'%s' is not an object database\n", dbPath.c_str());
+		return false;
+	}
+	buf.erase(0, strlen(MTP_DB_MAGIC));
+	DBReader reader(buf);
+	uint64_t runId = reader.get<uint64_t>();
+	MtpObjectHandle savedLastHandle = reader.get<uint32_t>();
+	MtpStorageID storageID = reader.get<uint32_t>();
+	std::string storagePath = reader.getString();
+	uint8_t rootFlags = reader.get<uint8_t>();
+	uint64_t rootInode = reader.get<uint64_t>();
+	uint64_t rootMtime = reader.get<uint64_t>();
+	if (!reader.ok || storageID != mStorageID || storagePath != mtpstorageparent) {
+		MTPD("object database '%s' does not match this storage\n", dbPath.c_str());
+		return false;
+	}
+	if (runId != dbRunId && !(dbRunId == 0 && lastHandle == 0)) {
+		// handles from another run could collide with handles already handed out
+		MTPD("object database '%s' is from another run, ignoring\n", dbPath.c_str());
+		return false;
+	}
+
+	std::vector<DBRecord> records;
+	std::set<MtpObjectHandle> dirs;
+	std::set<MtpObjectHandle> handles;
+	dirs.insert(0);
+	while (reader.ok && !reader.atEnd()) {
+		DBRecord r;
+		r.handle = reader.get<uint32_t>();
+		r.parent = reader.get<uint32_t>();
+		r.flags = reader.get<uint8_t>();
+		r.size = reader.get<uint64_t>();
+		r.mtime = reader.get<uint64_t>();
+		r.name = reader.getString();
+		r.dirInode = r.dirMtime = 0;
+		if (r.flags & MTP_DB_FLAG_READ) {
+			r.dirInode = reader.get<uint64_t>();
+			r.dirMtime = reader.get<uint64_t>();
+		}
+		if (!reader.ok || r.handle == 0 || r.handle > savedLastHandle
+				|| dirs.find(r.parent) == dirs.end() || !handles.insert(r.handle).second) {
+			MTPE("object database '%s' is corrupt\n", dbPath.c_str());
+			return false;
+		}
+		if (r.flags & MTP_DB_FLAG_DIR)
+			dirs.insert(r.handle);
+		records.push_back(r);
+	}
+
+	Tree* root = mtpmap[0];
+	if (rootFlags & MTP_DB_FLAG_READ) {
+		root->setAlreadyRead(true);
+		root->setRestored(true);
+		root->setDirStat(rootInode, rootMtime);
+	}
+	for (size_t i = 0; i < records.size(); i++) {
+		const DBRecord& r = records[i];
+		Node* node;
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		st.st_size = r.size;
+		st.st_mtime = r.mtime;
+		if (r.flags & MTP_DB_FLAG_DIR) {
+			Tree* tree = new Tree(r.handle, r.parent, r.name);
+			if (r.flags & MTP_DB_FLAG_READ) {
+				tree->setAlreadyRead(true);
+				tree->setRestored(true);
+				tree->setDirStat(r.dirInode, r.dirMtime);
+			}
+			mtpmap[r.handle] = tree;
+			node = tree;
+			st.st_mode = S_IFDIR;
+		} else {
+			node = new Node(r.handle, r.parent, r.name);
+			st.st_mode = S_IFREG;
+		}
+		node->addProperties(st, mStorageID);
+		mtpmap[r.parent]->addEntry(node);
+	}
+
+	dbRunId = runId;
+	if (savedLastHandle > lastHandle)
+		lastHandle = savedLastHandle;
+	MTPD("loaded %u objects from '%s'\n", records.size(), dbPath.c_str());
+	return rootFlags & MTP_DB_FLAG_READ;
+}
@@ -24,8 +24,10 @@
 #include <string>
 #include <deque>
 #include <map>
+#include <vector>
 #include <libgen.h>
 #include <pthread.h>
+#include <sys/stat.h>
 #include "btree.hpp"
 #include "MtpServer.h"
 
@@ -75,6 +77,13 @@ public:
 		std::string strvalue;
 	};
 
+	// result of scanning one directory entry, filled without holding the storage lock
+	struct DirEntry {
+		std::string name;
+		struct stat st;
+		bool valid;
+	};
+
 	int readDir(const std::string& path, Tree* tree);
 	int createDB();
 	MtpObjectHandleList* getObjectList(MtpStorageID storageID, MtpObjectHandle parent);
@@ -103,6 +112,29 @@ private:
 	bool sendEvents;
 	MtpObjectHandle handleCurrentlySending;
 
+	int scanDir(const std::string& path, std::vector<DirEntry>& entries, struct stat& dirst);
+	void populateTree(Tree* tree, const std::vector<DirEntry>& entries, const struct stat& dirst);
+	void forgetTree(Tree* tree);
+
+	// background reading of subdirectories the host is likely to open next
+	static void* prefetch_thread_start(void* cookie);
+	void prefetch_t();
+	void queuePrefetch(Tree* tree);
+	pthread_t prefetch_thread;
+	pthread_mutex_t prefetchMutex;
+	pthread_cond_t prefetchCond;
+	std::deque<MtpObjectHandle> prefetchQueue;
+	bool prefetchStop;
+
+	// snapshot of the object tree in tmpfs, so handles survive restarting MTP
+	volatile int dbDirty;
+	void markDBDirty();
+	std::string getDBPath();
+	bool loadDB();
+	void saveDB();
+	void serializeTree(std::string& buf, Tree* tree);
+	void revalidateDir(Tree* tree);
+
 	Node* addNewNode(bool isDir, Tree* tree, const std::string& name);
 	Node* findNode(MtpObjectHandle handle);
 	Node* findNodeByPath(const std::string& path);
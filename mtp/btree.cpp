@@ -21,7 +21,7 @@
 
 // Constructor
 Tree::Tree(MtpObjectHandle handle, MtpObjectHandle parent, const std::string& name)
-	: Node(handle, parent, name), alreadyRead(false) {
+	: Node(handle, parent, name), alreadyRead(false), restored(false), dirInode(0), dirMtime(0) {
 }
 
 // Destructor
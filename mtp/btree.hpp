@@ -19,6 +19,7 @@
 
 #include <vector>
 #include <map>
+#include <sys/stat.h>
 #include "MtpTypes.h"
 
 // A directory entry
@@ -42,6 +43,7 @@ public:
 	void addProperty(MtpPropertyCode property, uint64_t valueInt, std::string valueStr, MtpDataType dataType);
 	void updateProperty(MtpPropertyCode property, uint64_t valueInt, std::string valueStr, MtpDataType dataType);
 	void addProperties(const std::string& path, int storageID);
+	void addProperties(const struct stat& st, int storageID);
 	uint64_t getIntProperty(MtpPropertyCode property);
 	struct mtpProperty {
 		MtpPropertyCode property;
@@ -59,6 +61,9 @@ public:
 class Tree : public Node {
 	std::map<MtpObjectHandle, Node*> entries;
 	bool alreadyRead;
+	bool restored;	// entries were loaded from the object database and not yet checked
+	uint64_t dirInode;	// identity and mtime of the directory when it was read
+	uint64_t dirMtime;
 public:
 	Tree(MtpObjectHandle handle, MtpObjectHandle parent, const std::string& name);
 	~Tree();
@@ -76,6 +81,11 @@ public:
 	int getCount();
 	bool wasAlreadyRead() const { return alreadyRead; }
 	void setAlreadyRead(bool b) { alreadyRead = b; }
+	bool wasRestored() const { return restored; }
+	void setRestored(bool b) { restored = b; }
+	uint64_t getDirInode() const { return dirInode; }
+	uint64_t getDirMtime() const { return dirMtime; }
+	void setDirStat(uint64_t inode, uint64_t mtime) { dirInode = inode; dirMtime = mtime; }
 };
 
 #endif
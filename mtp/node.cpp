@@ -100,8 +100,18 @@ std::vector<Node::mtpProperty>& Node::getMtpProps() {
 }
 
 void Node::addProperties(const std::string& path, int storageID) {
-	MTPD("addProperties: handle: %u, filename: '%s'\n", handle, getName().c_str());
 	struct stat st;
+	if (lstat(path.c_str(), &st) != 0)
+		memset(&st, 0, sizeof(st));
+	addProperties(st, storageID);
+}
+
+// Adds the properties from an already known stat result, so that callers
+// which have just read the directory do not need to lstat each entry again.
+void Node::addProperties(const struct stat& st, int storageID) {
+	MTPD("addProperties: handle: %u, filename: '%s'\n", handle, getName().c_str());
+	// called again after an upload or edit finished, so start over instead of adding duplicates
+	mtpProp.clear();
 	int mFormat = 0;
 	uint64_t puid;
 	off_t file_size = 0;
@@ -111,11 +121,9 @@ void Node::addProperties(const std::string& path, int storageID) {
 	std::string puidStr = storageIDStr + mtpidStr;
 	if ( ! (std::istringstream(puidStr) >> puid) ) puid = 0;
 	mFormat = MTP_FORMAT_UNDEFINED;   // file
-	if (lstat(path.c_str(), &st) == 0) {
-		file_size = st.st_size;
-		if (S_ISDIR(st.st_mode))
-			mFormat = MTP_FORMAT_ASSOCIATION; // folder
-	}
+	file_size = st.st_size;
+	if (S_ISDIR(st.st_mode))
+		mFormat = MTP_FORMAT_ASSOCIATION; // folder
 
 	// TODO: don't store properties with constant values at all, add them at query time instead
 	addProperty(MTP_PROPERTY_STORAGE_ID, storageID, "", MTP_TYPE_UINT32);
@@ -22,6 +22,10 @@
 #include <sys/stat.h>
 #include <sys/vfs.h>
 #include <sys/mount.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <iostream>
@@ -40,6 +44,8 @@
 #include "twrpDigest.hpp"
 #include "twrpTar.hpp"
 #include "twrpDU.hpp"
+#include "twrpImage.hpp"
+#include "twrpWipe.hpp"
 #include "fixPermissions.hpp"
 #include "infomanager.hpp"
 extern "C" {
@@ -113,6 +119,7 @@ TWPartition::TWPartition() {
 	Can_Be_Wiped = false;
 	Can_Be_Backed_Up = false;
 	Use_Rm_Rf = false;
+	Use_Block_Backup = false;
 	Wipe_During_Factory_Reset = false;
 	Wipe_Available_in_GUI = false;
 	Is_SubPartition = false;
@@ -143,6 +150,7 @@ TWPartition::TWPartition() {
 	Backup_FileName = "";
 	MTD_Name = "";
 	Backup_Method = NONE;
+	Backup_Has_MD5 = false;
 	Can_Encrypt_Backup = false;
 	Use_Userdata_Encryption = false;
 	Has_Data_Media = false;
@@ -493,6 +501,8 @@ bool TWPartition::Process_Flags(string Flags, bool Display_Error) {
 			Can_Be_Wiped = true;
 		} else if (strcmp(ptr, "usermrf") == 0) {
 			Use_Rm_Rf = true;
+		} else if (strcmp(ptr, "blockbackup") == 0) {
+			Use_Block_Backup = true;
 		} else if (ptr_len > 7 && strncmp(ptr, "backup=", 7) == 0) {
 			ptr += 7;
 			if (*ptr == '1' || *ptr == 'y' || *ptr == 'Y')
@@ -638,7 +648,10 @@ void TWPartition::Setup_File_System(bool Display_Error) {
 	Make_Dir(Mount_Point, Display_Error);
 	Display_Name = Mount_Point.substr(1, Mount_Point.size() - 1);
 	Backup_Name = Display_Name;
-	Backup_Method = FILES;
+	if (Use_Block_Backup)
+		Backup_Method = USED_BLOCKS;
+	else
+		Backup_Method = FILES;
 }
 
 void TWPartition::Setup_Image(bool Display_Error) {
@@ -802,53 +815,20 @@ bool TWPartition::Get_Size_Via_statfs(bool Display_Error) {
 }
 
 bool TWPartition::Get_Size_Via_df(bool Display_Error) {
-	FILE* fp;
-	char command[255], line[512];
-	int include_block = 1;
-	unsigned int min_len;
+	struct statfs st;
 
 	if (!Mount(Display_Error))
 		return false;
 
-	min_len = Actual_Block_Device.size() + 2;
-	sprintf(command, "df %s > /tmp/dfoutput.txt", Mount_Point.c_str());
-	TWFunc::Exec_Cmd(command);
-	fp = fopen("/tmp/dfoutput.txt", "rt");
-	if (fp == NULL) {
-		LOGINFO("Unable to open /tmp/dfoutput.txt.\n");
+	// Same numbers as df, which statfs's the mount point and reports what non-root users can still use as free
+	if (statfs(Mount_Point.c_str(), &st) != 0) {
+		LOGINFO("Unable to statfs '%s': %s\n", Mount_Point.c_str(), strerror(errno));
 		return false;
 	}
-
-	while (fgets(line, sizeof(line), fp) != NULL)
-	{
-		unsigned long blocks, used, available;
-		char device[64];
-		char tmpString[64];
-
-		if (strncmp(line, "Filesystem", 10) == 0)
-			continue;
-		if (strlen(line) < min_len) {
-			include_block = 0;
-			continue;
-		}
-		if (include_block) {
-			sscanf(line, "%s %lu %lu %lu", device, &blocks, &used, &available);
-		} else {
-			// The device block string is so long that the df information is on the next line
-			int space_count = 0;
-			sprintf(tmpString, "/dev/block/%s", Actual_Block_Device.c_str());
-			while (tmpString[space_count] == 32)
-				space_count++;
-			sscanf(line + space_count, "%lu %lu %lu", &blocks, &used, &available);
-		}
-
-		// Adjust block size to byte size
-		Size = blocks * 1024ULL;
-		Used = used * 1024ULL;
-		Free = available * 1024ULL;
-		Backup_Size = Used;
-	}
-	fclose(fp);
+	Size = (unsigned long long)st.f_blocks * st.f_bsize;
+	Used = (unsigned long long)(st.f_blocks - st.f_bfree) * st.f_bsize;
+	Free = (unsigned long long)st.f_bavail * st.f_bsize;
+	Backup_Size = Used;
 	return true;
 }
 
@@ -1045,6 +1025,9 @@ bool TWPartition::Mount(bool Display_Error) {
 		string Command = "mount '" + Symlink_Path + "' '" + Symlink_Mount_Point + "'";
 		TWFunc::Exec_Cmd(Command);
 	}
+
+	// The settings file may live here, write what the background save had to skip
+	DataManager::FlushPending();
 	return true;
 }
 
@@ -1072,6 +1055,9 @@ bool TWPartition::UnMount(bool Display_Error) {
 		}
 #endif
 
+		// The settings file may live here, write what is still pending
+		DataManager::FlushPending();
+
 		if (!Symlink_Mount_Point.empty())
 			umount(Symlink_Mount_Point.c_str());
 
@@ -1100,6 +1086,9 @@ bool TWPartition::Wipe(string New_File_System) {
 		return false;
 	}
 
+	// A new file system can reuse inode numbers with the same times
+	du.clear_cache();
+
 	if (Mount_Point == "/cache")
 		Log_Offset = 0;
 
@@ -1198,6 +1187,8 @@ bool TWPartition::Wipe_AndSec(void) {
 	if (!Has_Android_Secure)
 		return false;
 
+	du.clear_cache();
+
 	if (!Mount(true))
 		return false;
 
@@ -1301,12 +1292,15 @@ bool TWPartition::Repair() {
 }
 
 bool TWPartition::Backup(string backup_folder, const unsigned long long *overall_size, const unsigned long long *other_backups_size) {
+	Backup_Has_MD5 = false;
 	if (Backup_Method == FILES)
 		return Backup_Tar(backup_folder, overall_size, other_backups_size);
 	else if (Backup_Method == DD)
-		return Backup_DD(backup_folder);
+		return Backup_DD(backup_folder, overall_size, other_backups_size);
 	else if (Backup_Method == FLASH_UTILS)
 		return Backup_Dump_Image(backup_folder);
+	else if (Backup_Method == USED_BLOCKS)
+		return Backup_Used_Blocks(backup_folder, overall_size, other_backups_size);
 	LOGERR("Unknown backup method for '%s'\n", Mount_Point.c_str());
 	return false;
 }
@@ -1364,6 +1358,9 @@ bool TWPartition::Check_MD5(string restore_folder) {
 bool TWPartition::Restore(string restore_folder, const unsigned long long *total_restore_size, unsigned long long *already_restored_size) {
 	string Restore_File_System;
 
+	// Restored folders get back the times they had when they were backed up
+	du.clear_cache();
+
 	TWFunc::GUI_Operation_Text(TW_RESTORE_TEXT, Display_Name, "Restoring");
 	LOGINFO("Restore filename is: %s\n", Backup_FileName.c_str());
 
@@ -1413,6 +1410,8 @@ string TWPartition::Backup_Method_By_Name() {
 		return "dd";
 	else if (Backup_Method == FLASH_UTILS)
 		return "flash_utils";
+	else if (Backup_Method == USED_BLOCKS)
+		return "used_blocks";
 	else
 		return "undefined";
 	return "ERROR!";
@@ -1430,6 +1429,8 @@ bool TWPartition::Wipe_Encryption() {
 	if (!UnMount(true))
 		return false;
 
+	du.clear_cache();
+
 	Has_Data_Media = false;
 	Decrypted_Block_Device = "";
 	Is_Decrypted = false;
@@ -1489,13 +1490,28 @@ bool TWPartition::Wipe_EXT23(string File_System) {
 	if (TWFunc::Path_Exists("/sbin/mke2fs")) {
 		string command;
 
+		bool zeroes;
+		timespec start, end;
+
 		gui_print("Formatting %s using mke2fs...\n", Display_Name.c_str());
+		clock_gettime(CLOCK_MONOTONIC, &start);
 		Find_Actual_Block_Device();
-		command = "mke2fs -t " + File_System + " -m 0 " + Actual_Block_Device;
+		command = "mke2fs -t " + File_System + " -m 0 ";
+		if (Discard_Block_Device(&zeroes)) {
+			// The kernel initializes the inode tables after mounting, the journal
+			// is only left as it is when the discard already zeroed it
+			command += "-E nodiscard,lazy_itable_init=1";
+			if (zeroes)
+				command += ",lazy_journal_init=1";
+			command += " ";
+		}
+		command += Actual_Block_Device;
 		LOGINFO("mke2fs command: %s\n", command.c_str());
 		if (TWFunc::Exec_Cmd(command) == 0) {
 			Current_File_System = File_System;
 			Recreate_AndSec_Folder();
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			LOGINFO("Formatted '%s' in %i ms\n", Mount_Point.c_str(), TWFunc::timespec_diff_ms(start, end));
 			gui_print("Done.\n");
 			return true;
 		} else {
@@ -1520,8 +1536,12 @@ bool TWPartition::Wipe_EXT4() {
 #if defined(HAVE_SELINUX) && defined(USE_EXT4)
 	int ret;
 	char *secontext = NULL;
+	bool zeroes;
+	timespec start, end;
 
 	gui_print("Formatting %s using make_ext4fs function.\n", Display_Name.c_str());
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	Discard_Block_Device(&zeroes);
 
 	if (!selinux_handle || selabel_lookup(selinux_handle, &secontext, Mount_Point.c_str(), S_IFDIR) < 0) {
 		LOGINFO("Cannot lookup security context for '%s'\n", Mount_Point.c_str());
@@ -1537,14 +1557,20 @@ bool TWPartition::Wipe_EXT4() {
 		PartitionManager.Mount_By_Path(sedir.c_str(), true);
 		rmdir(sedir.c_str());
 		mkdir(sedir.c_str(), S_IRWXU | S_IRWXG | S_IWGRP | S_IXGRP);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		LOGINFO("Formatted '%s' in %i ms\n", Mount_Point.c_str(), TWFunc::timespec_diff_ms(start, end));
 		return true;
 	}
 #else
 	if (TWFunc::Path_Exists("/sbin/make_ext4fs")) {
 		string Command;
+		bool zeroes;
+		timespec start, end;
 
 		gui_print("Formatting %s using make_ext4fs...\n", Display_Name.c_str());
+		clock_gettime(CLOCK_MONOTONIC, &start);
 		Find_Actual_Block_Device();
+		Discard_Block_Device(&zeroes);
 		Command = "make_ext4fs";
 		if (!Is_Decrypted && Length != 0) {
 			// Only use length if we're not decrypted
@@ -1561,6 +1587,8 @@ bool TWPartition::Wipe_EXT4() {
 		if (TWFunc::Exec_Cmd(Command) == 0) {
 			Current_File_System = "ext4";
 			Recreate_AndSec_Folder();
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			LOGINFO("Formatted '%s' in %i ms\n", Mount_Point.c_str(), TWFunc::timespec_diff_ms(start, end));
 			gui_print("Done.\n");
 			return true;
 		} else {
@@ -1573,6 +1601,53 @@ bool TWPartition::Wipe_EXT4() {
 	return false;
 }
 
+// Tells the storage that the blocks are unused, so the formatter does not
+// have to write the inode tables and the flash has free blocks to start with
+bool TWPartition::Discard_Block_Device(bool *Zeroes) {
+	int fast_format, fd;
+	uint64_t range[2], size;
+	timespec start, end;
+
+	*Zeroes = false;
+	DataManager::GetValue(TW_FAST_FORMAT_VAR, fast_format);
+	if (!fast_format)
+		return false;
+
+	fd = open(Actual_Block_Device.c_str(), O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		LOGINFO("Unable to open '%s' to discard it: %s\n", Actual_Block_Device.c_str(), strerror(errno));
+		return false;
+	}
+	if (ioctl(fd, BLKGETSIZE64, &size) != 0) {
+		LOGINFO("Unable to get the size of '%s': %s\n", Actual_Block_Device.c_str(), strerror(errno));
+		close(fd);
+		return false;
+	}
+	// Keep what is past the file system, like the crypto footer when Length is negative
+	if (!Is_Decrypted && Length < 0 && (uint64_t)(-(int64_t)Length) < size)
+		size -= (uint64_t)(-(int64_t)Length);
+	else if (!Is_Decrypted && Length > 0 && (uint64_t)Length < size)
+		size = (uint64_t)Length;
+
+	range[0] = 0;
+	range[1] = size;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (ioctl(fd, BLKDISCARD, range) != 0) {
+		LOGINFO("Unable to discard '%s': %s\n", Actual_Block_Device.c_str(), strerror(errno));
+		close(fd);
+		return false;
+	}
+#ifdef BLKDISCARDZEROES
+	unsigned int discard_zeroes = 0;
+	if (ioctl(fd, BLKDISCARDZEROES, &discard_zeroes) == 0)
+		*Zeroes = (discard_zeroes != 0);
+#endif
+	close(fd);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	LOGINFO("Discarded %llu bytes of '%s' in %i ms\n", (unsigned long long)size, Actual_Block_Device.c_str(), TWFunc::timespec_diff_ms(start, end));
+	return true;
+}
+
 bool TWPartition::Wipe_FAT() {
 	string command;
 
@@ -1675,11 +1750,18 @@ bool TWPartition::Wipe_F2FS() {
 		if (!UnMount(true))
 			return false;
 
+		bool zeroes;
+		timespec start, end;
+
 		gui_print("Formatting %s using mkfs.f2fs...\n", Display_Name.c_str());
+		clock_gettime(CLOCK_MONOTONIC, &start);
 		Find_Actual_Block_Device();
+		Discard_Block_Device(&zeroes);
 		command = "mkfs.f2fs " + Actual_Block_Device;
 		if (TWFunc::Exec_Cmd(command) == 0) {
 			Recreate_AndSec_Folder();
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			LOGINFO("Formatted '%s' in %i ms\n", Mount_Point.c_str(), TWFunc::timespec_diff_ms(start, end));
 			gui_print("Done.\n");
 			return true;
 		} else {
@@ -1699,7 +1781,6 @@ bool TWPartition::Wipe_Data_Without_Wiping_Media() {
 	// In an OEM Build we want to do a full format
 	return Wipe_Encryption();
 #else
-	string dir;
 	#ifdef HAVE_SELINUX
 	fixPermissions perms;
 	#endif
@@ -1710,34 +1791,18 @@ bool TWPartition::Wipe_Data_Without_Wiping_Media() {
 
 	gui_print("Wiping data without wiping /data/media ...\n");
 
-	DIR* d;
-	d = opendir("/data");
-	if (d != NULL) {
-		struct dirent* de;
-		while ((de = readdir(d)) != NULL) {
-			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)	 continue;
-			// The media folder is the "internal sdcard"
-			// The .layout_version file is responsible for determining whether 4.2 decides up upgrade
-			// the media folder for multi-user.
-			//TODO: convert this to use twrpDU.cpp
-			if (strcmp(de->d_name, "media") == 0 || strcmp(de->d_name, ".layout_version") == 0)   continue;
-
-			dir = "/data/";
-			dir.append(de->d_name);
-			if (de->d_type == DT_DIR) {
-				TWFunc::removeDir(dir, false);
-			} else if (de->d_type == DT_REG || de->d_type == DT_LNK || de->d_type == DT_FIFO || de->d_type == DT_SOCK) {
-				if (!unlink(dir.c_str()))
-					LOGINFO("Unable to unlink '%s'\n", dir.c_str());
-			}
-		}
-		closedir(d);
-
-		gui_print("Done.\n");
-		return true;
+	twrpWipe wipe;
+	// The media folder is the "internal sdcard"
+	// The .layout_version file is responsible for determining whether 4.2 decides up upgrade
+	// the media folder for multi-user.
+	wipe.add_skip("media");
+	wipe.add_skip(".layout_version");
+	if (wipe.removeDir("/data", true) != 0) {
+		gui_print("Unable to wipe everything in /data, error!\n");
+		return false;
 	}
-	gui_print("Dirent failed to open /data, error!\n");
-	return false;
+	gui_print("Done.\n");
+	return true;
 #endif // ifdef TW_OEM_BUILD
 }
 
@@ -1788,13 +1853,11 @@ bool TWPartition::Backup_Tar(string backup_folder, const unsigned long long *ove
 	return true;
 }
 
-bool TWPartition::Backup_DD(string backup_folder) {
-	char back_name[255], backup_size[32];
-	string Full_FileName, Command, DD_BS;
-	int use_compression;
-
-	sprintf(backup_size, "%llu", Backup_Size);
-	DD_BS = backup_size;
+bool TWPartition::Backup_DD(string backup_folder, const unsigned long long *overall_size, const unsigned long long *other_backups_size) {
+	char back_name[255];
+	string Full_FileName;
+	int skip_md5;
+	twrpImage image;
 
 	TWFunc::GUI_Operation_Text(TW_BACKUP_TEXT, Display_Name, "Backing Up");
 	gui_print("Backing up %s...\n", Display_Name.c_str());
@@ -1804,13 +1867,70 @@ bool TWPartition::Backup_DD(string backup_folder) {
 
 	Full_FileName = backup_folder + "/" + Backup_FileName;
 
-	Command = "dd if=" + Actual_Block_Device + " of='" + Full_FileName + "'" + " bs=" + DD_BS + "c count=1";
-	LOGINFO("Backup command: '%s'\n", Command.c_str());
-	TWFunc::Exec_Cmd(Command);
+	// The md5 is computed from the data as it is written, Backup_Partition does not read the image back
+	DataManager::GetValue(TW_SKIP_MD5_GENERATE_VAR, skip_md5);
+	image.setsource(Actual_Block_Device);
+	image.setdest(Full_FileName);
+	image.setsize(Backup_Size);
+	image.setmd5(skip_md5 == 0);
+	if (image.copyImage(overall_size, other_backups_size) != 0) {
+		LOGERR("Unable to back up '%s'\n", Display_Name.c_str());
+		return false;
+	}
 	if (TWFunc::Get_File_Size(Full_FileName) == 0) {
 		LOGERR("Backup file size for '%s' is 0 bytes.\n", Full_FileName.c_str());
 		return false;
 	}
+	Backup_Has_MD5 = (skip_md5 == 0);
+	return true;
+}
+
+// The image is named like an emmc backup so it is restored with Restore_DD,
+// the blocks that were not copied are holes in it and restore as zeros
+bool TWPartition::Backup_Used_Blocks(string backup_folder, const unsigned long long *overall_size, const unsigned long long *other_backups_size) {
+	char back_name[255];
+	string Full_FileName;
+	int skip_md5, use_encryption = 0;
+	twrpImage image;
+
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	DataManager::GetValue("tw_encrypt_backup", use_encryption);
+#endif
+	// Only tar can leave out media or encrypt the backup
+	if (Current_File_System != "ext4" || Has_Data_Media || (use_encryption && Can_Encrypt_Backup)) {
+		LOGINFO("Backing up '%s' with tar instead of as an image\n", Mount_Point.c_str());
+		return Backup_Tar(backup_folder, overall_size, other_backups_size);
+	}
+	// The image is as large as the file system, only holes keep its free space off the backup storage
+	if (!twrpImage::folderKeepsHoles(backup_folder)) {
+		LOGINFO("Backup storage of '%s' does not keep holes in files, backing up with tar\n", Mount_Point.c_str());
+		return Backup_Tar(backup_folder, overall_size, other_backups_size);
+	}
+	if (!UnMount(true) || Is_Mounted()) {
+		LOGERR("'%s' has to be unmounted to back up its used blocks\n", Mount_Point.c_str());
+		return false;
+	}
+
+	TWFunc::GUI_Operation_Text(TW_BACKUP_TEXT, Backup_Display_Name, "Backing Up");
+	gui_print("Backing up %s...\n", Backup_Display_Name.c_str());
+
+	sprintf(back_name, "%s.emmc.win", Backup_Name.c_str());
+	Backup_FileName = back_name;
+	Full_FileName = backup_folder + "/" + Backup_FileName;
+
+	DataManager::GetValue(TW_SKIP_MD5_GENERATE_VAR, skip_md5);
+	image.setsource(Actual_Block_Device);
+	image.setdest(Full_FileName);
+	image.setmd5(skip_md5 == 0);
+	if (image.useExt4Bitmaps() != 0) {
+		LOGINFO("Unable to find the used blocks of '%s', backing it up with tar\n", Mount_Point.c_str());
+		return Backup_Tar(backup_folder, overall_size, other_backups_size);
+	}
+	if (image.copyImage(overall_size, other_backups_size) != 0) {
+		LOGERR("Unable to back up '%s'\n", Backup_Display_Name.c_str());
+		return false;
+	}
+	Backup_Has_MD5 = (skip_md5 == 0);
 	return true;
 }
 
@@ -1936,9 +2056,10 @@ bool TWPartition::Restore_Tar(string restore_folder, string Restore_File_System,
 }
 
 bool TWPartition::Restore_DD(string restore_folder, const unsigned long long *total_restore_size, unsigned long long *already_restored_size) {
-	string Full_FileName, Command;
+	string Full_FileName;
 	double display_percent, progress_percent;
 	char size_progress[1024];
+	twrpImage image;
 
 	TWFunc::GUI_Operation_Text(TW_RESTORE_TEXT, Display_Name, "Restoring");
 	Full_FileName = restore_folder + "/" + Backup_FileName;
@@ -1955,10 +2076,23 @@ bool TWPartition::Restore_DD(string restore_folder, const unsigned long long *to
 		return false;
 	}
 
+	// Images of used blocks are restored over file systems
+	if (Can_Be_Mounted && (!UnMount(true) || Is_Mounted())) {
+		LOGERR("Unable to unmount '%s' to restore it\n", Mount_Point.c_str());
+		return false;
+	}
+
 	gui_print("Restoring %s...\n", Display_Name.c_str());
-	Command = "dd bs=4096 if='" + Full_FileName + "' of=" + Actual_Block_Device;
-	LOGINFO("Restore command: '%s'\n", Command.c_str());
-	TWFunc::Exec_Cmd(Command);
+	image.setsource(Full_FileName);
+	image.setdest(Actual_Block_Device);
+	image.setsize(backup_size);
+	if (image.copyImage(total_restore_size, already_restored_size) != 0) {
+		LOGERR("Unable to restore '%s'\n", Display_Name.c_str());
+		return false;
+	}
+	// The image may hold a different file system than the partition had
+	if (Can_Be_Mounted)
+		Check_FS_Type();
 	display_percent = (double)(Restore_Size + *already_restored_size) / (double)(*total_restore_size) * 100;
 	sprintf(size_progress, "%lluMB of %lluMB, %i%%", (Restore_Size + *already_restored_size) / 1048576, *total_restore_size / 1048576, (int)(display_percent));
 	DataManager::SetValue("tw_size_progress", size_progress);
@@ -1991,13 +2125,13 @@ bool TWPartition::Restore_Flash_Image(string restore_folder, const unsigned long
 	return true;
 }
 
-bool TWPartition::Update_Size(bool Display_Error) {
+bool TWPartition::Update_Size(bool Display_Error, bool Leave_Mounted) {
 	bool ret = false, Was_Already_Mounted = false;
 
 	if (!Can_Be_Mounted && !Is_Encrypted)
 		return false;
 
-	Was_Already_Mounted = Is_Mounted();
+	Was_Already_Mounted = Is_Mounted() || Leave_Mounted;
 	if (Removable || Is_Encrypted) {
 		if (!Mount(false))
 			return true;
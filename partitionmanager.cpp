@@ -30,6 +30,10 @@
 #include <iostream>
 #include <iomanip>
 #include <sys/wait.h>
+#include <pthread.h>
+#include <map>
+#include <set>
+#include <algorithm>
 #include "variables.h"
 #include "twcommon.h"
 #include "partitions.hpp"
@@ -542,7 +546,7 @@ bool TWPartitionManager::Backup_Partition(TWPartition* Part, string Backup_Folde
 					}
 					sync();
 					sync();
-					if (!Make_MD5(generate_md5, Backup_Folder, (*subpart)->Backup_FileName)) {
+					if (!Make_MD5(generate_md5 && !(*subpart)->Backup_Has_MD5, Backup_Folder, (*subpart)->Backup_FileName)) {
 						TWFunc::SetPerformanceMode(false);
 						return false;
 					}
@@ -568,7 +572,8 @@ bool TWPartitionManager::Backup_Partition(TWPartition* Part, string Backup_Folde
 			*img_time += backup_time;
 		}
 
-		md5Success = Make_MD5(generate_md5, Backup_Folder, Part->Backup_FileName);
+		// Raw images get their md5 while they are written
+		md5Success = Make_MD5(generate_md5 && !Part->Backup_Has_MD5, Backup_Folder, Part->Backup_FileName);
 		TWFunc::SetPerformanceMode(false);
 		return md5Success;
 	} else {
@@ -1181,14 +1186,74 @@ int TWPartitionManager::Repair_By_Path(string Path, bool Display_Error) {
 	return false;
 }
 
+TWPartition* TWPartitionManager::Find_Mount_Root(TWPartition* Part) {
+	std::vector<TWPartition*>::iterator iter;
+	TWPartition* Root = Part;
+
+	if (Part->Is_SubPartition) {
+		TWPartition* Parent = Find_Partition_By_Path(Part->SubPartition_Of);
+		if (Parent != NULL && Parent != Part)
+			Root = Parent;
+	}
+	// A mount point inside another partition needs that partition mounted first
+	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+		if ((*iter)->Can_Be_Mounted && (*iter) != Root && (*iter)->Mount_Point.size() < Root->Mount_Point.size() && Root->Mount_Point.compare(0, (*iter)->Mount_Point.size() + 1, (*iter)->Mount_Point + "/") == 0)
+			Root = (*iter);
+	}
+	return (Root == Part ? Root : Find_Mount_Root(Root));
+}
+
+bool TWPartitionManager::Longer_Mount_Point(TWPartition* a, TWPartition* b) {
+	return a->Mount_Point.size() > b->Mount_Point.size();
+}
+
+// Sizes the partitions of one device in order, leaving them mounted
+static void* Update_Size_Thread(void* cookie) {
+	std::vector<TWPartition*>* Group = (std::vector<TWPartition*>*) cookie;
+	std::vector<TWPartition*>::iterator iter;
+
+	for (iter = Group->begin(); iter != Group->end(); iter++)
+		(*iter)->Update_Size(true, true);
+	return NULL;
+}
+
 void TWPartitionManager::Update_System_Details(void) {
 	std::vector<TWPartition*>::iterator iter;
 	int data_size = 0;
 
 	gui_print("Updating partition details...\n");
+
+	// Each device is probed on its own thread. Partitions that depend on
+	// each other share a thread, and everything stays mounted until all
+	// sizes are known, so nothing gets mounted twice.
+	std::map<TWPartition*, std::vector<TWPartition*> > Groups;
+	std::set<TWPartition*> Was_Mounted;
+	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+		if (!(*iter)->Can_Be_Mounted)
+			continue;
+		if ((*iter)->Is_Mounted())
+			Was_Mounted.insert(*iter);
+#ifdef TW_INCLUDE_CRYPTO_SAMSUNG
+		// Mounting any storage may mount /data for ecryptfs
+		Groups[NULL].push_back(*iter);
+#else
+		Groups[Find_Mount_Root(*iter)].push_back(*iter);
+#endif
+	}
+	std::vector<pthread_t> Threads;
+	std::map<TWPartition*, std::vector<TWPartition*> >::iterator group;
+	for (group = Groups.begin(); group != Groups.end(); group++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Update_Size_Thread, &group->second) == 0)
+			Threads.push_back(thread);
+		else
+			Update_Size_Thread(&group->second);
+	}
+	for (size_t i = 0; i < Threads.size(); i++)
+		pthread_join(Threads[i], NULL);
+
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
 		if ((*iter)->Can_Be_Mounted) {
-			(*iter)->Update_Size(true);
 			if ((*iter)->Mount_Point == "/system") {
 				int backup_display_size = (int)((*iter)->Backup_Size / 1048576LLU);
 				DataManager::SetValue(TW_BACKUP_SYSTEM_SIZE, backup_display_size);
@@ -1322,6 +1387,20 @@ void TWPartitionManager::Update_System_Details(void) {
 	} else {
 		LOGINFO("Unable to find storage partition '%s'.\n", current_storage_path.c_str());
 	}
+
+	// Put the rest back the way it was, storage is left mounted. Longer mount
+	// points go first, so a partition mounted inside another one is unmounted
+	// before it wherever it is in the fstab.
+	TWPartition* Storage_Root = (FreeStorage != NULL ? Find_Mount_Root(FreeStorage) : NULL);
+	std::vector<TWPartition*> UnMount_List;
+	for (std::vector<TWPartition*>::reverse_iterator riter = Partitions.rbegin(); riter != Partitions.rend(); riter++) {
+		if ((*riter)->Can_Be_Mounted && Was_Mounted.find(*riter) == Was_Mounted.end() && Find_Mount_Root(*riter) != Storage_Root)
+			UnMount_List.push_back(*riter);
+	}
+	std::stable_sort(UnMount_List.begin(), UnMount_List.end(), Longer_Mount_Point);
+	for (iter = UnMount_List.begin(); iter != UnMount_List.end(); iter++)
+		(*iter)->UnMount(false);
+
 	if (!Write_Fstab())
 		LOGERR("Error creating fstab\n");
 	return;
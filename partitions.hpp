@@ -42,6 +42,7 @@ public:
 		FILES = 1,
 		DD = 2,
 		FLASH_UTILS = 3,
+		USED_BLOCKS = 4,
 	};
 
 public:
@@ -65,7 +66,7 @@ public:
 	bool Decrypt(string Password);                                            // Decrypts the partition, return 0 for failure and -1 for success
 	bool Wipe_Encryption();                                                   // Ignores wipe commands for /data/media devices and formats the original block device
 	void Check_FS_Type();                                                     // Checks the fs type using blkid, does not do anything on MTD / yaffs2 because this crashes on some devices
-	bool Update_Size(bool Display_Error);                                     // Updates size information
+	bool Update_Size(bool Display_Error, bool Leave_Mounted = false);         // Updates size information, Leave_Mounted keeps the partition mounted for the caller to unmount
 	void Recreate_Media_Folder();                                             // Recreates the /data/media folder
 
 public:
@@ -94,6 +95,7 @@ private:
 	unsigned long long Get_Size_Via_du(string Path, bool Display_Error);      // Uses du to get sizes
 	bool Wipe_EXT23(string File_System);                                      // Formats as ext3 or ext2
 	bool Wipe_EXT4();                                                         // Formats using ext4, uses make_ext4fs when present
+	bool Discard_Block_Device(bool *Zeroes);                                  // Discards the blocks of the file system before it is formatted, Zeroes tells if they read back as zeros
 	bool Wipe_FAT();                                                          // Formats as FAT if mkdosfs exits otherwise rm -rf wipe
 	bool Wipe_EXFAT();                                                        // Formats as EXFAT
 	bool Wipe_MTD();                                                          // Formats as yaffs2 for MTD memory types
@@ -101,14 +103,15 @@ private:
 	bool Wipe_F2FS();                                                         // Uses mkfs.f2fs to wipe
 	bool Wipe_Data_Without_Wiping_Media();                                    // Uses rm -rf to wipe but does not wipe /data/media
 	bool Backup_Tar(string backup_folder, const unsigned long long *overall_size, const unsigned long long *other_backups_size); // Backs up using tar for file systems
-	bool Backup_DD(string backup_folder);                                     // Backs up using dd for emmc memory types
+	bool Backup_DD(string backup_folder, const unsigned long long *overall_size, const unsigned long long *other_backups_size); // Backs up emmc memory types as a raw image
+	bool Backup_Used_Blocks(string backup_folder, const unsigned long long *overall_size, const unsigned long long *other_backups_size); // Backs up the blocks an ext4 file system uses as a raw image
 	bool Backup_Dump_Image(string backup_folder);                             // Backs up using dump_image for MTD memory types
 	string Get_Restore_File_System(string restore_folder);                    // Returns the file system that was in place at the time of the backup
 	bool Restore_Tar(string restore_folder, string Restore_File_System, const unsigned long long *total_restore_size, unsigned long long *already_restored_size); // Restore using tar for file systems
-	bool Restore_DD(string restore_folder, const unsigned long long *total_restore_size, unsigned long long *already_restored_size); // Restore using dd for emmc memory types
+	bool Restore_DD(string restore_folder, const unsigned long long *total_restore_size, unsigned long long *already_restored_size); // Restore raw images to emmc memory types
 	bool Restore_Flash_Image(string restore_folder, const unsigned long long *total_restore_size, unsigned long long *already_restored_size); // Restore using flash_image for MTD memory types
 	bool Get_Size_Via_statfs(bool Display_Error);                             // Get Partition size, used, and free space using statfs
-	bool Get_Size_Via_df(bool Display_Error);                                 // Get Partition size, used, and free space using df command
+	bool Get_Size_Via_df(bool Display_Error);                                 // Get Partition size, used, and free space the way df reports them
 	bool Make_Dir(string Path, bool Display_Error);                           // Creates a directory if it doesn't already exist
 	bool Find_MTD_Block_Device(string MTD_Name);                              // Finds the mtd block device based on the name from the fstab
 	void Recreate_AndSec_Folder(void);                                        // Recreates the .android_secure folder
@@ -119,6 +122,7 @@ private:
 	bool Can_Be_Wiped;                                                        // Indicates that the partition can be wiped
 	bool Can_Be_Backed_Up;                                                    // Indicates that the partition will show up in the backup list
 	bool Use_Rm_Rf;                                                           // Indicates that the partition will always be formatted w/ "rm -rf *"
+	bool Use_Block_Backup;                                                    // Indicates that the partition is backed up as an image of its used blocks instead of with tar
 	bool Wipe_During_Factory_Reset;                                           // Indicates that this partition is wiped during a factory reset
 	bool Wipe_Available_in_GUI;                                               // Inidcates that the wipe can be user initiated in the GUI system
 	bool Is_SubPartition;                                                     // Indicates that this partition is a sub-partition of another partition (e.g. datadata is a sub-partition of data)
@@ -147,6 +151,7 @@ private:
 	string Storage_Name;                                                      // Name displayed in the partition list for storage selection
 	string Backup_FileName;                                                   // Actual backup filename
 	Backup_Method_enum Backup_Method;                                         // Method used for backup
+	bool Backup_Has_MD5;                                                      // The last backup wrote its md5 file while it was made
 	bool Can_Encrypt_Backup;                                                  // Indicates if this item can be encrypted during backup
 	bool Use_Userdata_Encryption;                                             // Indicates if we will use userdata encryption splitting on an encrypted backup
 	bool Has_Android_Secure;                                                  // Indicates the presence of .android_secure on this partition
@@ -223,6 +228,8 @@ private:
 	bool Restore_Partition(TWPartition* Part, string Restore_Name, int partition_count, const unsigned long long *total_restore_size, unsigned long long *already_restored_size);
 	void Output_Partition(TWPartition* Part);
 	TWPartition* Find_Next_Storage(string Path, string Exclude);
+	TWPartition* Find_Mount_Root(TWPartition* Part);                          // Returns the partition that has to be mounted before Part can be, or Part itself
+	static bool Longer_Mount_Point(TWPartition* a, TWPartition* b);          // Orders partitions nested in others before them, for unmounting
 	int Open_Lun_File(string Partition_Path, string Lun_File);
 	pid_t mtppid;
 	bool mtp_was_enabled;
@@ -43,6 +43,7 @@
 #include "variables.h"
 #include "bootloader.h"
 #include "cutils/properties.h"
+#include "twrpWipe.hpp"
 #ifdef ANDROID_RB_POWEROFF
 	#include "cutils/android_reboot.h"
 #endif
@@ -512,6 +513,7 @@ void TWFunc::Update_Intent_File(string Intent) {
 int TWFunc::tw_reboot(RebootCommand command)
 {
 	// Always force a sync before we reboot
+	DataManager::FlushPending(true);
 	sync();
 
 	switch (command) {
@@ -556,47 +558,9 @@ void TWFunc::check_and_run_script(const char* script_file, const char* display_n
 }
 
 int TWFunc::removeDir(const string path, bool skipParent) {
-	DIR *d = opendir(path.c_str());
-	int r = 0;
-	string new_path;
+	twrpWipe wipe;
 
-	if (d == NULL) {
-		LOGERR("Error opening '%s'\n", path.c_str());
-		return -1;
-	}
-
-	if (d) {
-		struct dirent *p;
-		while (!r && (p = readdir(d))) {
-			if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
-				continue;
-			new_path = path + "/";
-			new_path.append(p->d_name);
-			if (p->d_type == DT_DIR) {
-				r = removeDir(new_path, true);
-				if (!r) {
-					if (p->d_type == DT_DIR)
-						r = rmdir(new_path.c_str());
-					else
-						LOGINFO("Unable to removeDir '%s': %s\n", new_path.c_str(), strerror(errno));
-				}
-			} else if (p->d_type == DT_REG || p->d_type == DT_LNK || p->d_type == DT_FIFO || p->d_type == DT_SOCK) {
-				r = unlink(new_path.c_str());
-				if (r != 0) {
-					LOGINFO("Unable to unlink '%s: %s'\n", new_path.c_str(), strerror(errno));
-				}
-			}
-		}
-		closedir(d);
-
-		if (!r) {
-			if (skipParent)
-				return 0;
-			else
-				r = rmdir(path.c_str());
-		}
-	}
-	return r;
+	return wipe.removeDir(path, skipParent);
 }
 
 int TWFunc::copy_file(string src, string dst, int mode) {
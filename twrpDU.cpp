@@ -21,13 +21,16 @@ extern "C" {
 }
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fstream>
 #include <string>
 #include <vector>
-#include <algorithm>
+#include <deque>
 #include "twrpDU.hpp"
 #include "twrp-functions.hpp"
 
@@ -35,72 +38,241 @@ using namespace std;
 
 extern bool datamedia;
 
+// Folders are walked by up to this many threads, including the caller
+#define DU_MAX_THREADS 4
+// Names the folder cache holds at most, about 5 MB. Folders found after it
+// is full are read again on every walk.
+#define DU_CACHE_MAX_NAMES 100000
+
+// State shared by the threads of one Get_Folder_Size call, protected by lock.
+// A thread that finds a subfolder while others are idle hands it over
+// through the queue, otherwise it walks it itself with openat.
+struct twrpDU::Walk {
+	twrpDU* du;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	deque<string> queue;
+	int idle;    // threads waiting for a folder
+	int busy;    // threads walking a folder
+	uint64_t size;
+};
+
 twrpDU::twrpDU() {
+	pthread_mutex_init(&cachelock, NULL);
+	cache_names = 0;
 	add_relative_dir(".");
 	add_relative_dir("..");
 	add_relative_dir("lost+found");
 	add_absolute_dir("/data/data/com.google.android.music/files");
 }
 
+void twrpDU::clear_cache(void) {
+	pthread_mutex_lock(&cachelock);
+	cache.clear();
+	cache_names = 0;
+	pthread_mutex_unlock(&cachelock);
+}
+
 void twrpDU::add_relative_dir(const string& dir) {
-	relativedir.push_back(dir);
+	relativedir.insert(dir);
 }
 
 void twrpDU::clear_relative_dir(string dir) {
-	vector<string>::iterator iter = relativedir.begin();
-	while (iter != relativedir.end()) {
-		if (*iter == dir)
-			iter = relativedir.erase(iter);
-		else
-			iter++;
-	}
+	relativedir.erase(dir);
 }
 
 void twrpDU::add_absolute_dir(const string& dir) {
-	absolutedir.push_back(TWFunc::Remove_Trailing_Slashes(dir));
+	absolutedir.insert(TWFunc::Remove_Trailing_Slashes(dir));
 }
 
 vector<string> twrpDU::get_absolute_dirs(void) {
-	return absolutedir;
+	return vector<string>(absolutedir.begin(), absolutedir.end());
 }
 
 uint64_t twrpDU::Get_Folder_Size(const string& Path) {
-	DIR* d;
-	struct dirent* de;
-	struct stat st;
+	string Root = TWFunc::Remove_Trailing_Slashes(Path);
+	if (Root.empty())
+		Root = "/";
+
+	Walk walk;
+	walk.du = this;
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+	walk.queue.push_back(Root);
+	walk.idle = 0;
+	walk.busy = 0;
+	walk.size = 0;
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = cores < 1 ? 1 : (cores > DU_MAX_THREADS ? DU_MAX_THREADS : (int)cores);
+	vector<pthread_t> started;
+	for (int i = 1; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Walk_Thread, &walk) == 0)
+			started.push_back(thread);
+	}
+	Walk_Thread(&walk);
+	for (size_t i = 0; i < started.size(); i++)
+		pthread_join(started[i], NULL);
+
+	pthread_cond_destroy(&walk.cond);
+	pthread_mutex_destroy(&walk.lock);
+	return walk.size;
+}
+
+void* twrpDU::Walk_Thread(void* cookie) {
+	Walk* walk = (Walk*) cookie;
+	uint64_t size = 0;
+
+	pthread_mutex_lock(&walk->lock);
+	for (;;) {
+		if (!walk->queue.empty()) {
+			string Path = walk->queue.front();
+			walk->queue.pop_front();
+			walk->busy++;
+			pthread_mutex_unlock(&walk->lock);
+			size += walk->du->Walk_Dir(AT_FDCWD, Path.c_str(), Path, walk);
+			pthread_mutex_lock(&walk->lock);
+			walk->busy--;
+			continue;
+		}
+		if (walk->busy == 0)
+			break;
+		walk->idle++;
+		pthread_cond_wait(&walk->cond, &walk->lock);
+		walk->idle--;
+	}
+	walk->size += size;
+	pthread_cond_broadcast(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+	return NULL;
+}
+
+// Returns the size of the folder name in parentfd, Path is its full path
+uint64_t twrpDU::Walk_Dir(int parentfd, const char* name, const string& Path, Walk* walk) {
 	uint64_t dusize = 0;
-	string FullPath;
+	vector<string> files, subdirs;
 
-	d = opendir(Path.c_str());
-	if (d == NULL) {
+	int fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
 		LOGERR("error opening '%s'\n", Path.c_str());
 		LOGERR("error: %s\n", strerror(errno));
 		return 0;
 	}
 
-	while ((de = readdir(d)) != NULL) {
-		FullPath = Path + "/";
-		FullPath += de->d_name;
-		if (lstat(FullPath.c_str(), &st)) {
-			LOGERR("Unable to stat '%s'\n", FullPath.c_str());
-			continue;
+	struct stat dst;
+	bool cacheable = (fstat(fd, &dst) == 0);
+	bool cached = false;
+	if (cacheable) {
+		pthread_mutex_lock(&cachelock);
+		map<Cache_Key, Cache_Entry>::iterator it = cache.find(Cache_Key(dst.st_dev, dst.st_ino));
+		if (it != cache.end() && it->second.mtime == dst.st_mtime && it->second.ctime == dst.st_ctime) {
+			files = it->second.files;
+			subdirs = it->second.subdirs;
+			cached = true;
 		}
-		if ((st.st_mode & S_IFDIR) && !check_skip_dirs(FullPath) && de->d_type != DT_SOCK) {
-			dusize += Get_Folder_Size(FullPath);
-		} else if (st.st_mode & S_IFREG) {
-			dusize += (uint64_t)(st.st_size);
+		pthread_mutex_unlock(&cachelock);
+	}
+
+	if (cached) {
+		for (vector<string>::iterator file = files.begin(); file != files.end(); file++) {
+			struct stat st;
+			if (fstatat(fd, file->c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0)
+				dusize += (uint64_t)(st.st_size);
 		}
 	}
-	closedir(d);
+
+	DIR* d = NULL;
+	if (!cached) {
+		d = fdopendir(fd);
+		if (d == NULL) {
+			LOGERR("error opening '%s'\n", Path.c_str());
+			LOGERR("error: %s\n", strerror(errno));
+			close(fd);
+			return 0;
+		}
+
+		struct dirent* de;
+		while ((de = readdir(d)) != NULL) {
+			unsigned char type = de->d_type;
+			if (type != DT_DIR) {
+				struct stat st;
+				if (type != DT_REG && type != DT_LNK && type != DT_UNKNOWN)
+					continue;
+				if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+					LOGERR("Unable to stat '%s/%s'\n", Path.c_str(), de->d_name);
+					continue;
+				}
+				if (!S_ISDIR(st.st_mode)) {
+					if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
+						dusize += (uint64_t)(st.st_size);
+						files.push_back(de->d_name);
+					}
+					continue;
+				}
+			}
+			if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+				subdirs.push_back(de->d_name);
+		}
+
+		// A folder changed within the last second could change again without a new mtime
+		if (cacheable && dst.st_mtime < time(NULL) - 1 && dst.st_ctime < time(NULL) - 1) {
+			pthread_mutex_lock(&cachelock);
+			Cache_Key key(dst.st_dev, dst.st_ino);
+			map<Cache_Key, Cache_Entry>::iterator it = cache.find(key);
+			if (it != cache.end()) {
+				cache_names -= it->second.files.size() + it->second.subdirs.size();
+				cache.erase(it);
+			}
+			if (cache_names + files.size() + subdirs.size() <= DU_CACHE_MAX_NAMES) {
+				Cache_Entry& entry = cache[key];
+				entry.mtime = dst.st_mtime;
+				entry.ctime = dst.st_ctime;
+				entry.files = files;
+				entry.subdirs = subdirs;
+				cache_names += files.size() + subdirs.size();
+			}
+			pthread_mutex_unlock(&cachelock);
+		}
+	}
+
+	// The skip lists are checked on every walk, they may have changed since the folder was cached
+	for (vector<string>::iterator sub = subdirs.begin(); sub != subdirs.end(); sub++) {
+		if (relativedir.find(*sub) != relativedir.end())
+			continue;
+		string FullPath = Path;
+		if (FullPath != "/")
+			FullPath += "/";
+		FullPath += *sub;
+		if (!absolutedir.empty() && absolutedir.find(FullPath) != absolutedir.end())
+			continue;
+
+		// Hand the folder to an idle thread if there is one
+		bool queued = false;
+		pthread_mutex_lock(&walk->lock);
+		if ((size_t)walk->idle > walk->queue.size()) {
+			walk->queue.push_back(FullPath);
+			pthread_cond_signal(&walk->cond);
+			queued = true;
+		}
+		pthread_mutex_unlock(&walk->lock);
+		if (!queued)
+			dusize += Walk_Dir(fd, sub->c_str(), FullPath, walk);
+	}
+
+	if (d)
+		closedir(d);
+	else
+		close(fd);
 	return dusize;
 }
 
 bool twrpDU::check_relative_skip_dirs(const string& dir) {
-	return std::find(relativedir.begin(), relativedir.end(), dir) != relativedir.end();
+	return relativedir.find(dir) != relativedir.end();
 }
 
 bool twrpDU::check_absolute_skip_dirs(const string& path) {
-	return std::find(absolutedir.begin(), absolutedir.end(), path) != absolutedir.end();
+	return absolutedir.find(path) != absolutedir.end();
 }
 
 bool twrpDU::check_skip_dirs(const string& path) {
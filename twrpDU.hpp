@@ -29,6 +29,11 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <set>
+#include <map>
+#include <utility>
+#include <pthread.h>
+#include <time.h>
 #include "twcommon.h"
 
 using namespace std;
@@ -37,7 +42,7 @@ class twrpDU {
 
 public:
 	twrpDU();
-	uint64_t Get_Folder_Size(const string& Path); // Gets the folder's size using stat
+	uint64_t Get_Folder_Size(const string& Path); // Gets the folder's size using stat, walking subfolders on several threads
 	void add_absolute_dir(const string& Path);
 	void add_relative_dir(const string& Path);
 	bool check_relative_skip_dirs(const string& dir);
@@ -45,9 +50,27 @@ public:
 	bool check_skip_dirs(const string& path);
 	vector<string> get_absolute_dirs(void);
 	void clear_relative_dir(string dir);
+	void clear_cache(void); // Forgets all folder sizes, for when a partition is wiped or restored
 private:
-	vector<string> absolutedir;
-	vector<string> relativedir;
+	struct Walk;
+	uint64_t Walk_Dir(int parentfd, const char* name, const string& Path, Walk* walk);
+	static void* Walk_Thread(void* cookie);
+
+	// What a folder held when it was last read, reused while its mtime and ctime stay the same.
+	// Files are stat'ed again on every walk, they can be rewritten without touching the folder.
+	struct Cache_Entry {
+		time_t mtime;
+		time_t ctime;
+		vector<string> files;   // regular files and symlinks directly in the folder
+		vector<string> subdirs;
+	};
+	typedef pair<dev_t, ino_t> Cache_Key;
+
+	set<string> absolutedir;
+	set<string> relativedir;
+	map<Cache_Key, Cache_Entry> cache;
+	size_t cache_names;     // files and subdirs held by all entries
+	pthread_mutex_t cachelock;
 };
 
 extern twrpDU du;
@@ -49,22 +49,33 @@ void twrpDigest::setfn(string fn) {
 
 int twrpDigest::computeMD5(void) {
 	string line;
-	struct MD5Context md5c;
 	FILE *file;
 	int len;
 	unsigned char buf[1024];
-	MD5Init(&md5c);
+	initMD5();
 	file = fopen(md5fn.c_str(), "rb");
 	if (file == NULL)
 		return -1;
 	while ((len = fread(buf, 1, sizeof(buf), file)) > 0) {
-		MD5Update(&md5c, buf, len);
+		updateMD5(buf, len);
 	}
 	fclose(file);
-	MD5Final(md5sum, &md5c);
+	finalizeMD5();
 	return 0;
 }
 
+void twrpDigest::initMD5(void) {
+	MD5Init(&md5c);
+}
+
+void twrpDigest::updateMD5(const unsigned char* buf, size_t len) {
+	MD5Update(&md5c, buf, len);
+}
+
+void twrpDigest::finalizeMD5(void) {
+	MD5Final(md5sum, &md5c);
+}
+
 int twrpDigest::write_md5digest(void) {
 	int i;
 	string md5string, md5file;
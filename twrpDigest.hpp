@@ -30,9 +30,15 @@ public:
 	int verify_md5digest(void);
 	int write_md5digest(void);
 
+	// For data that is being written anyway, instead of reading the file back in computeMD5
+	void initMD5(void);
+	void updateMD5(const unsigned char* buf, size_t len);
+	void finalizeMD5(void);
+
 private:
 	int read_md5digest(void);
 	string md5fn;
 	string line;
 	unsigned char md5sum[MD5LENGTH];
+	struct MD5Context md5c;
 };
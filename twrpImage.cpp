@@ -0,0 +1,544 @@
+/*
+	Copyright 2014 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "twcommon.h"
+#include "data.hpp"
+#include "twrpDigest.hpp"
+#include "twrpImage.hpp"
+
+using namespace std;
+
+#define IMAGE_BUFFER_SIZE (4 * 1024 * 1024)
+#define IMAGE_ALIGNMENT 4096
+#define IMAGE_BLOCK_SIZE 4096  // unit of zero detection
+#define IMAGE_MERGE_GAP (64 * 1024)  // free space between used blocks that is read anyway, for longer reads
+#define IMAGE_HOLE_TEST_SIZE (1024 * 1024)
+
+// ext4 on-disk layout, all values are little endian
+#define EXT4_SUPERBLOCK_OFFSET 1024
+#define EXT4_SUPER_MAGIC 0xEF53
+#define EXT4_FEATURE_INCOMPAT_META_BG 0x0010
+#define EXT4_FEATURE_INCOMPAT_64BIT 0x0080
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM 0x0010
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM 0x0400
+#define EXT4_BG_BLOCK_UNINIT 0x0002
+
+twrpImage::twrpImage() {
+	copy_size = 0;
+	copied = 0;
+	zero_bytes = 0;
+	dest_is_file = false;
+	generate_md5 = false;
+	source_fd = -1;
+	dest_fd = -1;
+	read_done = false;
+	abort_copy = false;
+	read_error = 0;
+	for (int i = 0; i < 2; i++) {
+		buffers[i].data = NULL;
+		buffers[i].length = 0;
+		buffers[i].full = false;
+	}
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+twrpImage::~twrpImage() {
+	for (int i = 0; i < 2; i++)
+		free(buffers[i].data);
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void twrpImage::setsource(string fn) {
+	sourcefn = fn;
+}
+
+void twrpImage::setdest(string fn) {
+	destfn = fn;
+}
+
+void twrpImage::setsize(unsigned long long size) {
+	copy_size = size;
+}
+
+void twrpImage::setmd5(bool generate) {
+	generate_md5 = generate;
+}
+
+unsigned long long twrpImage::get_copied() {
+	return copied;
+}
+
+unsigned long long twrpImage::get_zero_bytes() {
+	return zero_bytes;
+}
+
+// Extends an empty test file and checks that no blocks were allocated for it.
+// vfat and exfat write the zeros out, so an image there would be full size.
+bool twrpImage::folderKeepsHoles(string folder) {
+	string testfn = folder + "/.twrp_hole_test";
+	int fd = open(testfn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		LOGINFO("Unable to create '%s': %s\n", testfn.c_str(), strerror(errno));
+		return false;
+	}
+	struct stat st;
+	bool sparse = ftruncate64(fd, IMAGE_HOLE_TEST_SIZE) == 0 && fstat(fd, &st) == 0
+		&& (unsigned long long)st.st_blocks * 512 < IMAGE_HOLE_TEST_SIZE / 2;
+	close(fd);
+	unlink(testfn.c_str());
+	return sparse;
+}
+
+// Opens with O_DIRECT if the file system takes it
+int twrpImage::openImage(string fn, int flags) {
+	int fd = open(fn.c_str(), flags | O_DIRECT, 0644);
+	if (fd < 0 && errno == EINVAL)
+		fd = open(fn.c_str(), flags, 0644);
+	return fd;
+}
+
+// O_DIRECT needs aligned lengths, the last piece of an image may not be
+static bool dropDirect(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || !(flags & O_DIRECT))
+		return false;
+	return fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0;
+}
+
+static bool isZero(const char* buf, size_t len) {
+	return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+// Writes len bytes at offset in the destination
+int twrpImage::writeRun(const char* buf, size_t len, unsigned long long offset, bool zero) {
+	if (zero) {
+		zero_bytes += len;
+		// The image file was truncated, skipping leaves a hole that reads as zeros
+		if (dest_is_file)
+			return 0;
+#ifdef BLKZEROOUT
+		uint64_t range[2] = { (uint64_t)offset, (uint64_t)len };
+		if (len % 512 == 0 && ioctl(dest_fd, BLKZEROOUT, range) == 0)
+			return 0;
+#endif
+	}
+	while (len > 0) {
+		ssize_t ret = pwrite64(dest_fd, buf, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EINVAL && dropDirect(dest_fd))
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+// Writes a buffer as runs of data and runs of zero blocks
+int twrpImage::writeData(const char* buf, size_t len, unsigned long long offset) {
+	size_t start = 0;
+	bool zero = false;
+
+	for (size_t pos = 0; pos < len; pos += IMAGE_BLOCK_SIZE) {
+		size_t block = len - pos < IMAGE_BLOCK_SIZE ? len - pos : IMAGE_BLOCK_SIZE;
+		bool block_zero = isZero(buf + pos, block);
+		if (pos > start && block_zero != zero) {
+			if (writeRun(buf + start, pos - start, offset + start, zero) != 0)
+				return -1;
+			copied += pos - start;
+			start = pos;
+		}
+		zero = block_zero;
+	}
+	if (writeRun(buf + start, len - start, offset + start, zero) != 0)
+		return -1;
+	copied += len - start;
+	return 0;
+}
+
+static inline unsigned int le16(const unsigned char* p) {
+	return p[0] | (p[1] << 8);
+}
+
+static inline unsigned long le32(const unsigned char* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static bool preadFully(int fd, void* buf, size_t len, unsigned long long offset) {
+	char* pos = (char*) buf;
+	while (len > 0) {
+		ssize_t ret = pread64(fd, pos, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		pos += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return true;
+}
+
+// Adds a range to copy, joining it to the last one if only a small gap is between them
+void twrpImage::addExtent(unsigned long long start, unsigned long long length) {
+	if (!extents.empty()) {
+		Image_Extent& last = extents.back();
+		if (start <= last.start + last.length + IMAGE_MERGE_GAP) {
+			last.length = start + length - last.start;
+			return;
+		}
+	}
+	Image_Extent extent;
+	extent.start = start;
+	extent.length = length;
+	extents.push_back(extent);
+}
+
+int twrpImage::useExt4Bitmaps() {
+	unsigned char sb[1024];
+	int fd = open(sourcefn.c_str(), O_RDONLY);
+	if (fd < 0) {
+		LOGERR("Unable to open '%s': %s\n", sourcefn.c_str(), strerror(errno));
+		return -1;
+	}
+	if (!preadFully(fd, sb, sizeof(sb), EXT4_SUPERBLOCK_OFFSET) || le16(sb + 56) != EXT4_SUPER_MAGIC) {
+		LOGINFO("'%s' does not have an ext4 file system\n", sourcefn.c_str());
+		close(fd);
+		return -1;
+	}
+
+	unsigned long long block_size = 1024ULL << le32(sb + 24);
+	unsigned long long blocks = le32(sb + 4);
+	unsigned long first_data_block = le32(sb + 20);
+	unsigned long blocks_per_group = le32(sb + 32);
+	unsigned long incompat = le32(sb + 96);
+	unsigned long ro_compat = le32(sb + 100);
+	unsigned int desc_size = 32;
+	if (incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+		blocks |= (unsigned long long)le32(sb + 336) << 32;
+		if (le16(sb + 254) > 32)
+			desc_size = le16(sb + 254);
+	}
+	// META_BG moves the group descriptors out of the blocks after the superblock
+	if ((incompat & EXT4_FEATURE_INCOMPAT_META_BG) || block_size > 65536 || blocks_per_group == 0 || blocks_per_group > block_size * 8 || blocks <= first_data_block) {
+		LOGINFO("Unsupported ext4 layout on '%s'\n", sourcefn.c_str());
+		close(fd);
+		return -1;
+	}
+	// Without group checksums BLOCK_UNINIT is not trusted by the kernel either
+	bool uninit_valid = (ro_compat & (EXT4_FEATURE_RO_COMPAT_GDT_CSUM | EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)) != 0;
+
+	unsigned long long groups = (blocks - first_data_block + blocks_per_group - 1) / blocks_per_group;
+	vector<unsigned char> gdt(groups * desc_size);
+	vector<unsigned char> bitmap(block_size);
+	if (!preadFully(fd, &gdt[0], gdt.size(), (first_data_block + 1) * block_size)) {
+		LOGERR("Unable to read the ext4 group descriptors of '%s'\n", sourcefn.c_str());
+		close(fd);
+		return -1;
+	}
+
+	extents.clear();
+	// Boot block in front of the first group
+	if (first_data_block > 0)
+		addExtent(0, first_data_block * block_size);
+	for (unsigned long long group = 0; group < groups; group++) {
+		const unsigned char* desc = &gdt[group * desc_size];
+		unsigned long long first = first_data_block + group * blocks_per_group;
+		unsigned long long count = blocks - first < blocks_per_group ? blocks - first : blocks_per_group;
+		unsigned long long bitmap_block = le32(desc);
+		if (desc_size >= 64)
+			bitmap_block |= (unsigned long long)le32(desc + 32) << 32;
+
+		// The metadata of a group without a bitmap can be anywhere in it, copy all of it
+		if (uninit_valid && (le16(desc + 18) & EXT4_BG_BLOCK_UNINIT)) {
+			addExtent(first * block_size, count * block_size);
+			continue;
+		}
+		if (bitmap_block >= blocks || !preadFully(fd, &bitmap[0], block_size, bitmap_block * block_size)) {
+			LOGERR("Unable to read the ext4 block bitmap of group %llu on '%s'\n", group, sourcefn.c_str());
+			close(fd);
+			extents.clear();
+			return -1;
+		}
+		unsigned long long run = 0;
+		for (unsigned long long i = 0; i <= count; i++) {
+			if (i < count && (bitmap[i >> 3] & (1 << (i & 7)))) {
+				run++;
+			} else if (run) {
+				addExtent((first + i - run) * block_size, run * block_size);
+				run = 0;
+			}
+		}
+	}
+	close(fd);
+
+	unsigned long long used = 0;
+	for (vector<Image_Extent>::iterator extent = extents.begin(); extent != extents.end(); extent++)
+		used += extent->length;
+	copy_size = blocks * block_size;
+	LOGINFO("'%s' has %llu of %llu bytes in use in %u extents\n", sourcefn.c_str(), used, copy_size, (unsigned)extents.size());
+	return 0;
+}
+
+void* twrpImage::readThread(void* cookie) {
+	((twrpImage*) cookie)->readData();
+	return NULL;
+}
+
+void twrpImage::readData() {
+	vector<Image_Extent> ranges = extents;
+	int index = 0, error = 0;
+
+	if (ranges.empty()) {
+		Image_Extent all;
+		all.start = 0;
+		all.length = copy_size;
+		ranges.push_back(all);
+	}
+	vector<Image_Extent>::iterator range = ranges.begin();
+	unsigned long long offset = range->start, remaining = range->length;
+
+	while (!error) {
+		if (remaining == 0) {
+			if (++range == ranges.end())
+				break;
+			offset = range->start;
+			remaining = range->length;
+			continue;
+		}
+		Image_Buffer* buffer = &buffers[index];
+		pthread_mutex_lock(&lock);
+		while (buffer->full && !abort_copy)
+			pthread_cond_wait(&cond, &lock);
+		bool stop = abort_copy;
+		pthread_mutex_unlock(&lock);
+		if (stop)
+			break;
+
+		// Read whole aligned blocks, a short read at the end of the source is fine
+		size_t want = remaining < IMAGE_BUFFER_SIZE ? (size_t)remaining : IMAGE_BUFFER_SIZE;
+		size_t aligned = (want + IMAGE_ALIGNMENT - 1) & ~(size_t)(IMAGE_ALIGNMENT - 1);
+		size_t got = 0;
+		while (got < want) {
+			ssize_t ret = pread64(source_fd, buffer->data + got, aligned - got, offset + got);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EINVAL && dropDirect(source_fd))
+					continue;
+				error = errno;
+				break;
+			}
+			if (ret == 0)
+				break;
+			got += ret;
+		}
+		if (!error && got < want) {
+			LOGERR("'%s' ended after %llu of %llu bytes\n", sourcefn.c_str(), offset + got, copy_size);
+			error = EIO;
+		}
+		if (error)
+			break;
+
+		buffer->length = want;
+		buffer->offset = offset;
+		offset += want;
+		remaining -= want;
+		pthread_mutex_lock(&lock);
+		buffer->full = true;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+		index ^= 1;
+	}
+
+	pthread_mutex_lock(&lock);
+	read_error = error;
+	read_done = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+// The md5 is of the whole image, including the parts between extents that read as zeros
+static void digestZeros(twrpDigest& digest, unsigned long long from, unsigned long long to) {
+	static const unsigned char zeros[IMAGE_BLOCK_SIZE] = { 0 };
+
+	while (from < to) {
+		size_t len = to - from < sizeof(zeros) ? (size_t)(to - from) : sizeof(zeros);
+		digest.updateMD5(zeros, len);
+		from += len;
+	}
+}
+
+void twrpImage::updateProgress(const unsigned long long *overall_size, const unsigned long long *other_sizes) {
+	if (overall_size == NULL || *overall_size == 0)
+		return;
+
+	unsigned long long done = copied + (other_sizes ? *other_sizes : 0);
+	double display_percent = (double)(done) / (double)(*overall_size) * 100;
+	char size_progress[1024];
+	sprintf(size_progress, "%lluMB of %lluMB, %i%%", done / 1048576, *overall_size / 1048576, (int)(display_percent));
+	DataManager::SetValue("tw_size_progress", size_progress);
+	DataManager::SetProgress((float)(display_percent / 100));
+}
+
+int twrpImage::copyImage(const unsigned long long *overall_size, const unsigned long long *other_sizes) {
+	twrpDigest digest;
+	unsigned long long digest_pos = 0;
+	pthread_t thread;
+	int index = 0, error = 0;
+
+	copied = 0;
+	source_fd = openImage(sourcefn, O_RDONLY);
+	if (source_fd < 0) {
+		LOGERR("Unable to open '%s': %s\n", sourcefn.c_str(), strerror(errno));
+		return -1;
+	}
+	if (copy_size == 0) {
+		struct stat st;
+		if (fstat(source_fd, &st) == 0 && S_ISREG(st.st_mode))
+			copy_size = st.st_size;
+		else if (ioctl(source_fd, BLKGETSIZE64, &copy_size) != 0)
+			copy_size = 0;
+	}
+	dest_fd = openImage(destfn, O_WRONLY | O_CREAT | O_TRUNC);
+	if (dest_fd < 0) {
+		LOGERR("Unable to open '%s': %s\n", destfn.c_str(), strerror(errno));
+		close(source_fd);
+		return -1;
+	}
+	struct stat dest_st;
+	dest_is_file = (fstat(dest_fd, &dest_st) == 0 && S_ISREG(dest_st.st_mode));
+	if (!extents.empty() && !dest_is_file) {
+		// The blocks between extents would keep what was on the device before
+		LOGERR("Used blocks can only be copied into an image file\n");
+		close(source_fd);
+		close(dest_fd);
+		return -1;
+	}
+	zero_bytes = 0;
+	for (int i = 0; i < 2; i++) {
+		void* buf;
+		if (buffers[i].data == NULL && posix_memalign(&buf, IMAGE_ALIGNMENT, IMAGE_BUFFER_SIZE) == 0)
+			buffers[i].data = (char*) buf;
+		buffers[i].full = false;
+	}
+	if (buffers[0].data == NULL || buffers[1].data == NULL) {
+		LOGERR("Unable to allocate image buffers\n");
+		close(source_fd);
+		close(dest_fd);
+		return -1;
+	}
+
+	LOGINFO("Copying %llu bytes from '%s' to '%s'\n", copy_size, sourcefn.c_str(), destfn.c_str());
+	if (generate_md5) {
+		digest.setfn(destfn);
+		digest.initMD5();
+	}
+	read_done = false;
+	abort_copy = false;
+	read_error = 0;
+	if (pthread_create(&thread, NULL, readThread, this) != 0) {
+		LOGERR("Unable to start image reader\n");
+		close(source_fd);
+		close(dest_fd);
+		return -1;
+	}
+
+	for (;;) {
+		Image_Buffer* buffer = &buffers[index];
+		pthread_mutex_lock(&lock);
+		while (!buffer->full && !read_done)
+			pthread_cond_wait(&cond, &lock);
+		bool full = buffer->full;
+		pthread_mutex_unlock(&lock);
+		if (!full)
+			break;
+
+		if (writeData(buffer->data, buffer->length, buffer->offset) != 0) {
+			error = errno;
+			LOGERR("Unable to write '%s': %s\n", destfn.c_str(), strerror(error));
+			break;
+		}
+		if (generate_md5) {
+			digestZeros(digest, digest_pos, buffer->offset);
+			digest.updateMD5((const unsigned char*) buffer->data, buffer->length);
+			digest_pos = buffer->offset + buffer->length;
+		}
+		updateProgress(overall_size, other_sizes);
+
+		pthread_mutex_lock(&lock);
+		buffer->full = false;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+		index ^= 1;
+	}
+
+	pthread_mutex_lock(&lock);
+	abort_copy = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+	if (!error && read_error) {
+		error = read_error;
+		LOGERR("Unable to read '%s': %s\n", sourcefn.c_str(), strerror(error));
+	}
+
+	// Zeros at the end of the image have to be there in the file's size
+	if (!error && dest_is_file && ftruncate64(dest_fd, copy_size) != 0) {
+		error = errno;
+		LOGERR("Unable to set the size of '%s': %s\n", destfn.c_str(), strerror(error));
+	}
+
+	if (!error && fsync(dest_fd) != 0 && errno != EINVAL) {
+		error = errno;
+		LOGERR("Unable to sync '%s': %s\n", destfn.c_str(), strerror(error));
+	}
+	close(source_fd);
+	if (close(dest_fd) != 0 && !error)
+		error = errno;
+	source_fd = dest_fd = -1;
+	if (error)
+		return -1;
+
+	if (generate_md5) {
+		digestZeros(digest, digest_pos, copy_size);
+		digest.finalizeMD5();
+		if (digest.write_md5digest() != 0)
+			return -1;
+	}
+	LOGINFO("Copied %llu bytes, %llu of them zeros that were not written\n", copied, zero_bytes);
+	return 0;
+}
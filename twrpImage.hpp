@@ -0,0 +1,92 @@
+/*
+	Copyright 2014 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TWRPIMAGE_HPP
+#define TWRPIMAGE_HPP
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class twrpDigest;
+
+// Copies a raw image between a block device and a file, for backups and
+// restores of emmc partitions. A reader thread fills one aligned buffer
+// while the other one is written, both sides use O_DIRECT when the file
+// system allows it. Blocks of zeros are not written: they are left as
+// holes in an image file, and zeroed with BLKZEROOUT on a block device.
+class twrpImage {
+public:
+	twrpImage();
+	virtual ~twrpImage();
+	void setsource(string fn);
+	void setdest(string fn);
+	void setsize(unsigned long long size);                                    // Bytes to copy, the whole source if 0
+	void setmd5(bool generate);                                               // Writes an md5 file for the destination while copying
+	int useExt4Bitmaps();                                                     // Copies only the blocks an unmounted ext4 source has in use, into an image file
+	// Progress is shown as other_sizes + bytes copied out of overall_size, either may be NULL
+	int copyImage(const unsigned long long *overall_size, const unsigned long long *other_sizes);
+	unsigned long long get_copied();
+	unsigned long long get_zero_bytes();                                      // Bytes that were zeros and not written
+	static bool folderKeepsHoles(string folder);                              // Files in folder can have holes that take no space
+
+private:
+	struct Image_Buffer {
+		char* data;
+		size_t length;
+		unsigned long long offset;   // where the data is in the image
+		bool full;
+	};
+
+	struct Image_Extent {
+		unsigned long long start;
+		unsigned long long length;
+	};
+
+	static void* readThread(void* cookie);
+	void readData();
+	int openImage(string fn, int flags);
+	int writeData(const char* buf, size_t len, unsigned long long offset);
+	int writeRun(const char* buf, size_t len, unsigned long long offset, bool zero);
+	void addExtent(unsigned long long start, unsigned long long length);
+	void updateProgress(const unsigned long long *overall_size, const unsigned long long *other_sizes);
+
+	string sourcefn;
+	string destfn;
+	unsigned long long copy_size;
+	unsigned long long copied;
+	unsigned long long zero_bytes;
+	bool dest_is_file;
+	bool generate_md5;
+	int source_fd;
+	int dest_fd;
+	vector<Image_Extent> extents;                                             // parts of the source to copy, all of it if empty
+
+	// shared with the reader thread, protected by lock
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	Image_Buffer buffers[2];
+	bool read_done;
+	bool abort_copy;
+	int read_error;
+};
+
+#endif
@@ -0,0 +1,253 @@
+/*
+	Copyright 2014 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <algorithm>
+#include "twrpWipe.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+#include "data.hpp"
+
+using namespace std;
+
+// Folders are removed by up to this many threads, including the caller
+#define WIPE_MAX_THREADS 4
+// Entries removed by all threads between looks at the clock
+#define WIPE_PROGRESS_ENTRIES 256
+// How often the number of removed entries is shown
+#define WIPE_PROGRESS_MS 2000
+
+// State shared by the threads of one removeDir call, protected by lock.
+// A folder that still holds entries another thread is removing when its
+// walk ends is kept in deferred and removed after all threads are done.
+// An entry that cannot be removed does not stop the wipe, it sets failed
+// and removeDir reports it once everything else is gone.
+struct twrpWipe::Wipe {
+	twrpWipe* wipe;
+	string root;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	deque<string> queue;
+	vector<string> deferred;
+	int idle;    // threads waiting for a folder
+	int busy;    // threads removing a folder
+	volatile bool failed;
+	unsigned long long removed;
+	timespec start;
+	timespec last_progress;
+};
+
+static bool Longer_Path(const string& a, const string& b) {
+	return a.size() > b.size();
+}
+
+twrpWipe::twrpWipe() {
+	removed = 0;
+}
+
+void twrpWipe::add_skip(const string& name) {
+	skip.insert(name);
+}
+
+unsigned long long twrpWipe::get_removed(void) {
+	return removed;
+}
+
+int twrpWipe::removeDir(const string& Path, bool skipParent) {
+	string Root = TWFunc::Remove_Trailing_Slashes(Path);
+	if (Root.empty())
+		Root = "/";
+
+	Wipe wipe;
+	wipe.wipe = this;
+	wipe.root = Root;
+	pthread_mutex_init(&wipe.lock, NULL);
+	pthread_cond_init(&wipe.cond, NULL);
+	wipe.queue.push_back(Root);
+	wipe.idle = 0;
+	wipe.busy = 0;
+	wipe.failed = false;
+	wipe.removed = 0;
+	clock_gettime(CLOCK_MONOTONIC, &wipe.start);
+	wipe.last_progress = wipe.start;
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = cores < 1 ? 1 : (cores > WIPE_MAX_THREADS ? WIPE_MAX_THREADS : (int)cores);
+	vector<pthread_t> started;
+	for (int i = 1; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Wipe_Thread, &wipe) == 0)
+			started.push_back(thread);
+	}
+	Wipe_Thread(&wipe);
+	for (size_t i = 0; i < started.size(); i++)
+		pthread_join(started[i], NULL);
+
+	// Subfolders before the folders they are in
+	sort(wipe.deferred.begin(), wipe.deferred.end(), Longer_Path);
+	for (size_t i = 0; i < wipe.deferred.size(); i++) {
+		if (rmdir(wipe.deferred[i].c_str()) != 0) {
+			LOGINFO("Unable to removeDir '%s': %s\n", wipe.deferred[i].c_str(), strerror(errno));
+			wipe.failed = true;
+		} else {
+			wipe.removed++;
+		}
+	}
+	if (!wipe.failed && !skipParent) {
+		if (rmdir(Root.c_str()) != 0) {
+			LOGINFO("Unable to removeDir '%s': %s\n", Root.c_str(), strerror(errno));
+			wipe.failed = true;
+		}
+	}
+
+	timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	removed = wipe.removed;
+	LOGINFO("Removed %llu entries from '%s' in %i ms\n", removed, Root.c_str(), TWFunc::timespec_diff_ms(wipe.start, end));
+	pthread_cond_destroy(&wipe.cond);
+	pthread_mutex_destroy(&wipe.lock);
+	return wipe.failed ? -1 : 0;
+}
+
+void* twrpWipe::Wipe_Thread(void* cookie) {
+	Wipe* wipe = (Wipe*) cookie;
+
+	pthread_mutex_lock(&wipe->lock);
+	for (;;) {
+		if (!wipe->queue.empty()) {
+			string Path = wipe->queue.front();
+			wipe->queue.pop_front();
+			wipe->busy++;
+			pthread_mutex_unlock(&wipe->lock);
+			int ret;
+			if (Path == wipe->root)
+				ret = wipe->wipe->Remove_Dir(AT_FDCWD, Path.c_str(), Path, wipe, true);
+			else
+				ret = wipe->wipe->Remove_Subdir(AT_FDCWD, Path.c_str(), Path, wipe);
+			pthread_mutex_lock(&wipe->lock);
+			if (ret != 0)
+				wipe->failed = true;
+			wipe->busy--;
+			continue;
+		}
+		if (wipe->busy == 0)
+			break;
+		wipe->idle++;
+		pthread_cond_wait(&wipe->cond, &wipe->lock);
+		wipe->idle--;
+	}
+	pthread_cond_broadcast(&wipe->cond);
+	pthread_mutex_unlock(&wipe->lock);
+	return NULL;
+}
+
+void twrpWipe::Update_Progress(Wipe* wipe) {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&wipe->lock);
+	if (TWFunc::timespec_diff_ms(wipe->last_progress, now) >= WIPE_PROGRESS_MS) {
+		wipe->last_progress = now;
+		gui_print("Removed %llu files and folders from %s...\n", wipe->removed, wipe->root.c_str());
+	}
+	pthread_mutex_unlock(&wipe->lock);
+}
+
+// Empties the folder name in parentfd and removes it, unless another
+// thread is still removing a part of it
+int twrpWipe::Remove_Subdir(int parentfd, const char* name, const string& Path, Wipe* wipe) {
+	if (Remove_Dir(parentfd, name, Path, wipe, false) != 0)
+		return -1;
+	if (unlinkat(parentfd, name, AT_REMOVEDIR) == 0) {
+		if (__sync_add_and_fetch(&wipe->removed, 1) % WIPE_PROGRESS_ENTRIES == 0)
+			Update_Progress(wipe);
+		return 0;
+	}
+	if (errno == ENOTEMPTY || errno == EEXIST) {
+		pthread_mutex_lock(&wipe->lock);
+		wipe->deferred.push_back(Path);
+		pthread_mutex_unlock(&wipe->lock);
+		return 0;
+	}
+	LOGINFO("Unable to removeDir '%s': %s\n", Path.c_str(), strerror(errno));
+	return -1;
+}
+
+// Removes what is in the folder name in parentfd, Path is its full path
+int twrpWipe::Remove_Dir(int parentfd, const char* name, const string& Path, Wipe* wipe, bool top) {
+	int fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	DIR* d = fd < 0 ? NULL : fdopendir(fd);
+	if (d == NULL) {
+		LOGERR("Error opening '%s'\n", Path.c_str());
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	int ret = 0;
+	struct dirent* de;
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (top && skip.find(de->d_name) != skip.end())
+			continue;
+		string FullPath = Path;
+		if (FullPath != "/")
+			FullPath += "/";
+		FullPath += de->d_name;
+
+		bool is_dir = de->d_type == DT_DIR;
+		if (de->d_type == DT_UNKNOWN) {
+			struct stat st;
+			is_dir = fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+		}
+		if (is_dir) {
+			// Hand the folder to an idle thread if there is one
+			bool queued = false;
+			pthread_mutex_lock(&wipe->lock);
+			if ((size_t)wipe->idle > wipe->queue.size()) {
+				wipe->queue.push_back(FullPath);
+				pthread_cond_signal(&wipe->cond);
+				queued = true;
+			}
+			pthread_mutex_unlock(&wipe->lock);
+			if (!queued && Remove_Subdir(fd, de->d_name, FullPath, wipe) != 0)
+				ret = -1;
+		} else if (unlinkat(fd, de->d_name, 0) == 0) {
+			if (__sync_add_and_fetch(&wipe->removed, 1) % WIPE_PROGRESS_ENTRIES == 0)
+				Update_Progress(wipe);
+		} else {
+			LOGINFO("Unable to unlink '%s': %s\n", FullPath.c_str(), strerror(errno));
+			ret = -1;
+		}
+	}
+	closedir(d);
+	return ret;
+}
@@ -0,0 +1,48 @@
+/*
+	Copyright 2014 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TWRPWIPE_HPP
+#define TWRPWIPE_HPP
+
+#include <string>
+#include <set>
+
+using namespace std;
+
+// Removes folder trees with unlinkat relative to the open folder. Folders
+// are handed to idle threads while they are walked, the same way twrpDU
+// walks them, and the number of removed entries is shown while it runs.
+class twrpWipe {
+public:
+	twrpWipe();
+	void add_skip(const string& name);                                         // Entry directly in the folder that is kept, like media in /data
+	int removeDir(const string& Path, bool skipParent);                        // Removes everything in Path, and Path itself unless skipParent
+	unsigned long long get_removed(void);                                      // Entries removed by the last removeDir
+
+private:
+	struct Wipe;
+	int Remove_Dir(int parentfd, const char* name, const string& Path, Wipe* wipe, bool top);
+	int Remove_Subdir(int parentfd, const char* name, const string& Path, Wipe* wipe);
+	static void* Wipe_Thread(void* cookie);
+	static void Update_Progress(Wipe* wipe);
+
+	set<string> skip;
+	unsigned long long removed;
+};
+
+#endif
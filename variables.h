@@ -82,6 +82,7 @@
 #define TW_FORCE_MD5_CHECK_VAR      "tw_force_md5_check"
 #define TW_SKIP_MD5_CHECK_VAR       "tw_skip_md5_check"
 #define TW_SKIP_MD5_GENERATE_VAR    "tw_skip_md5_generate"
+#define TW_FAST_FORMAT_VAR          "tw_fast_format"
 #define TW_SIGNED_ZIP_VERIFY_VAR    "tw_signed_zip_verify"
 #define TW_REBOOT_AFTER_FLASH_VAR   "tw_reboot_after_flash_option"
 #define TW_TIME_ZONE_VAR            "tw_time_zone"